@@ -15,6 +15,7 @@ SRC_DIR := src/
 BIN_DIR := bin/
 BUILD_DIR := build/
 TEST_DIR := test/
+TOOL_DIR := tool/
 
 SRC := \
   $(wildcard $(SRC_DIR)*.cc) \
@@ -23,12 +24,21 @@ SRC := \
 OBJ := $(subst $(SRC_DIR),$(BUILD_DIR),$(SRC:.cc=.o))
 OBJ := $(subst $(TEST_DIR),$(BUILD_DIR),$(OBJ))
 
-DEP := $(OBJ:.o=.d)
+TOOL_SRC := \
+  $(wildcard $(SRC_DIR)*.cc) \
+  $(wildcard $(TOOL_DIR)*.cc)
+
+TOOL_BUILD_DIR := $(BUILD_DIR)tool/
+
+TOOL_OBJ := $(patsubst $(SRC_DIR)%,$(TOOL_BUILD_DIR)%,$(TOOL_SRC:.cc=.o))
+TOOL_OBJ := $(patsubst $(TOOL_DIR)%,$(TOOL_BUILD_DIR)%,$(TOOL_OBJ))
+
+DEP := $(OBJ:.o=.d) $(TOOL_OBJ:.o=.d)
 
 CXX := /usr/bin/clang++
-CXX_FLAGS := -std=gnu++17 -Wpedantic -Wall -Wextra -Og
+CXX_FLAGS := -std=gnu++17 -Wpedantic -Wall -Wextra -Og -pthread
 
-LD_LIBS := -lyf
+LD_LIBS := -lyf -lrt
 LD_FLAGS := \
   -iquote $(INCLUDE_DIR) \
   -iquote $(SRC_DIR)
@@ -37,19 +47,23 @@ PP := $(CXX) -E
 PP_FLAGS := -D FONT_DEVEL
 
 OUT := $(BIN_DIR)Devel
+TOOL_OUT := $(BIN_DIR)fontc
 
 devel: $(OBJ)
 	$(CXX) $(CXX_FLAGS) $(LD_FLAGS) $^ $(LD_LIBS) -o $(OUT)
 
+fontc: $(TOOL_OBJ)
+	$(CXX) $(CXX_FLAGS) $(LD_FLAGS) $^ -lrt -o $(TOOL_OUT)
+
 -include $(DEP)
 
 .PHONY: clean-out
 clean-out:
-	rm -f $(OUT)
+	rm -f $(OUT) $(TOOL_OUT)
 
 .PHONY: clean-obj
 clean-obj:
-	rm -f $(OBJ)
+	rm -f $(OBJ) $(TOOL_OBJ)
 
 .PHONY: clean-dep
 clean-dep:
@@ -69,3 +83,19 @@ $(BUILD_DIR)%.d: $(SRC_DIR)%.cc
 
 $(BUILD_DIR)%.d: $(TEST_DIR)%.cc
 	@$(PP) $(LD_FLAGS) $(PP_FLAGS) $< -MM -MT $(@:.d=.o) > $@
+
+$(TOOL_BUILD_DIR)%.o: $(SRC_DIR)%.cc
+	@mkdir -p $(TOOL_BUILD_DIR)
+	$(CXX) $(CXX_FLAGS) $(LD_FLAGS) -c $< -o $@
+
+$(TOOL_BUILD_DIR)%.o: $(TOOL_DIR)%.cc
+	@mkdir -p $(TOOL_BUILD_DIR)
+	$(CXX) $(CXX_FLAGS) $(LD_FLAGS) -c $< -o $@
+
+$(TOOL_BUILD_DIR)%.d: $(SRC_DIR)%.cc
+	@mkdir -p $(TOOL_BUILD_DIR)
+	@$(PP) $(LD_FLAGS) $< -MM -MT $(@:.d=.o) > $@
+
+$(TOOL_BUILD_DIR)%.d: $(TOOL_DIR)%.cc
+	@mkdir -p $(TOOL_BUILD_DIR)
+	@$(PP) $(LD_FLAGS) $< -MM -MT $(@:.d=.o) > $@
@@ -9,9 +9,133 @@
 #define FONT_FONT_H
 
 #include <string>
+#include <vector>
 #include <memory>
+#include <memory_resource>
 #include <cstdint>
 
+/// Pixel formats of glyph bitmaps.
+///
+enum class PixelFmt : uint8_t {
+  A8,      // 8-bit coverage
+  A1,      // 1-bit coverage, MSB first, rows padded to whole bytes
+  A8Gamma, // 8-bit coverage mapped through a gamma curve
+  RGBA8    // premultiplied white
+};
+
+/// Blending of overlapping glyphs in text runs.
+///
+enum class Blend : uint8_t {
+  Max, // keep the highest coverage
+  Add  // saturated sum of coverages
+};
+
+/// Rectangle of pixels, relative to the pen position (maxima excluded).
+///
+struct Rect {
+  int16_t xMin, yMin, xMax, yMax;
+};
+
+/// Glyph rendering options.
+///
+struct RenderOpts {
+  PixelFmt format = PixelFmt::A8;
+  float gamma = 2.2f; // PixelFmt::A8Gamma only
+  Blend blend = Blend::Max; // text runs only
+  // only pixels inside 'clip' are rendered, and the bitmap is cropped to
+  // them (e.g. to render a large glyph one tile at a time)
+  Rect clip = {INT16_MIN, INT16_MIN, INT16_MAX, INT16_MAX};
+  // large bitmaps are rasterized on several threads (which 'scratchMem'
+  // must then support)
+  bool parallel = false;
+  // glyphs whose size (points times dpi) is within this fraction of a
+  // size rendered before are resampled from that bitmap, instead of being
+  // rasterized - see 'Glyph::error' (up to 16 MiB of bitmaps are kept per
+  // font, the oldest dropped first, and glyphs shared through 'setCache'
+  // are cached apart from rasterized ones, and report no error)
+  float tolerance = 0.0f;
+  // synthetic bold: outlines are widened by this fraction of the em (e.g.
+  // 0.04), half on each side - text runs advance by as much more
+  float embolden = 0.0f;
+  // synthetic oblique: outlines are sheared right by this much per unit
+  // of height (e.g. 0.2 for about 11 degrees)
+  float slant = 0.0f;
+};
+
+/// Glyph metrics, in pixels.
+///
+struct Metrics {
+  float advance;
+  float lsb; // left side bearing
+  float rsb; // right side bearing
+  float xMin, yMin, xMax, yMax; // bounds relative to the pen position
+};
+
+/// Estimated bytes held by a font, per structure.
+///
+struct MemoryUsage {
+  size_t cmap;       // character to glyph mapping
+  size_t outlines;   // 'loca' and 'glyf' tables
+  size_t metrics;    // advances and side bearings
+  size_t kerning;    // kerning pairs and classes
+  size_t compounds;  // flattened compound glyphs
+  size_t sized;      // bitmaps kept for resampling
+  size_t variations; // glyph variations and instanced glyphs
+  size_t mapped;     // mapping of a compiled font (read from the file)
+  size_t total;
+};
+
+/// Design axis of a variable font.
+///
+struct Axis {
+  uint32_t tag; // e.g. 'wght', first character in the high byte
+  float min, def, max;
+};
+
+/// Position of a variable font along one of its axes.
+///
+struct Variation {
+  uint32_t tag;
+  float value; // in design units (e.g. 700 for 'wght')
+};
+
+/// Memory released by 'Font::trim' - each level includes the previous.
+///
+enum class TrimLevel : uint8_t {
+  Caches, // flattened compound and instanced glyphs, and bitmaps kept for
+          // resampling
+  Tables  // decoded tables, which are decoded again when next used
+};
+
+/// Vertex of a glyph mesh.
+///
+struct MeshVertex {
+  float x, y; // position, in ems
+  float u, v; // curve coordinates - the vertex is inside where u*u < v
+};
+
+/// Triangle mesh of a glyph outline, for rendering at any scale.
+///
+/// Triangles are listed three vertices at a time, and must be drawn with
+/// the nonzero rule: every fragment inside a triangle, and inside its
+/// curve (u*u < v), adds one to the winding if the triangle is
+/// counterclockwise and subtracts one otherwise (e.g. into a stencil
+/// buffer). Pixels whose winding ends up nonzero are covered.
+///
+struct Mesh {
+  std::vector<MeshVertex> vertices;
+  float xMin, yMin, xMax, yMax; // bounds relative to the pen position
+  // reference evaluation of the winding rule at a point, in ems
+  bool contains(float x, float y) const;
+};
+
+/// Character that a font does not map, found while mapping text.
+///
+struct Unmapped {
+  size_t pos;   // position in the glyph indices
+  char32_t chr; // code point
+};
+
 class Glyph {
  public:
   Glyph();
@@ -20,19 +144,180 @@ class Glyph {
   Glyph& operator=(const Glyph&) = delete;
   virtual std::pair<uint16_t, uint16_t> extent() const = 0;
   virtual const uint8_t* data() const = 0;
+  virtual PixelFmt format() const = 0;
+  virtual uint32_t pitch() const = 0;
+  // offset of the first row's first pixel from the pen position - rows
+  // are stored bottom-up
+  virtual std::pair<int16_t, int16_t> bearing() const = 0;
+  // estimate of how far an edge may be from where rasterizing would place
+  // it, in pixels (half a source sample, not a strict bound, since the
+  // filter itself may move edges a little more) - zero unless resampled
+  // from another size
+  virtual float error() const;
+};
+
+// compact copy of a glyph bitmap for long-lived caches - each row is
+// stored as runs of empty and fully covered pixels, plus literal edges
+class PackedGlyph {
+ public:
+  explicit PackedGlyph(const Glyph& glyph);
+  ~PackedGlyph();
+  std::pair<uint16_t, uint16_t> extent() const;
+  PixelFmt format() const;
+  uint32_t pitch() const;
+  std::pair<int16_t, int16_t> bearing() const;
+  // bytes held by the packed rows
+  size_t size() const;
+  // writes the bitmap to 'dst', whose rows are 'dstPitch' bytes apart (so
+  // a glyph can be unpacked straight into an atlas)
+  void unpack(uint8_t* dst, uint32_t dstPitch) const;
+  // unpacks into a new glyph, whose bitmap is allocated from 'mem' (null
+  // for the default resource)
+  std::unique_ptr<Glyph> unpack(std::pmr::memory_resource* mem = nullptr)
+    const;
+
+ private:
+  std::pair<uint16_t, uint16_t> _extent;
+  PixelFmt _format;
+  uint32_t _pitch;
+  std::pair<int16_t, int16_t> _bearing;
+  bool _packed;
+  std::vector<uint8_t> _rows;
+};
+
+class ShmCache;
+
+class SharedCache {
+ public:
+  // opens the POSIX shared memory object 'name' (e.g. "/font-cache"),
+  // creating it with 'size' bytes if it does not exist - glyphs are only
+  // ever added, so the object must be unlinked to empty the cache
+  // an object that another process never finished creating is replaced,
+  // and if the object cannot be opened at all, fonts that use the cache
+  // render without it
+  // 'packed' stores bitmaps as in 'PackedGlyph', at the cost of unpacking
+  // on every hit
+  explicit SharedCache(const std::string& name, size_t size = 64 << 20,
+                       bool packed = false);
+  ~SharedCache();
+  SharedCache(const SharedCache&) = delete;
+  SharedCache& operator=(const SharedCache&) = delete;
+  static void unlink(const std::string& name);
+
+ private:
+  friend class Font;
+  std::unique_ptr<ShmCache> _cache;
 };
 
 class Font {
  public:
-  explicit Font(const std::string& pathname);
+  // decoded tables are allocated from 'fontMem', and per-call temporaries
+  // and glyph bitmaps from 'scratchMem' (null for the default resource) -
+  // both must outlive the font and its glyphs, and be safe to use from
+  // every thread that uses the font
+  // 'pathname' is either a TrueType font or a font written by 'compile'
+  explicit Font(const std::string& pathname, bool verify = false,
+                std::pmr::memory_resource* fontMem = nullptr,
+                std::pmr::memory_resource* scratchMem = nullptr);
   ~Font();
   Font(const Font&) = delete;
   Font& operator=(const Font&) = delete;
-  std::unique_ptr<Glyph> getGlyph(wchar_t chr, uint16_t pts, uint16_t dpi = 72);
+  std::unique_ptr<Glyph> getGlyph(wchar_t chr, uint16_t pts, uint16_t dpi = 72,
+                                  const RenderOpts& opts = {});
+  // renders one glyph at each size in 'pts', optionally on several threads
+  // (which 'scratchMem' must then support)
+  std::vector<std::unique_ptr<Glyph>> getGlyphs(
+    wchar_t chr, const std::vector<uint16_t>& pts, uint16_t dpi = 72,
+    const RenderOpts& opts = {}, bool parallel = false);
+  std::unique_ptr<Glyph> getIndexGlyph(uint16_t index, uint16_t pts,
+                                       uint16_t dpi = 72,
+                                       const RenderOpts& opts = {});
+  // composites a string laid out on one line into a single bitmap - runs
+  // larger than 65535 pixels either way come back empty, and must be split
+  // into shorter runs
+  std::unique_ptr<Glyph> renderRun(const std::wstring& str, uint16_t pts,
+                                   uint16_t dpi = 72,
+                                   const RenderOpts& opts = {});
+  uint16_t getIndex(wchar_t chr);
+  // maps UTF-8 or UTF-16 text to glyph indices, one per code point, into
+  // 'indices' (which must have room for one per code unit) and returns
+  // their number - characters mapped to index zero are appended to
+  // 'missing', if given (invalid sequences map to U+FFFD)
+  size_t mapText(const char* text, size_t len, uint16_t* indices,
+                 std::vector<Unmapped>* missing = nullptr);
+  size_t mapText(const char16_t* text, size_t len, uint16_t* indices,
+                 std::vector<Unmapped>* missing = nullptr);
+  Mesh getMesh(wchar_t chr);
+  Mesh getIndexMesh(uint16_t index);
+  Metrics getMetrics(wchar_t chr, uint16_t pts, uint16_t dpi = 72);
+  Metrics getIndexMetrics(uint16_t index, uint16_t pts, uint16_t dpi = 72);
+  Metrics measure(const std::wstring& str, uint16_t pts, uint16_t dpi = 72);
+  void getKerning(const uint16_t* indices, size_t n, float* adjs,
+                  uint16_t pts, uint16_t dpi = 72);
+  // looks glyphs up in 'cache' before rendering them, and adds the ones
+  // rendered (null disables caching) - the cache must outlive the font
+  // and its glyphs, and must not be changed while rendering
+  void setCache(SharedCache* cache);
+  // design axes of a variable font (empty for other fonts)
+  std::vector<Axis> axes();
+  // selects the instance of a variable font that glyphs, metrics and
+  // 'compile' use - axes not given are at their default, and values are
+  // clamped to each axis (must not be called while the font is in use by
+  // other threads)
+  void setVariation(const std::vector<Variation>& variations);
+  MemoryUsage memoryUsage();
+  // releases memory that is rebuilt on demand - must not be called while
+  // the font is in use by other threads (glyphs already rendered stay
+  // valid), and only returns memory to 'fontMem', whose resource decides
+  // whether it is reused or freed
+  void trim(TrimLevel level);
+  // writes the font with every table decoded, in a format that loads
+  // without parsing (by mapping the file) and renders the same glyphs -
+  // compiled fonts are little-endian, and load on hosts of either order
+  void compile(const std::string& pathname);
 
  private:
+  friend class FontSet;
   class Impl;
   std::unique_ptr<Impl> _impl;
 };
 
+class FontSet {
+ public:
+  // loads a fallback chain of fonts - each character is rendered by the
+  // first font that maps it, looked up in one table built here (code
+  // points past U+FFFF are never mapped), each as 'Font' with 'verify',
+  // 'fontMem' and 'scratchMem'
+  explicit FontSet(const std::vector<std::string>& pathnames,
+                   bool verify = false,
+                   std::pmr::memory_resource* fontMem = nullptr,
+                   std::pmr::memory_resource* scratchMem = nullptr);
+  ~FontSet();
+  FontSet(const FontSet&) = delete;
+  FontSet& operator=(const FontSet&) = delete;
+  size_t size() const;
+  Font& font(size_t i);
+  // position of the font that renders 'chr' (zero if no font maps it)
+  uint8_t select(char32_t chr) const;
+  // as 'Font::mapText', also writing the position of each glyph's font
+  // into 'fonts'
+  size_t mapText(const char* text, size_t len, uint16_t* indices,
+                 uint8_t* fonts, std::vector<Unmapped>* missing = nullptr);
+  size_t mapText(const char16_t* text, size_t len, uint16_t* indices,
+                 uint8_t* fonts, std::vector<Unmapped>* missing = nullptr);
+  std::unique_ptr<Glyph> getGlyph(wchar_t chr, uint16_t pts, uint16_t dpi = 72,
+                                  const RenderOpts& opts = {});
+
+ private:
+  template<class T>
+  size_t map(const T* text, size_t len, uint16_t* indices, uint8_t* fonts,
+             std::vector<Unmapped>* missing);
+
+  std::vector<std::unique_ptr<Font>> _fonts;
+  // font position and glyph index of each code point up to U+FFFF (zero
+  // if unmapped)
+  std::vector<uint8_t> _faces;
+  std::vector<uint16_t> _indices;
+};
+
 #endif // FONT_FONT_H
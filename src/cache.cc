@@ -0,0 +1,372 @@
+//
+// Font
+// cache.cc
+//
+// Copyright (C) 2020 Gustavo C. Viegas.
+//
+
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <memory_resource>
+#include <algorithm>
+#include <cstring>
+#include <cstdlib>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "kernels.h"
+
+static_assert(std::atomic<uint32_t>::is_always_lock_free &&
+              std::atomic<uint64_t>::is_always_lock_free,
+              "!is_always_lock_free");
+
+namespace {
+
+/// Segment identification.
+///
+constexpr uint64_t Magic = 0x3130656863614346; // "FCache01"
+
+/// Length of a slab, and of the smallest record.
+///
+constexpr uint32_t SlabLen = 1 << 16;
+constexpr uint32_t MinRecord = 64;
+
+/// Number of record size classes (64 bytes to a whole slab).
+///
+constexpr uint32_t ClassN = 11;
+
+/// Smallest segment, and segment bytes per index slot.
+///
+constexpr size_t MinSize = 1 << 20;
+constexpr size_t BytesPerSlot = 256;
+
+/// How long to wait for another process to set a segment up.
+///
+constexpr auto SetupWait = std::chrono::seconds(1);
+
+/// Slots visited before giving up on a lookup.
+///
+constexpr uint32_t MaxProbe = 64;
+
+/// Reference of a slot whose glyph could not be stored.
+///
+constexpr uint64_t NoRef = ~0ULL;
+
+/// Glyph whose bitmap lives in the shared segment, or in a private copy
+/// when the record is packed.
+///
+class CachedGlyph : public Glyph {
+ public:
+  CachedGlyph(std::pair<uint16_t, uint16_t> extent, const uint8_t* data,
+              PixelFmt format, uint32_t pitch,
+              std::pair<int16_t, int16_t> bearing,
+              std::pmr::vector<uint8_t>&& copy) :
+    _extent(extent), _data(data), _format(format), _pitch(pitch),
+    _bearing(bearing), _copy(std::move(copy)) {}
+
+  std::pair<uint16_t, uint16_t> extent() const {
+    return _extent;
+  }
+  const uint8_t* data() const {
+    return _copy.empty() ? _data : _copy.data();
+  }
+  PixelFmt format() const {
+    return _format;
+  }
+  uint32_t pitch() const {
+    return _pitch;
+  }
+  std::pair<int16_t, int16_t> bearing() const {
+    return _bearing;
+  }
+
+ private:
+  std::pair<uint16_t, uint16_t> _extent;
+  const uint8_t* _data;
+  PixelFmt _format;
+  uint32_t _pitch;
+  std::pair<int16_t, int16_t> _bearing;
+  std::pmr::vector<uint8_t> _copy;
+};
+
+} // ns
+
+/// Segment header.
+///
+/// 'state' goes from zero (as created) to one while the creator sets the
+/// layout up, and then to two.
+///
+struct ShmCache::Header {
+  uint64_t magic;
+  std::atomic<uint32_t> state;
+  uint32_t slotN;
+  uint32_t slabN;
+  std::atomic<uint32_t> nextSlab;
+  uint64_t size;
+  uint64_t storeOff;
+  std::atomic<uint64_t> cur[ClassN]; // slab+1 << 32 | bytes used
+};
+
+/// Index slot.
+///
+/// 'key' is claimed first - 'ref' is zero until the record is written.
+///
+struct ShmCache::Slot {
+  std::atomic<uint64_t> key;
+  std::atomic<uint64_t> ref;
+};
+
+/// Stored glyph, followed by its bitmap (packed rows if 'packed').
+///
+struct ShmCache::Record {
+  uint64_t font;
+  uint32_t size;
+  uint32_t mode;
+  uint16_t index;
+  uint16_t w, h;
+  int16_t left, bottom;
+  uint8_t format;
+  uint8_t packed;
+  uint32_t pitch;
+  uint32_t len;
+  uint32_t pad;
+};
+
+ShmCache::ShmCache(const std::string& name, size_t size, bool packed)
+  : _base(nullptr), _size(0), _packed(packed), _hdr(nullptr),
+    _slots(nullptr) {
+  size = std::max(size, MinSize);
+
+  // a segment left unset (e.g. by a creator that died) is replaced once
+  if (open(name, size) == Stale) {
+    shm_unlink(name.c_str());
+    open(name, size);
+  }
+}
+
+ShmCache::Open ShmCache::open(const std::string& name, size_t size) {
+  // only the process that creates the segment sizes it
+  bool creator = true;
+  int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  if (fd == -1) {
+    creator = false;
+    fd = shm_open(name.c_str(), O_RDWR, 0600);
+  }
+  if (fd == -1)
+    return Failed;
+
+  const auto deadline = std::chrono::steady_clock::now() + SetupWait;
+  struct stat st;
+  if (creator) {
+    if (ftruncate(fd, size) == -1) {
+      close(fd);
+      return Failed;
+    }
+  } else {
+    for (;;) {
+      if (fstat(fd, &st) == -1) {
+        close(fd);
+        return Failed;
+      }
+      if (st.st_size != 0)
+        break;
+      if (std::chrono::steady_clock::now() > deadline) {
+        close(fd);
+        return Stale;
+      }
+      std::this_thread::yield();
+    }
+    size = st.st_size;
+  }
+
+  void* base = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  close(fd);
+  if (base == MAP_FAILED)
+    return Failed;
+  const auto hdr = reinterpret_cast<Header*>(base);
+
+  uint32_t state = 0;
+  if (hdr->state.compare_exchange_strong(state, 1)) {
+    uint32_t slotN = 1;
+    while (slotN*2 <= size / BytesPerSlot)
+      slotN *= 2;
+    const uint64_t slotOff = (sizeof(Header) + 63) & ~63;
+    const uint64_t storeOff = (slotOff + slotN*sizeof(Slot) + 63) & ~63;
+    hdr->magic = Magic;
+    hdr->slotN = slotN;
+    hdr->slabN = (size - storeOff) / SlabLen;
+    hdr->size = size;
+    hdr->storeOff = storeOff;
+    hdr->state.store(2, std::memory_order_release);
+  } else {
+    while (hdr->state.load(std::memory_order_acquire) != 2) {
+      if (std::chrono::steady_clock::now() > deadline) {
+        munmap(base, size);
+        return Stale;
+      }
+      std::this_thread::yield();
+    }
+  }
+
+  if (hdr->magic != Magic || hdr->size != size) {
+    munmap(base, size);
+    return Failed;
+  }
+  _base = static_cast<uint8_t*>(base);
+  _size = size;
+  _hdr = hdr;
+  _slots = reinterpret_cast<Slot*>(_base + ((sizeof(Header) + 63) & ~63));
+  return Opened;
+}
+
+ShmCache::~ShmCache() {
+  if (_base)
+    munmap(_base, _size);
+}
+
+std::unique_ptr<Glyph> ShmCache::get(const Key& key,
+                                     std::pmr::memory_resource* mem) const {
+  const uint64_t h = hash(key);
+  const uint32_t mask = _hdr->slotN - 1;
+
+  for (uint32_t i = 0; i < MaxProbe; ++i) {
+    const Slot& slot = _slots[(h+i) & mask];
+    const uint64_t k = slot.key.load(std::memory_order_acquire);
+    if (k == 0)
+      return nullptr;
+    if (k != h)
+      continue;
+    const uint64_t ref = slot.ref.load(std::memory_order_acquire);
+    if (ref == 0 || ref == NoRef)
+      return nullptr;
+    const auto rec = reinterpret_cast<const Record*>(_base + ref);
+    if (rec->font != key.font || rec->size != key.size ||
+        rec->mode != key.mode || rec->index != key.index)
+    { continue; }
+    const auto data = reinterpret_cast<const uint8_t*>(rec+1);
+    std::pmr::vector<uint8_t> copy(mem);
+    if (rec->packed) {
+      copy.resize(size_t(rec->pitch)*rec->h);
+      kernels::get().unpack(data, rec->len, copy.data(), rec->pitch, rec->h,
+                            rec->pitch);
+    }
+    return std::unique_ptr<Glyph>{
+      new CachedGlyph{{rec->w, rec->h}, data,
+                      static_cast<PixelFmt>(rec->format), rec->pitch,
+                      {rec->left, rec->bottom}, std::move(copy)}};
+  }
+  return nullptr;
+}
+
+void ShmCache::put(const Key& key, const Glyph& glyph,
+                   std::pmr::memory_resource* mem) {
+  const uint64_t h = hash(key);
+  const uint32_t mask = _hdr->slotN - 1;
+
+  for (uint32_t i = 0; i < MaxProbe; ++i) {
+    Slot& slot = _slots[(h+i) & mask];
+    uint64_t k = slot.key.load(std::memory_order_acquire);
+    if (k != 0 || !slot.key.compare_exchange_strong(k, h)) {
+      if (k == h)
+        // cached, being cached, or a colliding key
+        return;
+      continue;
+    }
+
+    const auto ext = glyph.extent();
+    const uint32_t pitch = glyph.pitch();
+    const uint8_t* data = glyph.data();
+    uint32_t len = pitch * ext.second;
+    std::pmr::vector<uint8_t> rows(mem);
+    bool packed = false;
+    if (_packed) {
+      // kept as is if packing does not pay off
+      rows.resize(kernels::packBound(pitch, ext.second));
+      const uint32_t packLen = kernels::pack(data, pitch, ext.second, pitch,
+                                             rows.data());
+      if (packLen < len) {
+        data = rows.data();
+        len = packLen;
+        packed = true;
+      }
+    }
+
+    const uint64_t off = alloc(sizeof(Record) + len);
+    if (off == 0) {
+      slot.ref.store(NoRef, std::memory_order_release);
+      return;
+    }
+    const auto rec = reinterpret_cast<Record*>(_base + off);
+    const auto bearing = glyph.bearing();
+    *rec = {key.font, key.size, key.mode, key.index, ext.first, ext.second,
+            bearing.first, bearing.second,
+            static_cast<uint8_t>(glyph.format()), packed, pitch, len, 0};
+    if (len != 0)
+      std::memcpy(rec+1, data, len);
+    slot.ref.store(off, std::memory_order_release);
+    return;
+  }
+}
+
+uint64_t ShmCache::hash(const Key& key) {
+  auto mix = [](uint64_t x) {
+    x ^= x >> 30;
+    x *= 0xBF58476D1CE4E5B9;
+    x ^= x >> 27;
+    x *= 0x94D049BB133111EB;
+    return x ^ (x >> 31);
+  };
+  const uint64_t opts = (uint64_t(key.size) << 32) | key.mode;
+  const uint64_t h = mix(key.font ^ mix(opts ^ (uint64_t(key.index) << 48)));
+  return h != 0 ? h : 1;
+}
+
+uint64_t ShmCache::alloc(uint32_t len) {
+  uint32_t cls = 0;
+  while (cls < ClassN && (MinRecord << cls) < len)
+    ++cls;
+  if (cls == ClassN)
+    return 0;
+  const uint32_t recLen = MinRecord << cls;
+
+  auto& cur = _hdr->cur[cls];
+  uint64_t old = cur.load(std::memory_order_acquire);
+  for (;;) {
+    const uint32_t slab = old >> 32;
+    const uint32_t used = old & 0xFFFFFFFF;
+    if (slab != 0 && used+recLen <= SlabLen) {
+      if (cur.compare_exchange_weak(old, old+recLen))
+        return _hdr->storeOff + uint64_t(slab-1)*SlabLen + used;
+      continue;
+    }
+
+    // current slab of this class is full - take a new one
+    if (_hdr->nextSlab.load(std::memory_order_relaxed) >= _hdr->slabN)
+      return 0;
+    const uint32_t next = _hdr->nextSlab.fetch_add(1);
+    if (next >= _hdr->slabN)
+      return 0;
+    if (cur.compare_exchange_strong(old, (uint64_t(next+1) << 32) | recLen))
+      return _hdr->storeOff + uint64_t(next)*SlabLen;
+    // XXX: Another process took a slab first, so this one is left unused.
+  }
+}
+
+SharedCache::SharedCache(const std::string& name, size_t size, bool packed)
+  : _cache(new ShmCache{name, size, packed}) {
+
+  // fonts render without a cache that could not be opened
+  if (!_cache->opened())
+    _cache.reset();
+}
+SharedCache::~SharedCache() {}
+
+void SharedCache::unlink(const std::string& name) {
+  shm_unlink(name.c_str());
+}
@@ -0,0 +1,104 @@
+//
+// Font
+// cache.h
+//
+// Copyright (C) 2020 Gustavo C. Viegas.
+//
+
+#ifndef FONT_CACHE_H
+#define FONT_CACHE_H
+
+#include <string>
+#include <memory>
+#include <memory_resource>
+#include <cstdint>
+
+#include "font.h"
+
+/// Shared memory segment holding rendered glyphs.
+///
+/// The segment starts with a header, followed by an open-addressing index
+/// and a store of fixed-size slabs. Each slab is handed to one size class
+/// of records, which are allocated from it by bumping an offset. Slots and
+/// slabs are claimed with atomic operations only, so any number of
+/// processes can use the segment at once.
+///
+/// Records are never freed - once the store is exhausted, new glyphs are
+/// not cached.
+///
+class ShmCache {
+ public:
+  /// Identity of a rendered glyph.
+  ///
+  struct Key {
+    uint64_t font;  // font fingerprint
+    uint32_t size;  // points times dpi
+    uint32_t mode;  // rendering options
+    uint16_t index; // glyph index
+  };
+
+  /// Bitmaps are stored packed (see 'kernels::packRow') if 'packed' is
+  /// set - records of either kind can be read.
+  ///
+  /// A segment that another process does not finish setting up within a
+  /// second is unlinked and created anew. Check 'opened' before use.
+  ///
+  ShmCache(const std::string& name, size_t size, bool packed);
+  ~ShmCache();
+  ShmCache(const ShmCache&) = delete;
+  ShmCache& operator=(const ShmCache&) = delete;
+
+  /// Whether the segment could be opened and set up.
+  ///
+  bool opened() const {
+    return _base;
+  }
+
+  /// Gets a cached glyph, whose bitmap stays in the segment.
+  ///
+  /// Packed bitmaps are unpacked into a copy allocated from 'mem'. Returns
+  /// null if the glyph is not cached (or is still being stored by another
+  /// process).
+  ///
+  std::unique_ptr<Glyph> get(const Key& key,
+                             std::pmr::memory_resource* mem) const;
+
+  /// Stores a copy of a glyph, unless already cached or out of space.
+  ///
+  /// Packing temporaries are allocated from 'mem'.
+  ///
+  void put(const Key& key, const Glyph& glyph,
+           std::pmr::memory_resource* mem);
+
+ private:
+  struct Header;
+  struct Slot;
+  struct Record;
+
+  /// Outcome of 'open'.
+  ///
+  enum Open { Opened, Failed, Stale };
+
+  /// Opens the segment, creating and setting it up if it does not exist.
+  ///
+  /// Returns 'Stale' if the segment was not set up in time.
+  ///
+  Open open(const std::string& name, size_t size);
+
+  /// Hashes a key into a non-zero value.
+  ///
+  static uint64_t hash(const Key& key);
+
+  /// Allocates a record from the store, returning its offset (zero if out
+  /// of space).
+  ///
+  uint64_t alloc(uint32_t len);
+
+  uint8_t* _base;
+  size_t _size;
+  bool _packed;
+  Header* _hdr;
+  Slot* _slots;
+};
+
+#endif // FONT_CACHE_H
@@ -7,12 +7,25 @@
 
 #include <cstdint>
 #include <cmath>
+#include <cstring>
 #include <fstream>
 #include <vector>
+#include <deque>
 #include <unordered_map>
+#include <memory_resource>
 #include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "font.h"
+#include "kernels.h"
+#include "cache.h"
 
 #ifdef FONT_DEVEL
 # include <iostream>
@@ -28,6 +41,18 @@ inline int16_t betoh(int16_t v) { return be16toh(v); }
 inline uint16_t betoh(uint16_t v) { return be16toh(v); }
 inline int32_t betoh(int32_t v) { return be32toh(v); }
 inline uint32_t betoh(uint32_t v) { return be32toh(v); }
+inline uint8_t htole(uint8_t v) { return v; }
+inline int16_t htole(int16_t v) { return htole16(v); }
+inline uint16_t htole(uint16_t v) { return htole16(v); }
+inline int32_t htole(int32_t v) { return htole32(v); }
+inline uint32_t htole(uint32_t v) { return htole32(v); }
+inline uint64_t htole(uint64_t v) { return htole64(v); }
+inline uint8_t letoh(uint8_t v) { return v; }
+inline int16_t letoh(int16_t v) { return le16toh(v); }
+inline uint16_t letoh(uint16_t v) { return le16toh(v); }
+inline int32_t letoh(int32_t v) { return le32toh(v); }
+inline uint32_t letoh(uint32_t v) { return le32toh(v); }
+inline uint64_t letoh(uint64_t v) { return le64toh(v); }
 #else
 // TODO
 # error "Invalid platform"
@@ -41,160 +66,1218 @@ constexpr uint32_t makeTag(char c1, char c2, char c3, char c4) {
   return c4 | (c3 << 8) | (c2 << 16) | (c1 << 24);
 }
 
+/// Coordinate formats of simple glyph flags.
+///
+struct FlagFmtTable {
+  uint8_t x[256];
+  uint8_t y[256];
+  constexpr FlagFmtTable() : x(), y() {
+    for (int f = 0; f < 256; ++f) {
+      // short vector (1 byte, sign given by the 'same' bit), same (0 bytes)
+      // or signed word (2 bytes)
+      if (f & 2)
+        x[f] = 1 | ((f & 16) ? kernels::CoordPos : 0);
+      else
+        x[f] = (f & 16) ? 0 : 2;
+      if (f & 4)
+        y[f] = 1 | ((f & 32) ? kernels::CoordPos : 0);
+      else
+        y[f] = (f & 32) ? 0 : 2;
+    }
+  }
+};
+constexpr FlagFmtTable FlagFmt;
+
+/// Code point of invalid sequences.
+///
+constexpr char32_t Replacement = 0xFFFD;
+
+/// Decodes the code point at 'text[i]', moving 'i' past it.
+///
+char32_t decode(const char* text, size_t len, size_t& i) {
+  const uint8_t lead = text[i++];
+  uint32_t n, min;
+  char32_t chr;
+  if (lead < 0x80)
+    return lead;
+  if ((lead & 0xE0) == 0xC0) {
+    n = 1;
+    min = 0x80;
+    chr = lead & 0x1F;
+  } else if ((lead & 0xF0) == 0xE0) {
+    n = 2;
+    min = 0x800;
+    chr = lead & 0x0F;
+  } else if ((lead & 0xF8) == 0xF0) {
+    n = 3;
+    min = 0x10000;
+    chr = lead & 0x07;
+  } else {
+    return Replacement;
+  }
+  // a sequence stops at the first byte that does not continue it
+  for (uint32_t k = 0; k < n; ++k) {
+    if (i == len || (text[i] & 0xC0) != 0x80)
+      return Replacement;
+    chr = chr << 6 | (text[i++] & 0x3F);
+  }
+  if (chr < min || chr > 0x10FFFF || (chr >= 0xD800 && chr <= 0xDFFF))
+    return Replacement;
+  return chr;
+}
+
+char32_t decode(const char16_t* text, size_t len, size_t& i) {
+  const char32_t unit = text[i++];
+  if (unit < 0xD800 || unit > 0xDFFF)
+    return unit;
+  if (unit > 0xDBFF || i == len || text[i] < 0xDC00 || text[i] > 0xDFFF)
+    return Replacement;
+  return 0x10000 + ((unit-0xD800) << 10) + (text[i++]-0xDC00);
+}
+
+/// Appends 'n' values to a buffer, in little-endian order.
+///
+template<class T>
+void append(std::vector<uint8_t>& buf, const T* src, size_t n) {
+  const size_t off = buf.size();
+  buf.resize(off + n*sizeof(T));
+  for (size_t i = 0; i < n; ++i) {
+    const T val = htole(src[i]);
+    std::memcpy(&buf[off + i*sizeof(T)], &val, sizeof(T));
+  }
+}
+
+/// Copies 'n' little-endian values out of a buffer of 'len' bytes, from
+/// 'off' onwards.
+///
+/// Returns false, leaving 'off' as is, if the buffer is too short.
+///
+template<class T>
+bool extract(const uint8_t* buf, size_t len, size_t& off, T* dst, size_t n) {
+  if (off > len || n*sizeof(T) > len-off)
+    return false;
+  if (n != 0)
+    std::memcpy(dst, buf+off, n*sizeof(T));
+  for (size_t i = 0; i < n; ++i)
+    dst[i] = letoh(dst[i]);
+  off += n*sizeof(T);
+  return true;
+}
+
+/// Reads a big-endian value at 'off', from a buffer of 'len' bytes.
+///
+/// Returns zero, clearing 'valid', if the value does not fit.
+///
+template<class T>
+T peek(const uint8_t* buf, size_t len, size_t off, bool& valid) {
+  static_assert(std::is_integral<T>(), "!is_integral");
+  if (off > len || sizeof(T) > len-off) {
+    valid = false;
+    return 0;
+  }
+  std::make_unsigned_t<T> val = 0;
+  for (size_t i = 0; i < sizeof(T); ++i)
+    val = (val << 8) | buf[off+i];
+  return static_cast<T>(val);
+}
+
+/// Rounds half up, as font tools do when applying variations.
+///
+inline int32_t otRound(double val) {
+  return static_cast<int32_t>(std::floor(val + 0.5));
+}
+
 /// Glyph.
 ///
+/// The bitmap is allocated from the given memory resource, which must
+/// outlive the glyph.
+///
 class SFNTGlyph : public Glyph {
  public:
-  SFNTGlyph(std::pair<uint16_t, uint16_t> extent, uint8_t* data) :
-    _extent(extent), _data(data) {}
+  SFNTGlyph(std::pair<uint16_t, uint16_t> extent, PixelFmt format,
+            uint32_t pitch, std::pair<int16_t, int16_t> bearing,
+            std::pmr::memory_resource* mem) :
+    _extent(extent), _format(format), _pitch(pitch), _bearing(bearing),
+    _mem(mem), _size(size_t(pitch)*extent.second),
+    _data(_size != 0 ? static_cast<uint8_t*>(mem->allocate(_size, 1)) :
+                       nullptr) {}
+
+  ~SFNTGlyph() {
+    if (_data)
+      _mem->deallocate(_data, _size, 1);
+  }
 
-  ~SFNTGlyph() {}
+  /// Gets the bitmap for writing.
+  ///
+  uint8_t* buffer() {
+    return _data;
+  }
 
   std::pair<uint16_t, uint16_t> extent() const {
     return _extent;
   }
 
   const uint8_t* data() const {
-    return _data.get();
+    return _data;
+  }
+
+  PixelFmt format() const {
+    return _format;
+  }
+
+  uint32_t pitch() const {
+    return _pitch;
+  }
+
+  std::pair<int16_t, int16_t> bearing() const {
+    return _bearing;
+  }
+
+  float error() const {
+    return _error;
+  }
+
+  /// Sets the error of a resampled bitmap.
+  ///
+  void setError(float error) {
+    _error = error;
   }
 
  private:
   std::pair<uint16_t, uint16_t> _extent;
-  std::unique_ptr<uint8_t[]> _data;
+  PixelFmt _format;
+  uint32_t _pitch;
+  std::pair<int16_t, int16_t> _bearing;
+  std::pmr::memory_resource* _mem;
+  size_t _size;
+  uint8_t* _data;
+  float _error = 0.0f;
+};
+
+/// Kerning pairs of a font, in FUnits.
+///
+/// Explicit pairs are kept in an open-addressing table keyed by the packed
+/// glyph pair, with a bitset of glyphs that start any pair to reject most
+/// lookups without probing. Class-based pairs keep, per subtable, the class
+/// of every glyph and a dense matrix of values.
+///
+class Kerning {
+ public:
+  explicit Kerning(std::pmr::memory_resource* mem) :
+    _pending(mem), _keys(mem), _values(mem), _lefts(mem), _classes(mem) {}
+
+  /// Adds an explicit pair, unless already present.
+  ///
+  void addPair(uint16_t left, uint16_t right, int16_t value) {
+    _pending.push_back({(uint32_t(left) << 16) | right, value});
+  }
+
+  /// Checks whether no pairs or classes were added.
+  ///
+  bool empty() const {
+    return _pending.empty() && _keys.empty() && _classes.empty();
+  }
+
+  /// Adds a class-based subtable.
+  ///
+  /// 'cls1' holds a class per glyph, or 'NoClass' if the subtable does not
+  /// apply to the glyph on the left. 'cls2' holds a class per glyph for the
+  /// glyph on the right, and 'values' a row of 'cls2N' values per class.
+  ///
+  void addClasses(const std::pmr::vector<uint16_t>& cls1,
+                  const std::pmr::vector<uint16_t>& cls2, uint16_t cls2N,
+                  const std::pmr::vector<int16_t>& values) {
+    const auto mem = _classes.get_allocator().resource();
+    _classes.push_back({{cls1, mem}, {cls2, mem}, cls2N, {values, mem}});
+  }
+
+  /// Builds the lookup structures from the pairs added so far.
+  ///
+  void build(uint16_t glyphN) {
+    uint32_t cap = 16;
+    while (cap < _pending.size()*2)
+      cap <<= 1;
+    _shift = 32 - __builtin_ctz(cap);
+    _keys.assign(cap, Empty);
+    _values.assign(cap, 0);
+    _lefts.assign((glyphN+63) / 64, 0);
+    for (const auto& pair : _pending) {
+      uint32_t i = hash(pair.first);
+      while (_keys[i] != Empty && _keys[i] != pair.first)
+        i = (i+1) & (cap-1);
+      if (_keys[i] == Empty) {
+        _keys[i] = pair.first;
+        _values[i] = pair.second;
+        const uint16_t left = pair.first >> 16;
+        _lefts[left/64] |= uint64_t(1) << (left%64);
+      }
+    }
+    _pending.clear();
+    _pending.shrink_to_fit();
+    _glyphN = glyphN;
+  }
+
+  /// Gets the number of bytes held by the lookup structures.
+  ///
+  size_t memoryUsage() const {
+    size_t n = _keys.capacity() * sizeof(uint32_t) +
+               _values.capacity() * sizeof(int16_t) +
+               _lefts.capacity() * sizeof(uint64_t) +
+               _classes.capacity() * sizeof(ClassSet);
+    for (const auto& cls : _classes)
+      n += (cls.cls1.capacity() + cls.cls2.capacity()) * sizeof(uint16_t) +
+           cls.values.capacity() * sizeof(int16_t);
+    return n;
+  }
+
+  /// Gets the adjustment of a glyph pair.
+  ///
+  int16_t get(uint16_t left, uint16_t right) const {
+    if (left >= _glyphN || right >= _glyphN)
+      return 0;
+    if (_lefts[left/64] & (uint64_t(1) << (left%64))) {
+      const uint32_t key = (uint32_t(left) << 16) | right;
+      const uint32_t mask = _keys.size() - 1;
+      for (uint32_t i = hash(key); _keys[i] != Empty; i = (i+1) & mask) {
+        if (_keys[i] == key)
+          return _values[i];
+      }
+    }
+    for (const auto& cls : _classes) {
+      const uint16_t c1 = cls.cls1[left];
+      if (c1 != NoClass)
+        return cls.values[c1*cls.cls2N + cls.cls2[right]];
+    }
+    return 0;
+  }
+
+  /// Gets the adjustments between each glyph and the next in a sequence.
+  ///
+  /// The last entry of 'adjs' is always zero.
+  ///
+  void get(const uint16_t* indices, size_t n, int16_t* adjs) const {
+    if (n == 0)
+      return;
+    if (_keys.empty() && _classes.empty()) {
+      std::fill_n(adjs, n, 0);
+      return;
+    }
+    for (size_t i = 0; i+1 < n; ++i)
+      adjs[i] = get(indices[i], indices[i+1]);
+    adjs[n-1] = 0;
+  }
+
+  /// Appends the built lookup structures to 'buf'.
+  ///
+  void save(std::vector<uint8_t>& buf) const {
+    const uint32_t counts[] = {_shift, _glyphN, uint32_t(_keys.size()),
+                               uint32_t(_lefts.size()),
+                               uint32_t(_classes.size())};
+    append(buf, counts, 5);
+    append(buf, _keys.data(), _keys.size());
+    append(buf, _values.data(), _values.size());
+    append(buf, _lefts.data(), _lefts.size());
+    for (const auto& cls : _classes) {
+      const uint32_t lens[] = {uint32_t(cls.cls1.size()),
+                               uint32_t(cls.cls2.size()), cls.cls2N,
+                               uint32_t(cls.values.size())};
+      append(buf, lens, 4);
+      append(buf, cls.cls1.data(), cls.cls1.size());
+      append(buf, cls.cls2.data(), cls.cls2.size());
+      append(buf, cls.values.data(), cls.values.size());
+    }
+  }
+
+  /// Restores lookup structures saved by 'save'.
+  ///
+  /// Returns false if the data is not valid for 'glyphN' glyphs.
+  ///
+  bool load(const uint8_t* buf, size_t len, uint16_t glyphN) {
+    size_t off = 0;
+    uint32_t counts[5];
+    if (!extract(buf, len, off, counts, 5) || counts[1] != glyphN ||
+        (counts[2] & (counts[2]-1)) != 0 ||
+        counts[2] != (counts[0] < 32 ? 1U << (32-counts[0]) : 0) ||
+        counts[3] != (glyphN+63U) / 64)
+    { return false; }
+    _shift = counts[0];
+    _glyphN = counts[1];
+    _keys.resize(counts[2]);
+    _values.resize(counts[2]);
+    _lefts.resize(counts[3]);
+    if (!extract(buf, len, off, _keys.data(), _keys.size()) ||
+        !extract(buf, len, off, _values.data(), _values.size()) ||
+        !extract(buf, len, off, _lefts.data(), _lefts.size()))
+    { return false; }
+
+    const auto mem = _classes.get_allocator().resource();
+    for (uint32_t i = 0; i < counts[4]; ++i) {
+      uint32_t lens[4];
+      if (!extract(buf, len, off, lens, 4) || lens[0] != glyphN ||
+          lens[1] != glyphN || lens[3] > len)
+      { return false; }
+      ClassSet cls{std::pmr::vector<uint16_t>(lens[0], mem),
+                   std::pmr::vector<uint16_t>(lens[1], mem), uint16_t(lens[2]),
+                   std::pmr::vector<int16_t>(lens[3], mem)};
+      if (!extract(buf, len, off, cls.cls1.data(), lens[0]) ||
+          !extract(buf, len, off, cls.cls2.data(), lens[1]) ||
+          !extract(buf, len, off, cls.values.data(), lens[3]))
+      { return false; }
+      // every pair of classes must index into the values
+      uint32_t maxCls2 = 0;
+      for (uint32_t j = 0; j < glyphN; ++j)
+        maxCls2 = std::max<uint32_t>(maxCls2, cls.cls2[j]);
+      for (uint32_t j = 0; j < glyphN; ++j) {
+        if (cls.cls1[j] != NoClass &&
+            uint64_t(cls.cls1[j]) * cls.cls2N + maxCls2 >= lens[3])
+        { return false; }
+      }
+      _classes.push_back(std::move(cls));
+    }
+    return off == len;
+  }
+
+  static constexpr uint16_t NoClass = 0xFFFF;
+
+ private:
+  static constexpr uint32_t Empty = 0xFFFFFFFF;
+
+  uint32_t hash(uint32_t key) const {
+    return (key * 0x9E3779B1) >> _shift;
+  }
+
+  struct ClassSet {
+    std::pmr::vector<uint16_t> cls1;
+    std::pmr::vector<uint16_t> cls2;
+    uint16_t cls2N;
+    std::pmr::vector<int16_t> values;
+  };
+
+  std::pmr::vector<std::pair<uint32_t, int16_t>> _pending;
+  std::pmr::vector<uint32_t> _keys;
+  std::pmr::vector<int16_t> _values;
+  std::pmr::vector<uint64_t> _lefts;
+  uint32_t _shift = 32;
+  uint16_t _glyphN = 0;
+  std::pmr::vector<ClassSet> _classes;
 };
 
 /// Font manager for 'sfnt' font files (TrueType outline).
 ///
 class SFNT {
  public:
-  SFNT(std::ifstream& ifs) {
-    if (!verify(ifs))
+  /// Only the table directory, 'head' and 'maxp' are read here - other
+  /// tables are decoded on first use.
+  ///
+  /// Decoded tables are allocated from 'fontMem'; temporaries and glyph
+  /// bitmaps from 'scratchMem'.
+  ///
+  SFNT(std::ifstream&& ifs, bool verify, std::pmr::memory_resource* fontMem,
+       std::pmr::memory_resource* scratchMem) :
+    _ifs(std::move(ifs)), _font(fontMem), _scratch(scratchMem),
+    _dir(fontMem), _advs(fontMem), _lsbs(fontMem), _bounds(fontMem),
+    _kerning(fontMem), _cmap(fontMem), _loca(fontMem), _glyf(fontMem),
+    _compounds(fontMem), _sized(fontMem), _sizedOrder(fontMem),
+    _axes(fontMem), _avar(fontMem), _coords(fontMem), _gvar(fontMem),
+    _instances(fontMem), _instRing(fontMem) {
+    if (!loadDir())
+      // TODO
+      std::abort();
+    _print = fingerprint();
+    if (verify && !this->verify())
+      // TODO
+      std::abort();
+    if (!loadHeader())
+      // TODO
+      std::abort();
+    loadAxes();
+  }
+
+  /// Maps a compiled font (see 'compile').
+  ///
+  /// Tables are used in place, so nothing is decoded here or later -
+  /// 'verify' checks the sections against the checksum in the header.
+  ///
+  SFNT(const std::string& pathname, bool verify,
+       std::pmr::memory_resource* fontMem,
+       std::pmr::memory_resource* scratchMem) :
+    _font(fontMem), _scratch(scratchMem),
+    _dir(fontMem), _advs(fontMem), _lsbs(fontMem), _bounds(fontMem),
+    _kerning(fontMem), _cmap(fontMem), _loca(fontMem), _glyf(fontMem),
+    _compounds(fontMem), _sized(fontMem), _sizedOrder(fontMem),
+    _axes(fontMem), _avar(fontMem), _coords(fontMem), _gvar(fontMem),
+    _instances(fontMem), _instRing(fontMem) {
+    const int fd = open(pathname.c_str(), O_RDONLY);
+    if (fd == -1)
+      // TODO
+      std::abort();
+    struct stat st;
+    if (fstat(fd, &st) == -1 || size_t(st.st_size) < sizeof(CompHeader)) {
+      close(fd);
+      // TODO
+      std::abort();
+    }
+    void* map = mmap(nullptr, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+      // TODO
+      std::abort();
+    _map = static_cast<const uint8_t*>(map);
+    _mapLen = st.st_size;
+    if (!loadCompiled(verify))
       // TODO
       std::abort();
-    if (!load(ifs))
+  }
+
+  ~SFNT() {
+    if (_map)
+      munmap(const_cast<uint8_t*>(_map), _mapLen);
+  }
+
+  /// Checks whether a stream holds a compiled font, rewinding it.
+  ///
+  static bool isCompiled(std::ifstream& ifs) {
+    uint64_t magic = 0;
+    ifs.read(reinterpret_cast<char*>(&magic), sizeof magic);
+    const bool compiled = ifs && letoh(magic) == CompMagic;
+    ifs.clear();
+    ifs.seekg(0);
+    return compiled;
+  }
+
+  /// Writes the font in the compiled format.
+  ///
+  /// Every table is decoded into arrays of little-endian values, and
+  /// every glyph into a flattened outline, stored as arrays of
+  /// coordinates, flags and contour ends.
+  ///
+  void compile(const std::string& pathname) {
+    need(CmapPart | GlyfPart | HmtxPart | KernPart);
+
+    CompHeader hdr{};
+    std::vector<uint8_t> buf(sizeof hdr);
+    auto section = [&](CompSection sec, const auto* src, size_t n) {
+      buf.resize((buf.size()+7) & ~size_t(7));
+      hdr.off[sec] = buf.size();
+      append(buf, src, n);
+    };
+
+    std::vector<std::pair<uint16_t, uint16_t>> maps;
+    mappings([&](uint16_t chr, uint16_t idx) { maps.push_back({chr, idx}); });
+    std::sort(maps.begin(), maps.end());
+    std::vector<uint16_t> codes, indices;
+    for (const auto& m : maps) {
+      codes.push_back(m.first);
+      indices.push_back(m.second);
+    }
+
+    std::vector<CompGlyph> glyphs(_glyphN);
+    std::vector<int16_t> xs, ys;
+    std::vector<uint8_t> ons;
+    std::vector<uint16_t> ends;
+    for (uint16_t i = 0; i < _glyphN; ++i) {
+      Outline<int16_t> outlnF(_scratch);
+      const auto& outline = fetch(i, outlnF);
+      auto& glyph = glyphs[i];
+      glyph = {uint32_t(xs.size()), uint32_t(ends.size()), 0, 0,
+               hasOutline(i), outline.xMin, outline.yMin, outline.xMax,
+               outline.yMax};
+      // components are joined into one
+      for (const auto& comp : outline.comps) {
+        const uint32_t base = xs.size() - glyph.pt;
+        for (const auto end : comp.cntrEnd)
+          ends.push_back(base + end);
+        for (const auto& pt : comp.pts) {
+          ons.push_back(std::get<0>(pt));
+          xs.push_back(std::get<1>(pt));
+          ys.push_back(std::get<2>(pt));
+        }
+      }
+      glyph.ptN = xs.size() - glyph.pt;
+      glyph.cntrN = ends.size() - glyph.cntr;
+    }
+
+    std::vector<uint16_t> advs(_advs.begin(), _advs.end());
+    std::vector<int16_t> lsbs(_lsbs.begin(), _lsbs.end());
+    if (varied()) {
+      for (uint16_t i = 0; i < _glyphN; ++i) {
+        const auto inst = instance(i);
+        advs[i] = inst->adv;
+        lsbs[i] = inst->lsb;
+      }
+    }
+
+    std::vector<uint8_t> kerning;
+    _kerning.save(kerning);
+
+    section(LatinSec, _latin, 256);
+    section(CodeSec, codes.data(), codes.size());
+    section(IndexSec, indices.data(), indices.size());
+    section(AdvSec, advs.data(), _glyphN);
+    section(LsbSec, lsbs.data(), _glyphN);
+    section(GlyphSec, glyphs.data(), glyphs.size());
+    section(XSec, xs.data(), xs.size());
+    section(YSec, ys.data(), ys.size());
+    section(OnSec, ons.data(), ons.size());
+    section(EndSec, ends.data(), ends.size());
+    section(KernSec, kerning.data(), kerning.size());
+    buf.resize((buf.size()+7) & ~size_t(7));
+
+    hdr.magic = CompMagic;
+    hdr.version = CompVersion;
+    hdr.len = buf.size();
+    // instances of a variable font get fingerprints of their own
+    hdr.print = _print ^ _varPrint;
+    hdr.csum = kernels::get().checksum(buf.data() + sizeof hdr,
+                                       buf.size() - sizeof hdr);
+    hdr.upem = _upem;
+    hdr.glyphN = _glyphN;
+    hdr.xMin = _xMin;
+    hdr.yMin = _yMin;
+    hdr.xMax = _xMax;
+    hdr.yMax = _yMax;
+    hdr.cmapN = codes.size();
+    hdr.ptN = xs.size();
+    hdr.cntrN = ends.size();
+    hdr.kernLen = kerning.size();
+    hdr = htole(hdr);
+    std::memcpy(buf.data(), &hdr, sizeof hdr);
+
+    std::ofstream ofs(pathname, std::ios_base::binary | std::ios_base::trunc);
+    ofs.write(reinterpret_cast<const char*>(buf.data()), buf.size());
+    if (!ofs)
       // TODO
       std::abort();
   }
 
   /// Produces the bitmap representation of a glyph.
   /// TODO
-  std::unique_ptr<Glyph> getGlyph(wchar_t glyph, uint16_t pts, uint16_t dpi) {
-    Outline<int16_t> outlnF;
-    fetch(glyph, outlnF);
-    Outline<float> outlnP;
-    scale(outlnF, outlnP, pts*dpi);
-
+  std::unique_ptr<Glyph> getGlyph(wchar_t glyph, uint16_t pts, uint16_t dpi,
+                                  const RenderOpts& opts) {
 #ifdef FONT_DEVEL
     std::wcout << "\n** Glyph '" << glyph << "' **\n";
+#endif
 
-    std::wcout << "\n-[FUnits]-\n";
-    std::wcout << "\nbounds:\n" <<
-      "x=(" << outlnF.xMin << "," << outlnF.xMax << ")\n" <<
-      "y=(" << outlnF.yMin << "," << outlnF.yMax << ")\n";
-    std::wcout << "\n~~ Components ~~\n" << outlnF.comps.size() << std::endl;
-    std::for_each(outlnF.comps.begin(), outlnF.comps.end(),
-      [](auto& comp) {
-        std::wcout << "\ncntrEnd:\n";
-        std::for_each(comp.cntrEnd.begin(), comp.cntrEnd.end(),
-          [](const auto& ce) {
-            std::wcout << ce << std::endl;
-          });
-        std::wcout << "\npts:\n";
-        std::for_each(comp.pts.begin(), comp.pts.end(),
-          [] (const auto& pt) {
-            std::wcout <<
-              (std::get<0>(pt) ? "on " : "off ") <<
-              std::get<1>(pt) << " " <<
-              std::get<2>(pt) << "\n";
-          });
-      });
-    std::wcout << "\n~~~~\n";
+    need(CmapPart | GlyfPart);
+    uint16_t idx;
+    if (!find(glyph, idx))
+      return draw(Outline<int16_t>(_scratch), pts, dpi, opts);
+    return drawCached(idx, pts, dpi, opts);
+  }
 
-    std::wcout << "\n-[Scaled]-\n";
-    std::wcout << "\nbounds:\n" <<
-      "x=(" << outlnP.xMin << "," << outlnP.xMax << ")\n" <<
-      "y=(" << outlnP.yMin << "," << outlnP.yMax << ")\n";
-    std::wcout << "\n~~ Components ~~\n" << outlnP.comps.size() << std::endl;
-    std::for_each(outlnP.comps.begin(), outlnP.comps.end(),
-      [](auto& comp) {
-        std::wcout << "\ncntrEnd:\n";
-        std::for_each(comp.cntrEnd.begin(), comp.cntrEnd.end(),
-          [](const auto& ce) {
-            std::wcout << ce << std::endl;
-          });
-        std::wcout << "\npts:\n";
-        std::for_each(comp.pts.begin(), comp.pts.end(),
-          [] (const auto& pt) {
-            std::wcout <<
-              (std::get<0>(pt) ? "on " : "off ") <<
-              std::get<1>(pt) << " " <<
-              std::get<2>(pt) << "\n";
-          });
-      });
-    std::wcout << "\n~~~~\n";
-#endif
+  /// Produces the bitmap representation of a glyph at several sizes.
+  ///
+  /// The outline is decoded and flattened once, at the largest size, and
+  /// every size is rasterized from the same edges.
+  ///
+  std::vector<std::unique_ptr<Glyph>> getGlyphs(
+    wchar_t glyph, const std::vector<uint16_t>& pts, uint16_t dpi,
+    const RenderOpts& opts, bool parallel) {
 
-    return rasterize(outlnP);
+    need(CmapPart | GlyfPart);
+    Outline<int16_t> outlnF(_scratch);
+    uint16_t idx;
+    if (!find(glyph, idx))
+      return drawSizes(outlnF, pts, dpi, opts, parallel);
+    return drawSizes(fetch(idx, outlnF), pts, dpi, opts, parallel);
   }
 
- private:
-  /// Font directory.
+  /// Produces the bitmap representation of a glyph index.
   ///
-  struct DirSub {
-    uint32_t scaler;
-    uint16_t tabN;
-    uint16_t srchRng;
-    uint16_t entSel;
-    uint16_t rngShft;
-  };
-  struct DirEntry {
-    uint32_t tag;
-    uint32_t csum;
-    uint32_t off;
-    uint32_t len;
-  };
-  static constexpr uint32_t DirSubLen = 12;
-  static constexpr uint32_t DirEntryLen = 16;
-  static_assert(sizeof(DirSub) == DirSubLen, "!sizeof");
-  static_assert(sizeof(DirEntry) == DirEntryLen, "!sizeof");
+  std::unique_ptr<Glyph> getIndexGlyph(uint16_t index, uint16_t pts,
+                                       uint16_t dpi, const RenderOpts& opts) {
+    need(GlyfPart);
+    if (index >= _glyphN)
+      return draw(Outline<int16_t>(_scratch), pts, dpi, opts);
+    return drawCached(index, pts, dpi, opts);
+  }
 
-  /// Font header table.
+  /// Sets the cache of rendered glyphs (null for none).
   ///
-  struct Head {
-    int32_t version;
-    int32_t revision;
-    uint32_t csumAdj;
-    uint32_t magic;
-    uint16_t flags;
-    uint16_t upem;
-    uint32_t creDate[2];
-    uint32_t modDate[2];
-    int16_t xMin;
-    int16_t yMin;
-    int16_t xMax;
-    int16_t yMax;
-    uint16_t style;
-    uint16_t lowestPpem;
-    int16_t dirHint;
-    int16_t locaFmt;
-    int16_t glyfFmt;
-  };
-  static constexpr uint32_t HeadLen = 54;
-  static_assert(offsetof(Head, glyfFmt) == HeadLen-2, "!offsetof");
+  void setCache(ShmCache* cache) {
+    _cache = cache;
+  }
 
-  /// Maximum profile table.
+  /// Gets an estimate of the memory held by the font.
   ///
-  struct Maxp {
-    int32_t version;
-    uint16_t glyphN;
-    uint16_t maxPts;
-    uint16_t maxCntrs;
-    uint16_t maxCompPts;
-    uint16_t maxCompCntrs;
-    uint16_t maxZones;
-    uint16_t maxZ0Pts;
-    uint16_t maxStorages;
-    uint16_t maxFDefs;
+  /// Containers are counted by capacity, and hash tables by their nodes
+  /// and buckets.
+  ///
+  MemoryUsage memoryUsage() {
+    auto mapBytes = [](const auto& map) {
+      const size_t node = sizeof(typename std::decay_t<decltype(map)>::
+                                 value_type) + 2*sizeof(void*);
+      return map.size()*node + map.bucket_count()*sizeof(void*);
+    };
+    auto vecBytes = [](const auto& vec) {
+      return vec.capacity() * sizeof vec[0];
+    };
+
+    MemoryUsage usage{};
+    {
+      std::lock_guard<std::mutex> lock(_loadMtx);
+      usage.cmap = mapBytes(_cmap) + sizeof _latin;
+      usage.outlines = vecBytes(_loca) + vecBytes(_glyf);
+      usage.metrics = vecBytes(_advs) + vecBytes(_lsbs) + vecBytes(_bounds);
+      usage.kerning = _kerning.memoryUsage();
+    }
+    {
+      std::lock_guard<std::mutex> lock(_compMtx);
+      usage.compounds = mapBytes(_compounds);
+      for (const auto& cmpd : _compounds) {
+        for (const auto& comp : cmpd.second.comps)
+          usage.compounds += vecBytes(comp.cntrEnd) + vecBytes(comp.pts) +
+                             sizeof comp;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(_sizedMtx);
+      usage.sized = mapBytes(_sized) +
+                    _sizedOrder.size() * sizeof _sizedOrder.front();
+      for (const auto& sizes : _sized) {
+        usage.sized += vecBytes(sizes.second);
+        for (const auto& sized : sizes.second)
+          usage.sized += sized.cov->pitch() * sized.cov->extent().second;
+      }
+    }
+    {
+      std::lock_guard<std::mutex> lock(_loadMtx);
+      usage.variations = vecBytes(_gvar);
+    }
+    {
+      std::lock_guard<std::mutex> lock(_instMtx);
+      usage.variations += mapBytes(_instances) + vecBytes(_instRing);
+      for (const auto& inst : _instances) {
+        usage.variations += sizeof(Instance) + vecBytes(inst.second->coords);
+        for (const auto& comp : inst.second->outline.comps)
+          usage.variations += vecBytes(comp.cntrEnd) + vecBytes(comp.pts) +
+                              sizeof comp;
+      }
+    }
+    usage.mapped = _mapLen;
+    usage.total = usage.cmap + usage.outlines + usage.metrics +
+                  usage.kerning + usage.compounds + usage.sized +
+                  usage.variations + usage.mapped;
+    return usage;
+  }
+
+  /// Releases memory that can be rebuilt.
+  ///
+  /// Tables are released by marking their parts as not loaded, so that
+  /// 'need' decodes them again on next use. For compiled fonts, pages of
+  /// the mapping are also handed back (to be read from the file again).
+  ///
+  void trim(TrimLevel level) {
+    {
+      std::lock_guard<std::mutex> lock(_compMtx);
+      decltype(_compounds){_font}.swap(_compounds);
+    }
+    {
+      std::lock_guard<std::mutex> lock(_sizedMtx);
+      decltype(_sized){_font}.swap(_sized);
+      decltype(_sizedOrder){_font}.swap(_sizedOrder);
+      _sizedLen = 0;
+    }
+    {
+      std::lock_guard<std::mutex> lock(_instMtx);
+      decltype(_instances){_font}.swap(_instances);
+      decltype(_instRing){_font}.swap(_instRing);
+      _instNext = 0;
+    }
+    if (level < TrimLevel::Tables)
+      return;
+
+    std::lock_guard<std::mutex> lock(_loadMtx);
+    decltype(_cmap){_font}.swap(_cmap);
+    decltype(_loca){_font}.swap(_loca);
+    decltype(_glyf){_font}.swap(_glyf);
+    decltype(_advs){_font}.swap(_advs);
+    decltype(_lsbs){_font}.swap(_lsbs);
+    decltype(_bounds){_font}.swap(_bounds);
+    _kerning = Kerning{_font};
+    decltype(_gvar){_font}.swap(_gvar);
+    _loaded.store(0, std::memory_order_release);
+    if (_map)
+      madvise(const_cast<uint8_t*>(_map), _mapLen, MADV_DONTNEED);
+  }
+
+  /// Gets the axes of a variable font.
+  ///
+  std::vector<Axis> axes() const {
+    return {_axes.begin(), _axes.end()};
+  }
+
+  /// Selects an instance of a variable font.
+  ///
+  /// Values are normalized to [-1, 1] around the axis defaults, mapped
+  /// through 'avar' and rounded to F2Dot14, as the font's deltas expect.
+  /// Instanced outlines of other coordinates stay cached.
+  ///
+  void setVariation(const std::vector<Variation>& values) {
+    if (_axes.empty())
+      return;
+    std::pmr::vector<int16_t> coords(_axes.size(), 0, _font);
+    for (size_t i = 0; i < _axes.size(); ++i) {
+      const auto& axis = _axes[i];
+      float val = axis.def;
+      for (const auto& var : values) {
+        if (var.tag == axis.tag)
+          val = var.value;
+      }
+      val = std::clamp(val, axis.min, axis.max);
+      float norm = 0.0f;
+      if (val < axis.def)
+        norm = (val - axis.def) / (axis.def - axis.min);
+      else if (val > axis.def)
+        norm = (val - axis.def) / (axis.max - axis.def);
+
+      // segment maps, whose 'from' coordinates increase
+      if (i < _avar.size()) {
+        const auto& map = _avar[i];
+        for (size_t j = 1; j < map.size(); ++j) {
+          const float x0 = map[j-1].first / 16384.0f;
+          const float x1 = map[j].first / 16384.0f;
+          if (norm > x1)
+            continue;
+          const float y0 = map[j-1].second / 16384.0f;
+          const float y1 = map[j].second / 16384.0f;
+          norm = x1 > x0 ? y0 + (norm-x0) * (y1-y0) / (x1-x0) : y1;
+          break;
+        }
+      }
+      coords[i] = std::clamp(otRound(norm * 16384.0f), -16384, 16384);
+    }
+
+    _coords.swap(coords);
+    _varPrint = 0;
+    if (std::any_of(_coords.begin(), _coords.end(),
+                    [](int16_t c) { return c != 0; })) {
+      _varPrint = 0x9E3779B97F4A7C15;
+      for (const auto c : _coords) {
+        _varPrint = (_varPrint ^ uint16_t(c)) * 0x100000001B3;
+        _varPrint ^= _varPrint >> 29;
+      }
+      _varPrint |= 1;
+    }
+  }
+
+  /// Gets the glyph index of a character code (zero if unmapped).
+  ///
+  uint16_t getIndex(wchar_t chr) {
+    need(CmapPart);
+    uint16_t idx;
+    return find(chr, idx) ? idx : 0;
+  }
+
+  /// Calls 'fn' with each mapped code point and its glyph index.
+  ///
+  template<class F>
+  void mappings(F fn) {
+    need(CmapPart);
+    if (_map) {
+      for (uint32_t i = 0; i < _comp.cmapN; ++i)
+        fn(at<uint16_t>(CodeSec, i), at<uint16_t>(IndexSec, i));
+      return;
+    }
+    for (const auto& m : _cmap)
+      fn(m.first, m.second);
+  }
+
+  /// Maps UTF-8 or UTF-16 text to glyph indices.
+  ///
+  /// Runs of ASCII are found by a kernel and mapped through the table of
+  /// the first 256 code points, and other characters are decoded and
+  /// looked up one at a time.
+  ///
+  template<class T>
+  size_t mapText(const T* text, size_t len, uint16_t* indices,
+                 std::vector<Unmapped>* missing) {
+    need(CmapPart);
+    const auto& kern = kernels::get();
+    size_t n = 0;
+    for (size_t i = 0; i < len;) {
+      const uint32_t max = std::min<size_t>(len-i, UINT32_MAX);
+      uint32_t run;
+      if constexpr (sizeof(T) == 1)
+        run = kern.asciiLen(text+i, max);
+      else
+        run = kern.asciiLen16(text+i, max);
+      for (uint32_t j = 0; j < run; ++j) {
+        const char32_t chr = text[i+j];
+        uint16_t idx = _latin[chr];
+        if (idx == NoGlyph || idx == 0) {
+          idx = 0;
+          if (missing)
+            missing->push_back({n+j, chr});
+        }
+        indices[n+j] = idx;
+      }
+      i += run;
+      n += run;
+      if (i == len)
+        break;
+
+      const char32_t chr = decode(text, len, i);
+      uint16_t idx;
+      if (chr > 0xFFFF || !find(chr, idx))
+        idx = 0;
+      if (idx == 0 && missing)
+        missing->push_back({n, chr});
+      indices[n++] = idx;
+    }
+    return n;
+  }
+
+  /// Gets the kerning between each glyph and the next in a sequence, in
+  /// pixels.
+  ///
+  void getKerning(const uint16_t* indices, size_t n, float* adjs,
+                  uint16_t pts, uint16_t dpi) {
+    need(KernPart);
+    const float fac = static_cast<float>(pts*dpi) / (72.0f * _upem);
+    std::pmr::vector<int16_t> units(n, _scratch);
+    _kerning.get(indices, n, units.data());
+    for (size_t i = 0; i < n; ++i)
+      adjs[i] = units[i] * fac;
+  }
+
+  /// Builds the triangle mesh of a glyph.
+  ///
+  /// Each line segment of a contour is fanned out to the first point of
+  /// the contour as a solid triangle. Each quadratic segment gets the same
+  /// triangle plus a curve triangle, which adds or removes the region
+  /// between the curve and its chord.
+  ///
+  Mesh getMesh(uint16_t index) {
+    need(GlyfPart);
+    Mesh mesh{{}, 0.0f, 0.0f, 0.0f, 0.0f};
+    if (index >= _glyphN)
+      return mesh;
+    Outline<int16_t> outlnF(_scratch);
+    const auto& outln = fetch(index, outlnF);
+    const float fac = 1.0f / _upem;
+    mesh.xMin = outln.xMin * fac;
+    mesh.yMin = outln.yMin * fac;
+    mesh.xMax = outln.xMax * fac;
+    mesh.yMax = outln.yMax * fac;
+
+    struct Pt { float x, y; };
+    Pt anchor;
+    auto cross = [](Pt a, Pt b, Pt c) {
+      return (b.x-a.x)*(c.y-a.y) - (b.y-a.y)*(c.x-a.x);
+    };
+    auto line = [&](Pt a, Pt b) {
+      // solid - u*u < v everywhere
+      if (cross(anchor, a, b) != 0.0f) {
+        mesh.vertices.push_back({anchor.x, anchor.y, 0.0f, 1.0f});
+        mesh.vertices.push_back({a.x, a.y, 0.0f, 1.0f});
+        mesh.vertices.push_back({b.x, b.y, 0.0f, 1.0f});
+      }
+    };
+    auto quad = [&](Pt a, Pt c, Pt b) {
+      line(a, b);
+      if (cross(a, c, b) != 0.0f) {
+        mesh.vertices.push_back({a.x, a.y, 0.0f, 0.0f});
+        mesh.vertices.push_back({c.x, c.y, 0.5f, 0.0f});
+        mesh.vertices.push_back({b.x, b.y, 1.0f, 1.0f});
+      }
+    };
+
+    for (const auto& comp : outln.comps) {
+      auto point = [&](uint16_t i) {
+        return Pt{std::get<1>(comp.pts[i]) * fac,
+                  std::get<2>(comp.pts[i]) * fac};
+      };
+      auto onCurve = [&](uint16_t i) { return std::get<0>(comp.pts[i]); };
+      auto mid = [](Pt a, Pt b) {
+        return Pt{(a.x+b.x) * 0.5f, (a.y+b.y) * 0.5f};
+      };
+
+      uint16_t beg = 0;
+      for (const auto& end : comp.cntrEnd) {
+        const uint16_t n = end-beg+1;
+        // start on a point that is on the curve, implied if need be
+        uint16_t first = beg;
+        while (first <= end && !onCurve(first))
+          ++first;
+        Pt start;
+        uint16_t skip, count;
+        if (first <= end) {
+          start = point(first);
+          skip = first-beg;
+          count = n-1;
+        } else {
+          start = mid(point(beg), point(beg == end ? beg : beg+1));
+          skip = 0;
+          count = n;
+        }
+
+        anchor = start;
+        Pt cur = start, ctrl;
+        bool hasCtrl = false;
+        for (uint16_t k = 1; k <= count; ++k) {
+          const uint16_t i = beg + (skip+k) % n;
+          const Pt p = point(i);
+          if (onCurve(i)) {
+            if (hasCtrl)
+              quad(cur, ctrl, p);
+            else
+              line(cur, p);
+            cur = p;
+            hasCtrl = false;
+          } else if (hasCtrl) {
+            const Pt m = mid(ctrl, p);
+            quad(cur, ctrl, m);
+            cur = m;
+            ctrl = p;
+          } else {
+            ctrl = p;
+            hasCtrl = true;
+          }
+        }
+        // back to the start
+        if (hasCtrl)
+          quad(cur, ctrl, start);
+        else
+          line(cur, start);
+        beg = end+1;
+      }
+    }
+    return mesh;
+  }
+
+  /// Gets the metrics of a glyph without touching its outline.
+  ///
+  Metrics getMetrics(uint16_t index, uint16_t pts, uint16_t dpi) {
+    need(HmtxPart | BoundsPart);
+    Metrics mtcs{};
+    if (index >= _glyphN)
+      return mtcs;
+    const float fac = static_cast<float>(pts*dpi) / (72.0f * _upem);
+    mtcs.advance = _advs[index] * fac;
+    mtcs.lsb = _lsbs[index] * fac;
+    if (varied()) {
+      const auto inst = instance(index);
+      const auto& outline = inst->outline;
+      mtcs.advance = inst->adv * fac;
+      mtcs.lsb = inst->lsb * fac;
+      if (!outline.comps.empty()) {
+        mtcs.xMin = outline.xMin * fac;
+        mtcs.yMin = outline.yMin * fac;
+        mtcs.xMax = outline.xMax * fac;
+        mtcs.yMax = outline.yMax * fac;
+      }
+    } else if (_map) {
+      const auto glyph = at<CompGlyph>(GlyphSec, index);
+      if (glyph.outlined) {
+        mtcs.xMin = glyph.xMin * fac;
+        mtcs.yMin = glyph.yMin * fac;
+        mtcs.xMax = glyph.xMax * fac;
+        mtcs.yMax = glyph.yMax * fac;
+      }
+    } else {
+      const auto& bnds = _bounds[index];
+      mtcs.xMin = bnds.xMin * fac;
+      mtcs.yMin = bnds.yMin * fac;
+      mtcs.xMax = bnds.xMax * fac;
+      mtcs.yMax = bnds.yMax * fac;
+    }
+    mtcs.rsb = mtcs.advance - mtcs.lsb - (mtcs.xMax - mtcs.xMin);
+    return mtcs;
+  }
+
+  /// Measures a string laid out on a single line.
+  ///
+  Metrics measure(const std::wstring& str, uint16_t pts, uint16_t dpi) {
+    need(CmapPart | HmtxPart | KernPart);
+    Metrics mtcs{};
+    const float fac = static_cast<float>(pts*dpi) / (72.0f * _upem);
+    float pen = 0.0f;
+    bool first = true;
+    uint16_t prev = 0;
+    for (size_t i = 0; i < str.size(); ++i) {
+      const uint16_t idx = getIndex(str[i]);
+      if (i > 0)
+        pen += getKerning(prev, idx) * fac;
+      prev = idx;
+      const auto gm = getMetrics(idx, pts, dpi);
+      if (gm.xMax > gm.xMin) {
+        if (first) {
+          mtcs.xMin = pen + gm.xMin;
+          mtcs.yMin = gm.yMin;
+          mtcs.xMax = pen + gm.xMax;
+          mtcs.yMax = gm.yMax;
+          first = false;
+        } else {
+          mtcs.xMin = std::min(mtcs.xMin, pen + gm.xMin);
+          mtcs.yMin = std::min(mtcs.yMin, gm.yMin);
+          mtcs.xMax = std::max(mtcs.xMax, pen + gm.xMax);
+          mtcs.yMax = std::max(mtcs.yMax, gm.yMax);
+        }
+      }
+      pen += gm.advance;
+    }
+    mtcs.advance = pen;
+    if (!str.empty()) {
+      mtcs.lsb = getMetrics(getIndex(str.front()), pts, dpi).lsb;
+      mtcs.rsb = getMetrics(getIndex(str.back()), pts, dpi).rsb;
+    }
+    return mtcs;
+  }
+
+  /// Renders a string laid out on a single line into one bitmap.
+  ///
+  /// Glyphs are placed on whole pixels, advanced by their 'hmtx' widths
+  /// plus any 'kern' adjustment, and blended into a shared coverage
+  /// bitmap. Repeated glyphs are rasterized only once, unless clipped.
+  ///
+  std::unique_ptr<Glyph> renderRun(const std::wstring& str, uint16_t pts,
+                                   uint16_t dpi, const RenderOpts& opts) {
+    need(CmapPart | GlyfPart | HmtxPart | KernPart);
+    struct Placement {
+      const Glyph* glyph;
+      int32_t x, y;
+    };
+
+    std::pmr::unordered_map<uint16_t, std::unique_ptr<Glyph>> glyphs(_scratch);
+    std::pmr::vector<Placement> places(_scratch);
+    std::pmr::vector<std::unique_ptr<Glyph>> clippedGlyphs(_scratch);
+    RenderOpts covOpts = opts;
+    covOpts.format = PixelFmt::A8;
+    const bool clip = clipped(opts);
+
+    const float fac = static_cast<float>(pts*dpi) / (72.0f * _upem);
+    const float bold = opts.embolden * _upem;
+    int32_t xMin, yMin, xMax, yMax;
+    xMin = yMin = INT32_MAX;
+    xMax = yMax = INT32_MIN;
+    float pen = 0.0f;
+    uint16_t prev = 0;
+
+    for (size_t i = 0; i < str.size(); ++i) {
+      const uint16_t idx = getIndex(str[i]);
+      if (i > 0)
+        pen += getKerning(prev, idx) * fac;
+      std::unique_ptr<Glyph>* slot;
+      if (clip) {
+        // the clip rectangle is moved to the pen, so that only the visible
+        // part of each occurrence is rendered
+        auto shift = [&](int16_t v) {
+          return int16_t(std::clamp<int32_t>(v - std::lround(pen),
+                                             INT16_MIN, INT16_MAX));
+        };
+        covOpts.clip.xMin = shift(opts.clip.xMin);
+        covOpts.clip.xMax = shift(opts.clip.xMax);
+        clippedGlyphs.push_back(getIndexGlyph(idx, pts, dpi, covOpts));
+        slot = &clippedGlyphs.back();
+      } else {
+        slot = &glyphs[idx];
+        if (!*slot)
+          *slot = getIndexGlyph(idx, pts, dpi, covOpts);
+      }
+      const auto& glyph = *slot;
+      const auto ext = glyph->extent();
+      if (ext.first > 0 && ext.second > 0) {
+        const auto brg = glyph->bearing();
+        const int32_t x = std::lround(pen) + brg.first;
+        const int32_t y = brg.second;
+        places.push_back({glyph.get(), x, y});
+        xMin = std::min(xMin, x);
+        yMin = std::min(yMin, y);
+        xMax = std::max(xMax, x + ext.first);
+        yMax = std::max(yMax, y + ext.second);
+      }
+      pen += (advance(idx) + bold) * fac;
+      prev = idx;
+    }
+
+    // glyph extents are 16-bit, so larger runs must be split by the caller
+    auto fits = [](int32_t lo, int32_t hi) {
+      return hi - lo <= UINT16_MAX && lo >= INT16_MIN && lo <= INT16_MAX;
+    };
+    if (places.empty() || !fits(xMin, xMax) || !fits(yMin, yMax))
+      return std::unique_ptr<Glyph>{new SFNTGlyph{{0, 0}, opts.format, 0,
+                                                  {0, 0}, _scratch}};
+
+    const uint32_t w = xMax - xMin;
+    const uint32_t h = yMax - yMin;
+    const std::pair<int16_t, int16_t> bearing(xMin, yMin);
+    std::pmr::vector<uint8_t> canvas(size_t(w)*h, 0, _scratch);
+    uint8_t* bmap = canvas.data();
+
+    const auto& kern = kernels::get();
+    const auto blend = opts.blend == Blend::Add ? kern.blendAdd :
+                                                  kern.blendMax;
+    for (const auto& pl : places) {
+      const auto ext = pl.glyph->extent();
+      const auto src = pl.glyph->data();
+      const auto srcPitch = pl.glyph->pitch();
+      uint8_t* dst = bmap + size_t(pl.y-yMin)*w + (pl.x-xMin);
+      for (uint16_t y = 0; y < ext.second; ++y)
+        blend(dst + size_t(y)*w, src + y*srcPitch, ext.first);
+    }
+
+    return std::unique_ptr<Glyph>{encode(bmap, w, w, h, opts, bearing)};
+  }
+
+ private:
+  /// Font directory.
+  ///
+  struct DirSub {
+    uint32_t scaler;
+    uint16_t tabN;
+    uint16_t srchRng;
+    uint16_t entSel;
+    uint16_t rngShft;
+  };
+  struct DirEntry {
+    uint32_t tag;
+    uint32_t csum;
+    uint32_t off;
+    uint32_t len;
+  };
+  static constexpr uint32_t DirSubLen = 12;
+  static constexpr uint32_t DirEntryLen = 16;
+  static_assert(sizeof(DirSub) == DirSubLen, "!sizeof");
+  static_assert(sizeof(DirEntry) == DirEntryLen, "!sizeof");
+
+  /// Font header table.
+  ///
+  struct Head {
+    int32_t version;
+    int32_t revision;
+    uint32_t csumAdj;
+    uint32_t magic;
+    uint16_t flags;
+    uint16_t upem;
+    uint32_t creDate[2];
+    uint32_t modDate[2];
+    int16_t xMin;
+    int16_t yMin;
+    int16_t xMax;
+    int16_t yMax;
+    uint16_t style;
+    uint16_t lowestPpem;
+    int16_t dirHint;
+    int16_t locaFmt;
+    int16_t glyfFmt;
+  };
+  static constexpr uint32_t HeadLen = 54;
+  static_assert(offsetof(Head, glyfFmt) == HeadLen-2, "!offsetof");
+
+  /// Maximum profile table.
+  ///
+  struct Maxp {
+    int32_t version;
+    uint16_t glyphN;
+    uint16_t maxPts;
+    uint16_t maxCntrs;
+    uint16_t maxCompPts;
+    uint16_t maxCompCntrs;
+    uint16_t maxZones;
+    uint16_t maxZ0Pts;
+    uint16_t maxStorages;
+    uint16_t maxFDefs;
     uint16_t maxIDefs;
     uint16_t maxStackElems;
     uint16_t maxInstrSz;
@@ -204,6 +1287,68 @@ class SFNT {
   static constexpr uint32_t MaxpLen = 32;
   static_assert(offsetof(Maxp, maxCompDepth) == MaxpLen-2, "!offsetof");
 
+  /// Horizontal header table.
+  ///
+  struct Hhea {
+    int32_t version;
+    int16_t ascent;
+    int16_t descent;
+    int16_t lineGap;
+    uint16_t advMax;
+    int16_t minLsb;
+    int16_t minRsb;
+    int16_t xMaxExtent;
+    int16_t caretRise;
+    int16_t caretRun;
+    int16_t caretOff;
+    int16_t reserved[4];
+    int16_t metricFmt;
+    uint16_t hmtxN;
+  };
+  static constexpr uint32_t HheaLen = 36;
+  static_assert(sizeof(Hhea) == HheaLen, "!sizeof");
+
+  /// Horizontal metrics table.
+  ///
+  struct Hmtx {
+    uint16_t adv;
+    int16_t lsb;
+  };
+  static constexpr uint32_t HmtxLen = 4;
+  static_assert(sizeof(Hmtx) == HmtxLen, "!sizeof");
+
+  /// Kerning table.
+  ///
+  struct KernIndex {
+    uint16_t version;
+    uint16_t subN;
+  };
+  struct KernSub {
+    uint16_t version;
+    uint16_t len;
+    uint16_t coverage;
+  };
+  struct Kern0 {
+    uint16_t pairN;
+    uint16_t srchRng;
+    uint16_t entSel;
+    uint16_t rngShft;
+    // XXX: KernPair[pairN] follows.
+  };
+  struct KernPair {
+    uint16_t left;
+    uint16_t right;
+    int16_t value;
+  };
+  static constexpr uint32_t KernIndexLen = 4;
+  static constexpr uint32_t KernSubLen = 6;
+  static constexpr uint32_t Kern0Len = 8;
+  static constexpr uint32_t KernPairLen = 6;
+  static_assert(sizeof(KernIndex) == KernIndexLen, "!sizeof");
+  static_assert(sizeof(KernSub) == KernSubLen, "!sizeof");
+  static_assert(sizeof(Kern0) == Kern0Len, "!sizeof");
+  static_assert(sizeof(KernPair) == KernPairLen, "!sizeof");
+
   /// Character to glyph mapping table.
   ///
   struct CmapIndex {
@@ -255,6 +1400,7 @@ class SFNT {
   static constexpr uint32_t GlyfLen = 10;
   static_assert(sizeof(Glyf) == GlyfLen, "!sizeof");
   static_assert(alignof(Glyf) == alignof(int16_t), "!alignof");
+  static constexpr uint32_t GlyfPad = 4;
 
   /// Table tags.
   ///
@@ -262,103 +1408,379 @@ class SFNT {
     CmapTag = ::makeTag('c', 'm', 'a', 'p'),
     GlyfTag = ::makeTag('g', 'l', 'y', 'f'),
     HeadTag = ::makeTag('h', 'e', 'a', 'd'),
-    HheaTag = ::makeTag('h', 'h', 'e', 'a'), // TODO
-    HmtxTag = ::makeTag('h', 'm', 't', 'x'), // TODO
+    HheaTag = ::makeTag('h', 'h', 'e', 'a'),
+    HmtxTag = ::makeTag('h', 'm', 't', 'x'),
+    KernTag = ::makeTag('k', 'e', 'r', 'n'),
+    GposTag = ::makeTag('G', 'P', 'O', 'S'),
     LocaTag = ::makeTag('l', 'o', 'c', 'a'),
     MaxpTag = ::makeTag('m', 'a', 'x', 'p'),
+    FvarTag = ::makeTag('f', 'v', 'a', 'r'),
+    AvarTag = ::makeTag('a', 'v', 'a', 'r'),
+    GvarTag = ::makeTag('g', 'v', 'a', 'r'),
     NameTag = ::makeTag('n', 'a', 'm', 'e'), // TODO
     PostTag = ::makeTag('p', 'o', 's', 't')  // TODO
   };
 
-  /// Verifies file.
+  /// Compiled font.
   ///
-  bool verify(std::ifstream& ifs) {
-    auto calcCsum = [](const uint32_t* tab, uint32_t len) -> uint32_t {
-      uint32_t sum = 0;
-      uint32_t dwordN = (len + 3) / 4;
-      while (dwordN-- > 0)
-        sum += betoh(*tab++);
-      return sum;
-    };
+  /// A header is followed by sections of little-endian values, each
+  /// aligned to eight bytes. Outlines are flattened into one set of
+  /// contours per glyph, whose points are kept in separate arrays of x, y
+  /// and on curve flags.
+  ///
+  enum CompSection {
+    LatinSec, // glyph indices of the first 256 code points
+    CodeSec,  // mapped code points, sorted
+    IndexSec, // glyph index of each mapped code point
+    AdvSec,   // advance width of each glyph
+    LsbSec,   // left side bearing of each glyph
+    GlyphSec, // 'CompGlyph' of each glyph
+    XSec,     // x of every point
+    YSec,     // y of every point
+    OnSec,    // on curve flag of every point
+    EndSec,   // last point of every contour, relative to the glyph
+    KernSec,  // kerning lookup structures
+    CompSecN
+  };
+  struct CompHeader {
+    uint64_t magic;
+    uint32_t version;
+    uint32_t len;  // file length
+    uint64_t print; // fingerprint of the source font and instance
+    uint32_t csum; // checksum of everything past the header
+    uint16_t upem;
+    uint16_t glyphN;
+    int16_t xMin, yMin, xMax, yMax;
+    uint32_t cmapN;
+    uint32_t ptN;
+    uint32_t cntrN;
+    uint32_t kernLen;
+    uint32_t off[CompSecN];
 
-    ifs.seekg(0);
-    DirSub sub;
-    ifs.read(reinterpret_cast<char*>(&sub), DirSubLen);
+    /// Converts a header to little-endian order.
+    ///
+    friend CompHeader htole(CompHeader hdr) {
+      hdr.magic = ::htole(hdr.magic);
+      hdr.version = ::htole(hdr.version);
+      hdr.len = ::htole(hdr.len);
+      hdr.print = ::htole(hdr.print);
+      hdr.csum = ::htole(hdr.csum);
+      hdr.upem = ::htole(hdr.upem);
+      hdr.glyphN = ::htole(hdr.glyphN);
+      hdr.xMin = ::htole(hdr.xMin);
+      hdr.yMin = ::htole(hdr.yMin);
+      hdr.xMax = ::htole(hdr.xMax);
+      hdr.yMax = ::htole(hdr.yMax);
+      hdr.cmapN = ::htole(hdr.cmapN);
+      hdr.ptN = ::htole(hdr.ptN);
+      hdr.cntrN = ::htole(hdr.cntrN);
+      hdr.kernLen = ::htole(hdr.kernLen);
+      for (auto& off : hdr.off)
+        off = ::htole(off);
+      return hdr;
+    }
 
-    const uint16_t tabN = betoh(sub.tabN);
-    std::vector<DirEntry> ents;
-    ents.resize(tabN);
-    ifs.read(reinterpret_cast<char*>(ents.data()), tabN*DirEntryLen);
-
-    for (const auto& e : ents) {
-      uint32_t off = betoh(e.off);
-      uint32_t len = betoh(e.len);
-      ifs.seekg(off);
-      auto buf = std::make_unique<uint32_t[]>((len+3)/4);
-      ifs.read(reinterpret_cast<char*>(buf.get()), ((len+3)/4)*4);
-      uint32_t csum = calcCsum(buf.get(), len);
-      if (csum != betoh(e.csum) && betoh(e.tag) != HeadTag)
-        return false;
+    /// Converts a header to host order (swapping bytes either way is the
+    /// same).
+    ///
+    friend CompHeader letoh(CompHeader hdr) {
+      return htole(hdr);
+    }
+  };
+  struct CompGlyph {
+    uint32_t pt;   // first point
+    uint32_t cntr; // first contour
+    uint32_t ptN;
+    uint16_t cntrN;
+    uint16_t outlined; // zero for glyphs without outline
+    int16_t xMin, yMin, xMax, yMax;
+
+    /// Converts a glyph to little-endian order.
+    ///
+    friend CompGlyph htole(CompGlyph glyph) {
+      glyph.pt = ::htole(glyph.pt);
+      glyph.cntr = ::htole(glyph.cntr);
+      glyph.ptN = ::htole(glyph.ptN);
+      glyph.cntrN = ::htole(glyph.cntrN);
+      glyph.outlined = ::htole(glyph.outlined);
+      glyph.xMin = ::htole(glyph.xMin);
+      glyph.yMin = ::htole(glyph.yMin);
+      glyph.xMax = ::htole(glyph.xMax);
+      glyph.yMax = ::htole(glyph.yMax);
+      return glyph;
+    }
+
+    /// Converts a glyph to host order.
+    ///
+    friend CompGlyph letoh(CompGlyph glyph) {
+      return htole(glyph);
+    }
+  };
+  static constexpr uint64_t CompMagic = 0x314F43544E4F4646; // "FFONTCO1"
+  static constexpr uint32_t CompVersion = 1;
+
+  /// Gets a section of the compiled font.
+  ///
+  template<class T>
+  const T* section(CompSection sec) const {
+    return reinterpret_cast<const T*>(_map + _comp.off[sec]);
+  }
+
+  /// Gets a value of a section of the compiled font, in host order.
+  ///
+  template<class T>
+  T at(CompSection sec, size_t i) const {
+    T val;
+    std::memcpy(&val, _map + _comp.off[sec] + i*sizeof(T), sizeof val);
+    return letoh(val);
+  }
+
+  /// Checks the header and sections of the compiled font, and sets up the
+  /// font from them.
+  ///
+  bool loadCompiled(bool verify) {
+    std::memcpy(&_comp, _map, sizeof _comp);
+    _comp = letoh(_comp);
+    const auto& hdr = _comp;
+    if (hdr.magic != CompMagic || hdr.version != CompVersion ||
+        hdr.len != _mapLen || hdr.len % 8 != 0 || hdr.upem == 0)
+    { return false; }
+    if (verify && kernels::get().checksum(_map + sizeof hdr,
+                                          _mapLen - sizeof hdr) != hdr.csum)
+    { return false; }
+
+    const size_t lens[CompSecN] = {
+      256 * sizeof(uint16_t),
+      hdr.cmapN * sizeof(uint16_t),
+      hdr.cmapN * sizeof(uint16_t),
+      hdr.glyphN * sizeof(uint16_t),
+      hdr.glyphN * sizeof(int16_t),
+      hdr.glyphN * sizeof(CompGlyph),
+      hdr.ptN * sizeof(int16_t),
+      hdr.ptN * sizeof(int16_t),
+      hdr.ptN * sizeof(uint8_t),
+      hdr.cntrN * sizeof(uint16_t),
+      hdr.kernLen
+    };
+    for (uint32_t i = 0; i < CompSecN; ++i) {
+      if (hdr.off[i] % 8 != 0 || hdr.off[i] < sizeof hdr ||
+          hdr.off[i] > _mapLen || lens[i] > _mapLen - hdr.off[i])
+      { return false; }
     }
 
+    _print = hdr.print;
+    _upem = hdr.upem;
+    _glyphN = hdr.glyphN;
+    _xMin = hdr.xMin;
+    _yMin = hdr.yMin;
+    _xMax = hdr.xMax;
+    _yMax = hdr.yMax;
+    _locaFmt = 0;
+    _maxPts = _maxCntrs = _maxCompPts = _maxCompCntrs = 0;
+    for (uint32_t i = 0; i < 256; ++i)
+      _latin[i] = at<uint16_t>(LatinSec, i);
     return true;
   }
 
-  /// Loads font data.
+  /// Parts of the font decoded on first use.
   ///
-  bool load(std::ifstream& ifs) {
-    ifs.seekg(0);
+  enum Part : uint32_t {
+    CmapPart = 1,
+    GlyfPart = 2, // 'loca' and 'glyf'
+    HmtxPart = 4, // 'hhea' and 'hmtx'
+    KernPart = 8, // 'GPOS' or 'kern'
+    BoundsPart = 16, // glyph headers of 'glyf'
+    VarPart = 32 // 'gvar'
+  };
+
+  /// Ensures that the given parts are loaded.
+  ///
+  void need(uint32_t parts) {
+    if ((_loaded.load(std::memory_order_acquire) & parts) == parts)
+      return;
+    std::lock_guard<std::mutex> lock(_loadMtx);
+    const uint32_t missing = parts & ~_loaded.load(std::memory_order_relaxed);
+    if (_map) {
+      loadCompiledParts(missing);
+      _loaded.fetch_or(missing, std::memory_order_release);
+      return;
+    }
+    if (missing & CmapPart)
+      loadCmap();
+    if (missing & GlyfPart)
+      loadGlyf();
+    if (missing & HmtxPart)
+      loadHmtx();
+    if (missing & KernPart)
+      loadKerning();
+    if (missing & VarPart)
+      loadGvar();
+    if (missing & BoundsPart)
+      loadBounds();
+    if (!_ifs)
+      // TODO
+      std::abort();
+    _loaded.fetch_or(missing, std::memory_order_release);
+  }
+
+  /// Sets up parts of a compiled font.
+  ///
+  /// Only metrics and kerning are copied - the mapping and outlines are
+  /// read in place.
+  ///
+  void loadCompiledParts(uint32_t parts) {
+    if (parts & HmtxPart) {
+      _advs.resize(_glyphN);
+      _lsbs.resize(_glyphN);
+      for (uint16_t i = 0; i < _glyphN; ++i) {
+        _advs[i] = at<uint16_t>(AdvSec, i);
+        _lsbs[i] = at<int16_t>(LsbSec, i);
+      }
+    }
+    if ((parts & KernPart) &&
+        !_kerning.load(section<uint8_t>(KernSec), _comp.kernLen, _glyphN))
+      // TODO
+      std::abort();
+  }
+
+  /// Gets a table's directory entry (byte-swapped), or null if missing.
+  ///
+  const DirEntry* table(uint32_t tag) const {
+    for (const auto& e : _dir) {
+      if (e.tag == tag)
+        return &e;
+    }
+    return nullptr;
+  }
+
+  /// Reads the font directory.
+  ///
+  bool loadDir() {
+    _ifs.seekg(0);
     DirSub sub;
-    ifs.read(reinterpret_cast<char*>(&sub), DirSubLen);
+    _ifs.read(reinterpret_cast<char*>(&sub), DirSubLen);
 
     const uint16_t tabN = betoh(sub.tabN);
-    std::vector<DirEntry> ents;
-    ents.resize(tabN);
-    ifs.read(reinterpret_cast<char*>(ents.data()), tabN*DirEntryLen);
+    _dir.resize(tabN);
+    _ifs.read(reinterpret_cast<char*>(_dir.data()), tabN*DirEntryLen);
+    if (!_ifs)
+      return false;
+    for (auto& e : _dir) {
+      e.tag = betoh(e.tag);
+      e.csum = betoh(e.csum);
+      e.off = betoh(e.off);
+      e.len = betoh(e.len);
+    }
 
-    int16_t cmapIdx, glyfIdx, headIdx, locaIdx, maxpIdx;
-    cmapIdx = glyfIdx = headIdx = locaIdx = maxpIdx = -1;
+    // the bare minimum for a TrueType
+    return table(CmapTag) && table(GlyfTag) && table(HeadTag) &&
+           table(LocaTag) && table(MaxpTag);
+  }
 
-    for (uint16_t i = 0; i < ents.size(); ++i) {
-      switch (betoh(ents[i].tag)) {
-        case CmapTag: cmapIdx = i; break;
-        case GlyfTag: glyfIdx = i; break;
-        case HeadTag: headIdx = i; break;
-        case LocaTag: locaIdx = i; break;
-        case MaxpTag: maxpIdx = i; break;
+  /// Identifies the font by its table directory (FNV-1a of every tag,
+  /// checksum and length).
+  ///
+  uint64_t fingerprint() const {
+    uint64_t h = 0xCBF29CE484222325;
+    for (const auto& e : _dir) {
+      for (const uint32_t v : {e.tag, e.csum, e.len}) {
+        for (uint32_t i = 0; i < 4; ++i)
+          h = (h ^ ((v >> 8*i) & 0xFF)) * 0x100000001B3;
       }
     }
+    return h;
+  }
 
-    // the bare minimum for a TrueType
-    if (cmapIdx < 0 || glyfIdx < 0 || headIdx < 0 || locaIdx < 0 || maxpIdx < 0)
-      return false;
-
+  /// Verifies table checksums.
+  ///
+  bool verify() {
+    const auto& kern = kernels::get();
+    std::pmr::vector<uint8_t> buf(_scratch);
+    for (const auto& e : _dir) {
+      if (e.tag == HeadTag)
+        continue;
+      const uint32_t len = (e.len + 3) & ~3;
+      buf.assign(len, 0);
+      _ifs.seekg(e.off);
+      _ifs.read(reinterpret_cast<char*>(buf.data()), e.len);
+      if (!_ifs || kern.checksum(buf.data(), len) != e.csum)
+        return false;
+    }
+    return true;
+  }
+
+  /// Loads the font header and maximum profile.
+  ///
+  bool loadHeader() {
     Head head;
-    ifs.seekg(betoh(ents[headIdx].off));
-    ifs.read(reinterpret_cast<char*>(&head), betoh(ents[headIdx].len));
+    const auto headEnt = table(HeadTag);
+    _ifs.seekg(headEnt->off);
+    _ifs.read(reinterpret_cast<char*>(&head), HeadLen);
     _upem = betoh(head.upem);
     _xMin = betoh(head.xMin);
     _yMin = betoh(head.yMin);
     _xMax = betoh(head.xMax);
     _yMax = betoh(head.yMax);
+    _locaFmt = betoh(head.locaFmt);
 
-    Maxp maxp;
-    ifs.seekg(betoh(ents[maxpIdx].off));
-    ifs.read(reinterpret_cast<char*>(&maxp), betoh(ents[maxpIdx].len));
+    Maxp maxp{};
+    const auto maxpEnt = table(MaxpTag);
+    _ifs.seekg(maxpEnt->off);
+    _ifs.read(reinterpret_cast<char*>(&maxp),
+              std::min(maxpEnt->len, MaxpLen));
     _glyphN = betoh(maxp.glyphN);
     _maxPts = betoh(maxp.maxPts);
     _maxCntrs = betoh(maxp.maxCntrs);
     _maxCompPts = betoh(maxp.maxCompPts);
     _maxCompCntrs = betoh(maxp.maxCompCntrs);
 
+    return _ifs && _upem != 0;
+  }
+
+  /// Loads horizontal metrics.
+  ///
+  /// Metrics are expanded to one entry per glyph - the last advance repeats
+  /// for glyphs that only have a side bearing.
+  ///
+  void loadHmtx() {
+    _advs.assign(_glyphN, 0);
+    _lsbs.assign(_glyphN, 0);
+    const auto hheaEnt = table(HheaTag);
+    const auto hmtxEnt = table(HmtxTag);
+    if (!hheaEnt || !hmtxEnt)
+      return;
+
+    Hhea hhea;
+    _ifs.seekg(hheaEnt->off);
+    _ifs.read(reinterpret_cast<char*>(&hhea), HheaLen);
+    const uint16_t hmtxN = std::min(betoh(hhea.hmtxN), _glyphN);
+    std::pmr::vector<Hmtx> hmtx(hmtxN, _scratch);
+    _ifs.seekg(hmtxEnt->off);
+    _ifs.read(reinterpret_cast<char*>(hmtx.data()), hmtxN*HmtxLen);
+    for (uint16_t i = 0; i < hmtxN; ++i) {
+      _advs[i] = betoh(hmtx[i].adv);
+      _lsbs[i] = betoh(hmtx[i].lsb);
+    }
+    if (hmtxN > 0 && hmtxN < _glyphN) {
+      std::fill(_advs.begin()+hmtxN, _advs.end(), _advs[hmtxN-1]);
+      _ifs.read(reinterpret_cast<char*>(&_lsbs[hmtxN]),
+                (_glyphN-hmtxN)*sizeof(int16_t));
+      std::for_each(_lsbs.begin()+hmtxN, _lsbs.end(),
+                    [](auto& lsb) { lsb = betoh(lsb); });
+    }
+  }
+
+  /// Loads the character to glyph mapping.
+  ///
+  void loadCmap() {
+    const uint32_t cmapOff = table(CmapTag)->off;
     CmapIndex cmi;
-    ifs.seekg(betoh(ents[cmapIdx].off));
-    ifs.read(reinterpret_cast<char*>(&cmi), CmapIndexLen);
+    _ifs.seekg(cmapOff);
+    _ifs.read(reinterpret_cast<char*>(&cmi), CmapIndexLen);
 
     const uint16_t cmeN = betoh(cmi.subN);
-    std::vector<CmapEncoding> cmes;
-    cmes.resize(cmeN);
-    ifs.read(reinterpret_cast<char*>(cmes.data()), cmeN*CmapEncodingLen);
+    std::pmr::vector<CmapEncoding> cmes(cmeN, _scratch);
+    _ifs.read(reinterpret_cast<char*>(cmes.data()), cmeN*CmapEncodingLen);
 
     // encodings: Unicode (sparse), Macintosh (roman, trimmed), Windows (sparse)
     const struct {
@@ -371,13 +1793,13 @@ class SFNT {
         // sparse format
         case 4: {
           Cmap4 cm4;
-          ifs.seekg(betoh(ents[cmapIdx].off) + betoh(cme.off));
-          ifs.read(reinterpret_cast<char*>(&cm4), Cmap4Len);
+          _ifs.seekg(cmapOff + betoh(cme.off));
+          _ifs.read(reinterpret_cast<char*>(&cm4), Cmap4Len);
           const uint16_t segCount = betoh(cm4.segCount2x) / 2;
           const uint16_t len = betoh(cm4.len);
           const uint16_t subLen = len > Cmap4Len ? len-Cmap4Len : Cmap4Len-len;
-          auto var = std::make_unique<uint16_t[]>(subLen/2);
-          ifs.read(reinterpret_cast<char*>(var.get()), subLen);
+          std::pmr::vector<uint16_t> var(subLen/2, _scratch);
+          _ifs.read(reinterpret_cast<char*>(var.data()), subLen);
           uint16_t endCode, startCode, code, delta, rngOff, idx;
           for (uint16_t i = 0; var[i] != 0xFFFF; ++i) {
             endCode = betoh(var[i]);
@@ -401,13 +1823,13 @@ class SFNT {
         // trimmed format
         case 6: {
           Cmap6 cm6;
-          ifs.seekg(betoh(ents[cmapIdx].off) + betoh(cme.off));
-          ifs.read(reinterpret_cast<char*>(&cm6), Cmap6Len);
+          _ifs.seekg(cmapOff + betoh(cme.off));
+          _ifs.read(reinterpret_cast<char*>(&cm6), Cmap6Len);
           const uint16_t firstCode = betoh(cm6.firstCode);
           const uint16_t entN = betoh(cm6.entN);
           uint16_t idx;
           for (uint16_t c = firstCode; c < entN; ++c) {
-            ifs.read(reinterpret_cast<char*>(&idx), sizeof idx);
+            _ifs.read(reinterpret_cast<char*>(&idx), sizeof idx);
             _cmap.emplace(c, betoh(idx));
           }
         } break;
@@ -421,12 +1843,12 @@ class SFNT {
           betoh(cme.specID) != enc.specID)
         { continue; }
         uint16_t v;
-        ifs.seekg(betoh(ents[cmapIdx].off) + betoh(cme.off));
-        ifs.read(reinterpret_cast<char*>(&v), sizeof v);
+        _ifs.seekg(cmapOff + betoh(cme.off));
+        _ifs.read(reinterpret_cast<char*>(&v), sizeof v);
         if (betoh(v) != enc.fmt)
           continue;
-        ifs.seekg(2, std::ios_base::cur);
-        ifs.read(reinterpret_cast<char*>(&v), sizeof v);
+        _ifs.seekg(2, std::ios_base::cur);
+        _ifs.read(reinterpret_cast<char*>(&v), sizeof v);
         if (betoh(v) != enc.lang)
           continue;
         setMapping(cme, enc.fmt);
@@ -436,48 +1858,434 @@ class SFNT {
         break;
     }
 
-    // glyph offsets stored pre-multiplied/byte-swapped
-    _loca = std::make_unique<uint32_t[]>(_glyphN+1);
-    ifs.seekg(betoh(ents[locaIdx].off));
-    if (head.locaFmt == 0) {
-      uint16_t v;
-      for (uint16_t i = 0; i < _glyphN+1; ++i) {
-        ifs.read(reinterpret_cast<char*>(&v), 2);
-        _loca[i] = 2 * betoh(v);
+    for (uint32_t c = 0; c < 256; ++c) {
+      const auto it = _cmap.find(c);
+      _latin[c] = it != _cmap.end() ? it->second : NoGlyph;
+    }
+  }
+
+  /// Loads the axes of a variable font ('fvar'), and their maps ('avar').
+  ///
+  /// Fonts whose axes are not valid are taken as not variable.
+  ///
+  void loadAxes() {
+    auto read = [&](const DirEntry* ent) {
+      std::pmr::vector<uint8_t> buf(ent ? ent->len : 0, _scratch);
+      if (ent) {
+        _ifs.seekg(ent->off);
+        _ifs.read(reinterpret_cast<char*>(buf.data()), buf.size());
       }
+      return buf;
+    };
+
+    const auto fvar = read(table(FvarTag));
+    bool valid = !fvar.empty();
+    auto u16 = [&](const auto& buf, size_t off) {
+      return peek<uint16_t>(buf.data(), buf.size(), off, valid);
+    };
+    auto fixed = [&](size_t off) {
+      return peek<int32_t>(fvar.data(), fvar.size(), off, valid) / 65536.0f;
+    };
+    const uint16_t axisOff = u16(fvar, 4);
+    const uint16_t axisN = u16(fvar, 8);
+    const uint16_t axisLen = u16(fvar, 10);
+    for (uint16_t i = 0; i < axisN && valid; ++i) {
+      const size_t off = axisOff + size_t(i)*axisLen;
+      const Axis axis{peek<uint32_t>(fvar.data(), fvar.size(), off, valid),
+                      fixed(off+4), fixed(off+8), fixed(off+12)};
+      if (axis.min > axis.def || axis.def > axis.max)
+        valid = false;
+      _axes.push_back(axis);
+    }
+    if (!valid) {
+      _axes.clear();
+      return;
+    }
+
+    // maps are only used if there is one per axis
+    const auto avar = read(table(AvarTag));
+    if (avar.empty() || u16(avar, 6) != axisN)
+      return;
+    size_t off = 8;
+    for (uint16_t i = 0; i < axisN && valid; ++i) {
+      const uint16_t n = u16(avar, off);
+      _avar.emplace_back();
+      for (uint16_t j = 0; j < n && valid; ++j) {
+        const int16_t from = u16(avar, off+2+4*j);
+        const int16_t to = u16(avar, off+4+4*j);
+        if (j > 0 && from < _avar.back().back().first)
+          valid = false;
+        _avar.back().push_back({from, to});
+      }
+      off += 2 + 4*n;
+    }
+    if (!valid)
+      _avar.clear();
+  }
+
+  /// Loads glyph variations.
+  ///
+  /// The table is kept as is, and each glyph's deltas decoded when the
+  /// glyph is instanced. Tables that do not match the font's axes and
+  /// glyphs are left out.
+  ///
+  void loadGvar() {
+    const auto gvarEnt = table(GvarTag);
+    if (!gvarEnt || _axes.empty())
+      return;
+    _gvar.assign(gvarEnt->len, 0);
+    _ifs.seekg(gvarEnt->off);
+    _ifs.read(reinterpret_cast<char*>(_gvar.data()), _gvar.size());
+
+    bool valid = true;
+    auto u16 = [&](size_t off) {
+      return peek<uint16_t>(_gvar.data(), _gvar.size(), off, valid);
+    };
+    auto u32 = [&](size_t off) {
+      return peek<uint32_t>(_gvar.data(), _gvar.size(), off, valid);
+    };
+    _gvarShared = u32(8);
+    _gvarSharedN = u16(6);
+    _gvarData = u32(16);
+    _gvarLong = u16(14) & 1;
+    const size_t offsLen = (_glyphN+1) * (_gvarLong ? 4 : 2);
+    if (u16(0) != 1 || u16(4) != _axes.size() || u16(12) != _glyphN ||
+        !valid || 20 + offsLen > _gvar.size() ||
+        _gvarShared + size_t(_gvarSharedN)*_axes.size()*2 > _gvar.size())
+    { decltype(_gvar){_font}.swap(_gvar); }
+  }
+
+  /// Loads glyph locations, pre-multiplied and byte-swapped.
+  ///
+  template<class T>
+  void loadLoca(T& loca) {
+    loca.assign(_glyphN+1, 0);
+    _ifs.seekg(table(LocaTag)->off);
+    if (_locaFmt == 0) {
+      std::pmr::vector<uint16_t> shortLoca(_glyphN+1, _scratch);
+      _ifs.read(reinterpret_cast<char*>(shortLoca.data()),
+                shortLoca.size()*2);
+      for (uint32_t i = 0; i < shortLoca.size(); ++i)
+        loca[i] = 2 * betoh(shortLoca[i]);
     } else {
-      for (uint16_t i = 0; i < _glyphN+1; ++i) {
-        ifs.read(reinterpret_cast<char*>(&_loca[i]), 4);
-        _loca[i] = betoh(_loca[i]);
+      _ifs.read(reinterpret_cast<char*>(loca.data()), (_glyphN+1)*4);
+      for (uint32_t i = 0; i < _glyphN+1u; ++i)
+        loca[i] = betoh(loca[i]);
+    }
+  }
+
+  /// Loads the bounds of each glyph.
+  ///
+  /// Only 'loca' and the header of each glyph description are read, so
+  /// that metrics never decode outlines.
+  ///
+  void loadBounds() {
+    std::pmr::vector<uint32_t> loca(_scratch);
+    loadLoca(loca);
+    _bounds.assign(_glyphN, {0, 0, 0, 0});
+    const auto glyfEnt = table(GlyfTag);
+    for (uint16_t i = 0; i < _glyphN; ++i) {
+      if (loca[i] == loca[i+1] || loca[i] + GlyfLen > glyfEnt->len)
+        continue;
+      Glyf glyf;
+      _ifs.seekg(glyfEnt->off + loca[i]);
+      _ifs.read(reinterpret_cast<char*>(&glyf), GlyfLen);
+      _bounds[i] = {betoh(glyf.xMin), betoh(glyf.yMin), betoh(glyf.xMax),
+                    betoh(glyf.yMax)};
+    }
+  }
+
+  /// Loads glyph locations and descriptions.
+  ///
+  void loadGlyf() {
+    loadLoca(_loca);
+
+    // glyph descriptions stored as raw data, padded for the coordinate
+    // decoder's over-reads
+    const auto glyfEnt = table(GlyfTag);
+    const uint32_t glyfLen = (glyfEnt->len + 1) & ~1;
+    _glyf.assign(glyfLen + GlyfPad, 0);
+    _ifs.seekg(glyfEnt->off);
+    _ifs.read(reinterpret_cast<char*>(_glyf.data()), glyfEnt->len);
+  }
+
+  /// Loads kerning pairs.
+  ///
+  /// Pair adjustments of the 'kern' feature in 'GPOS' take precedence; the
+  /// 'kern' table is used when 'GPOS' gives no pairs (it may be missing,
+  /// have no such lookups, or fail to parse).
+  ///
+  void loadKerning() {
+    const auto gposEnt = table(GposTag);
+    const auto kernEnt = table(KernTag);
+    if (gposEnt) {
+      std::pmr::vector<uint8_t> gpos(gposEnt->len, _scratch);
+      _ifs.seekg(gposEnt->off);
+      _ifs.read(reinterpret_cast<char*>(gpos.data()), gpos.size());
+      if (!loadGpos(gpos))
+        _kerning = Kerning{_font};
+    }
+
+    // horizontal kerning pairs (format 0)
+    if (_kerning.empty() && kernEnt) {
+      KernIndex ki;
+      _ifs.seekg(kernEnt->off);
+      _ifs.read(reinterpret_cast<char*>(&ki), KernIndexLen);
+      // XXX: Only the original (version 0) table layout is handled.
+      const uint16_t subN = betoh(ki.version) == 0 ? betoh(ki.subN) : 0;
+      uint32_t subOff = kernEnt->off + KernIndexLen;
+      for (uint16_t i = 0; i < subN; ++i) {
+        KernSub ks;
+        _ifs.seekg(subOff);
+        _ifs.read(reinterpret_cast<char*>(&ks), KernSubLen);
+        subOff += betoh(ks.len);
+        // horizontal, not minimum/cross-stream/override, format 0
+        if ((betoh(ks.coverage) & 0xFF0F) != 1)
+          continue;
+        Kern0 k0;
+        _ifs.read(reinterpret_cast<char*>(&k0), Kern0Len);
+        std::pmr::vector<KernPair> pairs(betoh(k0.pairN), _scratch);
+        _ifs.read(reinterpret_cast<char*>(pairs.data()),
+                  pairs.size()*KernPairLen);
+        for (const auto& kp : pairs)
+          _kerning.addPair(betoh(kp.left), betoh(kp.right), betoh(kp.value));
       }
     }
 
-    // glyph descriptions stored as raw data
-    const uint32_t glyfLen = (betoh(ents[glyfIdx].len) + 1) & ~1;
-    _glyf = std::make_unique<uint8_t[]>(glyfLen);
-    ifs.seekg(betoh(ents[glyfIdx].off));
-    ifs.read(reinterpret_cast<char*>(_glyf.get()), glyfLen);
+    _kerning.build(_glyphN);
+  }
 
-    return true;
+  /// Loads the pair adjustment lookups of the 'kern' feature.
+  ///
+  /// Only the x advance of the first glyph is taken. Class pair subtables
+  /// whose values run past the table are dropped.
+  ///
+  bool loadGpos(const std::pmr::vector<uint8_t>& gpos) {
+    bool valid = true;
+    auto u16 = [&](uint32_t off) -> uint16_t {
+      if (off+2 > gpos.size()) {
+        valid = false;
+        return 0;
+      }
+      return (gpos[off] << 8) | gpos[off+1];
+    };
+    auto u32 = [&](uint32_t off) -> uint32_t {
+      return (uint32_t(u16(off)) << 16) | u16(off+2);
+    };
+
+    // glyphs of a coverage table, in coverage index order
+    auto coverage = [&](uint32_t off) {
+      std::pmr::vector<uint16_t> glyphs(_scratch);
+      const uint16_t fmt = u16(off);
+      const uint16_t n = u16(off+2);
+      for (uint16_t i = 0; i < n && valid; ++i) {
+        if (fmt == 1) {
+          glyphs.push_back(u16(off+4+2*i));
+        } else if (fmt == 2) {
+          const uint32_t rec = off+4+6*i;
+          for (uint32_t g = u16(rec); g <= u16(rec+2) && valid; ++g)
+            glyphs.push_back(g);
+        }
+      }
+      return glyphs;
+    };
+
+    // class of every glyph, defaulting to zero
+    auto classDef = [&](uint32_t off) {
+      std::pmr::vector<uint16_t> cls(_glyphN, 0, _scratch);
+      const uint16_t fmt = u16(off);
+      if (fmt == 1) {
+        const uint16_t start = u16(off+2);
+        const uint16_t n = u16(off+4);
+        for (uint32_t i = 0; i < n && start+i < _glyphN && valid; ++i)
+          cls[start+i] = u16(off+6+2*i);
+      } else if (fmt == 2) {
+        const uint16_t n = u16(off+2);
+        for (uint16_t i = 0; i < n && valid; ++i) {
+          const uint32_t rec = off+4+6*i;
+          const uint16_t c = u16(rec+4);
+          for (uint32_t g = u16(rec); g <= u16(rec+2) && g < _glyphN; ++g)
+            cls[g] = c;
+        }
+      }
+      return cls;
+    };
+
+    // size of a value record and position of its x advance
+    auto valueSize = [](uint16_t fmt) {
+      return 2 * __builtin_popcount(fmt & 0xFF);
+    };
+    auto xAdvance = [&](uint32_t rec, uint16_t fmt) -> int16_t {
+      if (!(fmt & 4))
+        return 0;
+      return u16(rec + 2*__builtin_popcount(fmt & 3));
+    };
+
+    auto pairPos = [&](uint32_t off) {
+      const uint16_t fmt = u16(off);
+      const uint16_t vf1 = u16(off+4);
+      const uint16_t vf2 = u16(off+6);
+      const uint32_t recLen = 2 + valueSize(vf1) + valueSize(vf2);
+      const auto cov = coverage(off + u16(off+2));
+
+      if (fmt == 1) {
+        const uint16_t setN = std::min<size_t>(u16(off+8), cov.size());
+        for (uint16_t i = 0; i < setN && valid; ++i) {
+          const uint32_t set = off + u16(off+10+2*i);
+          const uint16_t n = u16(set);
+          for (uint16_t j = 0; j < n && valid; ++j) {
+            const uint32_t rec = set+2 + j*recLen;
+            _kerning.addPair(cov[i], u16(rec), xAdvance(rec+2, vf1));
+          }
+        }
+      } else if (fmt == 2) {
+        const auto cd1 = classDef(off + u16(off+8));
+        auto cls2 = classDef(off + u16(off+10));
+        const uint16_t cls1N = u16(off+12);
+        const uint16_t cls2N = u16(off+14);
+        std::pmr::vector<uint16_t> cls1(_glyphN, Kerning::NoClass, _scratch);
+        for (const auto& g : cov) {
+          if (g < _glyphN && cd1[g] < cls1N)
+            cls1[g] = cd1[g];
+        }
+        std::for_each(cls2.begin(), cls2.end(),
+          [&](auto& c) { if (c >= cls2N) c = 0; });
+        // subtables whose values run past the table are dropped
+        const size_t cellN = size_t(cls1N) * cls2N;
+        const uint32_t cellLen = recLen-2;
+        if (off+16 + cellN*cellLen > gpos.size())
+          return;
+        std::pmr::vector<int16_t> values(cellN, _scratch);
+        for (size_t i = 0; i < cellN && valid; ++i)
+          values[i] = xAdvance(off+16 + i*cellLen, vf1);
+        if (valid)
+          _kerning.addClasses(cls1, cls2, cls2N, values);
+      }
+    };
+
+    // lookups referenced by 'kern' features, in lookup list order
+    const uint32_t featList = u16(6);
+    const uint32_t lookList = u16(8);
+    std::pmr::vector<uint16_t> lookups(_scratch);
+    const uint16_t featN = u16(featList);
+    for (uint16_t i = 0; i < featN && valid; ++i) {
+      const uint32_t rec = featList+2 + 6*i;
+      if (u32(rec) != ::makeTag('k', 'e', 'r', 'n'))
+        continue;
+      const uint32_t feat = featList + u16(rec+4);
+      const uint16_t n = u16(feat+2);
+      for (uint16_t j = 0; j < n; ++j)
+        lookups.push_back(u16(feat+4+2*j));
+    }
+    std::sort(lookups.begin(), lookups.end());
+    lookups.erase(std::unique(lookups.begin(), lookups.end()), lookups.end());
+
+    for (const auto& l : lookups) {
+      if (l >= u16(lookList))
+        continue;
+      const uint32_t look = lookList + u16(lookList+2+2*l);
+      const uint16_t type = u16(look);
+      const uint16_t subN = u16(look+4);
+      for (uint16_t i = 0; i < subN && valid; ++i) {
+        uint32_t sub = look + u16(look+6+2*i);
+        if (type == 9) {
+          // extension
+          if (u16(sub+2) != 2)
+            continue;
+          sub += u32(sub+4);
+        } else if (type != 2) {
+          continue;
+        }
+        pairPos(sub);
+      }
+    }
+
+    return valid;
   }
 
   /// Component of a glyph (simple glyph).
   ///
+  /// Copies keep the resource of the container they are copied into (see
+  /// 'allocator_type').
+  ///
   template<class T>
   struct Component {
     static_assert(std::is_arithmetic<T>(), "!is_arithmetic");
-    std::vector<uint16_t> cntrEnd; // last point indices, one per contour
-    std::vector<std::tuple<bool, T, T>> pts; // <on curve, x, y>
+    using allocator_type = std::pmr::polymorphic_allocator<Component>;
+    explicit Component(const allocator_type& alloc) :
+      cntrEnd(alloc), pts(alloc) {}
+    Component(const Component& other, const allocator_type& alloc) :
+      cntrEnd(other.cntrEnd, alloc), pts(other.pts, alloc) {}
+    Component(Component&& other, const allocator_type& alloc) :
+      cntrEnd(std::move(other.cntrEnd), alloc),
+      pts(std::move(other.pts), alloc) {}
+    Component(const Component&) = default;
+    Component(Component&&) = default;
+    Component& operator=(const Component&) = default;
+    Component& operator=(Component&&) = default;
+    std::pmr::vector<uint16_t> cntrEnd; // last point indices, one per contour
+    std::pmr::vector<std::tuple<bool, T, T>> pts; // <on curve, x, y>
   };
 
   /// Complete outline of a glyph.
   ///
+  /// Assigning an outline copies its components into the resource of the
+  /// outline assigned to.
+  ///
   template<class T>
   struct Outline {
-    T xMin, yMin, xMax, yMax; // boundaries of this particular outline
-    std::vector<Component<T>> comps; // every component of this outline
+    using allocator_type = std::pmr::polymorphic_allocator<Outline>;
+    explicit Outline(const allocator_type& alloc) : comps(alloc) {}
+    Outline(const Outline& other, const allocator_type& alloc) :
+      xMin(other.xMin), yMin(other.yMin), xMax(other.xMax),
+      yMax(other.yMax), comps(other.comps, alloc) {}
+    Outline(Outline&& other, const allocator_type& alloc) :
+      xMin(other.xMin), yMin(other.yMin), xMax(other.xMax),
+      yMax(other.yMax), comps(std::move(other.comps), alloc) {}
+    Outline(const Outline&) = default;
+    Outline(Outline&&) = default;
+    Outline& operator=(const Outline&) = default;
+    Outline& operator=(Outline&&) = default;
+    T xMin{}, yMin{}, xMax{}, yMax{}; // boundaries of this particular outline
+    std::pmr::vector<Component<T>> comps; // every component of this outline
   };
 
+  /// Finds the glyph index of a character code.
+  ///
+  bool find(wchar_t chr, uint16_t& index) {
+    if (static_cast<uint32_t>(chr) < 256) {
+      index = _latin[chr];
+      return index != NoGlyph;
+    }
+    if (static_cast<uint32_t>(chr) > 0xFFFF)
+      return false;
+    if (_map) {
+      uint32_t lo = 0, hi = _comp.cmapN;
+      while (lo < hi) {
+        const uint32_t mid = lo + (hi-lo) / 2;
+        if (at<uint16_t>(CodeSec, mid) < uint32_t(chr))
+          lo = mid+1;
+        else
+          hi = mid;
+      }
+      if (lo == _comp.cmapN || at<uint16_t>(CodeSec, lo) != uint32_t(chr))
+        return false;
+      index = at<uint16_t>(IndexSec, lo);
+      return true;
+    }
+    const auto it = _cmap.find(chr);
+    if (it == _cmap.end())
+      return false;
+    index = it->second;
+    return true;
+  }
+
+  /// Gets the kerning adjustment of a glyph pair, in FUnits.
+  ///
+  int16_t getKerning(uint16_t left, uint16_t right) {
+    return _kerning.get(left, right);
+  }
+
   /// Checks whether a glyph is made of parts (compound/composite).
   ///
   bool isCompound(uint16_t index) {
@@ -487,29 +2295,113 @@ class SFNT {
 
   /// Fetches glyph data.
   ///
-  void fetch(wchar_t glyph, Outline<int16_t>& outline) {
-    const auto it = _cmap.find(glyph);
-    if (it == _cmap.end())
-      return;
-    const uint16_t idx = it->second;
+  /// Returns the outline to draw - either 'outline', filled with a simple
+  /// glyph, or the cached flattening of a compound glyph.
+  ///
+  const Outline<int16_t>& fetch(uint16_t idx, Outline<int16_t>& outline) {
+    if (_map)
+      return fetchCompiled(idx, outline);
+    if (_loca[idx] == _loca[idx+1])
+      // no outline
+      return outline;
+    if (varied()) {
+      outline = instance(idx)->outline;
+      return outline;
+    }
+    if (isCompound(idx))
+      return fetchCompound(idx);
+
     const auto glyf = reinterpret_cast<Glyf*>(&_glyf[_loca[idx]]);
     outline.xMin = betoh(glyf->xMin);
     outline.yMin = betoh(glyf->yMin);
     outline.xMax = betoh(glyf->xMax);
     outline.yMax = betoh(glyf->yMax);
+    outline.comps.emplace_back();
+    fetchSimple(idx, outline.comps.back());
+    return outline;
+  }
 
-    if (isCompound(idx)) {
-      fetchCompound(idx, outline.comps);
-    } else {
-      outline.comps.push_back({});
-      fetchSimple(idx, outline.comps.back());
+  /// Checks whether a glyph has an outline.
+  ///
+  bool hasOutline(uint16_t index) const {
+    if (_map)
+      return at<CompGlyph>(GlyphSec, index).outlined;
+    return _loca[index] != _loca[index+1];
+  }
+
+  /// Fetches a glyph of a compiled font.
+  ///
+  const Outline<int16_t>& fetchCompiled(uint16_t idx,
+                                        Outline<int16_t>& outline) {
+    const auto glyph = at<CompGlyph>(GlyphSec, idx);
+    if (!glyph.outlined)
+      return outline;
+    if (glyph.pt > _comp.ptN || glyph.ptN > _comp.ptN - glyph.pt ||
+        glyph.cntr > _comp.cntrN || glyph.cntrN > _comp.cntrN - glyph.cntr)
+      // TODO
+      std::abort();
+
+    outline.xMin = glyph.xMin;
+    outline.yMin = glyph.yMin;
+    outline.xMax = glyph.xMax;
+    outline.yMax = glyph.yMax;
+    outline.comps.emplace_back();
+    auto& comp = outline.comps.back();
+    comp.cntrEnd.reserve(glyph.cntrN);
+    for (uint16_t i = 0; i < glyph.cntrN; ++i) {
+      const uint16_t end = at<uint16_t>(EndSec, glyph.cntr+i);
+      if (end >= glyph.ptN || (i > 0 && end < comp.cntrEnd.back()))
+        // TODO
+        std::abort();
+      comp.cntrEnd.push_back(end);
     }
+    const auto ons = section<uint8_t>(OnSec) + glyph.pt;
+    comp.pts.reserve(glyph.ptN);
+    for (uint32_t i = 0; i < glyph.ptN; ++i)
+      comp.pts.emplace_back(ons[i] != 0, at<int16_t>(XSec, glyph.pt+i),
+                            at<int16_t>(YSec, glyph.pt+i));
+    return outline;
   }
 
   /// Fetches a compound glyph.
   ///
-  void fetchCompound(uint16_t index, std::vector<Component<int16_t>>& comps) {
-    uint16_t itOff = comps.size();
+  /// The first request flattens the glyph into a single component, which
+  /// is kept for the lifetime of the font. Cached outlines are never
+  /// modified, so they can be read without holding the lock.
+  ///
+  const Outline<int16_t>& fetchCompound(uint16_t index) {
+    {
+      std::lock_guard<std::mutex> lock(_compMtx);
+      const auto it = _compounds.find(index);
+      if (it != _compounds.end())
+        return it->second;
+    }
+
+    Outline<int16_t> outline(_font);
+    const auto glyf = reinterpret_cast<Glyf*>(&_glyf[_loca[index]]);
+    outline.xMin = betoh(glyf->xMin);
+    outline.yMin = betoh(glyf->yMin);
+    outline.xMax = betoh(glyf->xMax);
+    outline.yMax = betoh(glyf->yMax);
+    outline.comps.emplace_back();
+    flatten(index, outline.comps.back(), 0);
+
+    // another thread may have got here first
+    std::lock_guard<std::mutex> lock(_compMtx);
+    return _compounds.emplace(index, std::move(outline)).first->second;
+  }
+
+  /// Maximum nesting of compound glyphs.
+  ///
+  static constexpr uint16_t MaxDepth = 16;
+
+  /// Appends the transformed components of a compound glyph to 'dst'.
+  ///
+  /// Point numbers of matched components refer to the points appended so
+  /// far and to the points of the component itself, as in the font file.
+  ///
+  void flatten(uint16_t index, Component<int16_t>& dst, uint16_t depth,
+               double* phantoms = nullptr) {
     uint32_t curOff = _loca[index] + sizeof(Glyf);
 
     auto getWord = [&] {
@@ -518,164 +2410,544 @@ class SFNT {
       return wd;
     };
 
-    uint16_t flags;
-    uint16_t idx;
-    int16_t arg1, arg2;
-    int16_t a, b, c, d;
+    // offsets of the instance, for components placed by offset
+    std::pmr::vector<double> dxs(_scratch), dys(_scratch);
+    if (varied()) {
+      uint32_t compN = 0;
+      const uint32_t off = curOff;
+      uint16_t flags;
+      do {
+        flags = getWord();
+        curOff += 2 + ((flags & 1) ? 4 : 2);
+        curOff += (flags & 8) ? 2 : (flags & 64) ? 4 : (flags & 128) ? 8 : 0;
+        ++compN;
+      } while (flags & 32);
+      curOff = off;
+      dxs.assign(compN+4, 0.0);
+      dys.assign(compN+4, 0.0);
+      deltas(index, compN+4, nullptr, dxs.data(), dys.data());
+      if (phantoms) {
+        phantoms[0] = dxs[compN];
+        phantoms[1] = dxs[compN+1];
+      }
+    }
 
-    // iterate over each component
+    uint16_t flags;
+    uint32_t compI = 0;
     do {
       flags = getWord();
-      idx = getWord();
-
-      if (isCompound(idx)) {
-        fetchCompound(idx, comps);
-      } else {
-        comps.push_back({});
-        fetchSimple(idx, comps.back());
-      }
+      const uint16_t idx = getWord();
 
+      int32_t arg1, arg2;
       if (flags & 1) {
         // arg1 & arg2 are 2-bytes long
         arg1 = getWord();
         arg2 = getWord();
+      } else if (flags & 2) {
+        // arg1 & arg2 are signed offsets, 1-byte long
+        arg1 = static_cast<int8_t>(_glyf[curOff++]);
+        arg2 = static_cast<int8_t>(_glyf[curOff++]);
       } else {
-        // arg1 & arg2 are 1-byte long
+        // arg1 & arg2 are point numbers, 1-byte long
         arg1 = _glyf[curOff++];
         arg2 = _glyf[curOff++];
       }
-
-      if (flags & 2) {
-        // args are xy values
-        std::for_each(comps.begin()+itOff, comps.end(), [&](auto& comp) {
-          std::for_each(comp.pts.begin(), comp.pts.end(), [&](auto& pt) {
-            std::get<1>(pt) += arg1;
-            std::get<2>(pt) += arg2;
-          });
-        });
-      } else {
-        // args are points
-        // TODO
-        std::abort();
+      if (!(flags & 2)) {
+        // point numbers are unsigned
+        arg1 &= 0xFFFF;
+        arg2 &= 0xFFFF;
+      } else if (!dxs.empty()) {
+        arg1 = otRound(arg1 + dxs[compI]);
+        arg2 = otRound(arg2 + dys[compI]);
       }
+      ++compI;
 
-      // TODO: Apply transform.
+      // 2x2 transform, in F2Dot14
+      float a = 1.0f, b = 0.0, c = 0.0, d = 1.0f;
       if (flags & 8) {
         // simple scale
-        a = d = getWord();
-        b = c = 0;
+        a = d = getWord() / 16384.0f;
       } else if (flags & 64) {
         // different scales
-        a = getWord();
-        d = getWord();
-        b = c = 0;
+        a = getWord() / 16384.0f;
+        d = getWord() / 16384.0f;
       } else if (flags & 128) {
         // 2x2 transform
-        a = getWord();
-        b = getWord();
-        c = getWord();
-        d = getWord();
-      } else {
-        // as is
-        a = d = 1;
-        b = c = 0;
+        a = getWord() / 16384.0f;
+        b = getWord() / 16384.0f;
+        c = getWord() / 16384.0f;
+        d = getWord() / 16384.0f;
+      }
+
+      if (idx >= _glyphN || _loca[idx] == _loca[idx+1])
+        continue;
+      Component<int16_t> comp(_scratch);
+      if (!isCompound(idx)) {
+        fetchSimple(idx, comp);
+        if (varied())
+          vary(idx, comp, nullptr);
+      } else if (depth < MaxDepth) {
+        flatten(idx, comp, depth+1);
       }
 
-      ++itOff;
+      const bool identity = a == 1.0f && b == 0.0 && c == 0.0 && d == 1.0f;
+      auto xform = [&](float x, float y) {
+        return std::make_pair(x*a + y*c, x*b + y*d);
+      };
+
+      // offsets are rounded along with the points, not on their own
+      float dx = 0.0, dy = 0.0;
+      if (flags & 2) {
+        // args are xy values, scaled only when requested
+        dx = arg1;
+        dy = arg2;
+        if ((flags & 0x800) && !(flags & 0x1000))
+          std::tie(dx, dy) = xform(arg1, arg2);
+      } else if (static_cast<uint32_t>(arg1) < dst.pts.size() &&
+                 static_cast<uint32_t>(arg2) < comp.pts.size()) {
+        // args are points, the second moved onto the first
+        const auto& p2 = comp.pts[arg2];
+        const auto pt = xform(std::get<1>(p2), std::get<2>(p2));
+        dx = std::get<1>(dst.pts[arg1]) - pt.first;
+        dy = std::get<2>(dst.pts[arg1]) - pt.second;
+      }
+      if (!identity || dx != 0.0 || dy != 0.0) {
+        for (auto& pt : comp.pts) {
+          const auto xy = xform(std::get<1>(pt), std::get<2>(pt));
+          std::get<1>(pt) = std::lround(xy.first + dx);
+          std::get<2>(pt) = std::lround(xy.second + dy);
+        }
+      }
+
+      const uint16_t base = dst.pts.size();
+      dst.pts.insert(dst.pts.end(), comp.pts.begin(), comp.pts.end());
+      for (const auto& end : comp.cntrEnd)
+        dst.cntrEnd.push_back(base + end);
     } while (flags & 32);
   }
 
+  /// Checks whether an instance other than the default is selected.
+  ///
+  bool varied() const {
+    return _varPrint != 0;
+  }
+
+  /// Gets the advance width of a glyph, in FUnits.
+  ///
+  float advance(uint16_t index) {
+    return varied() ? instance(index)->adv : _advs[index];
+  }
+
+  /// Glyph of the selected instance of a variable font.
+  ///
+  struct Instance {
+    explicit Instance(std::pmr::memory_resource* mem) :
+      coords(mem), outline(mem) {}
+    uint16_t index;
+    std::pmr::vector<int16_t> coords; // normalized, in F2Dot14
+    Outline<int16_t> outline;
+    uint16_t adv;
+    int16_t lsb;
+  };
+
+  /// Most instanced glyphs kept at once - the oldest are dropped first.
+  ///
+  static constexpr uint32_t InstanceMax = 1024;
+
+  /// Gets a glyph of the selected instance, from the cache if there.
+  ///
+  /// Outlines are varied point by point, and rounded like the instances
+  /// that font tools write. Advances and bearings follow the deltas of
+  /// the horizontal phantom points.
+  ///
+  std::shared_ptr<const Instance> instance(uint16_t index) {
+    uint64_t key = (_varPrint ^ index) * 0xBF58476D1CE4E5B9;
+    key ^= key >> 31;
+    {
+      std::lock_guard<std::mutex> lock(_instMtx);
+      const auto it = _instances.find(key);
+      if (it != _instances.end() && it->second->index == index &&
+          it->second->coords == _coords)
+      { return it->second; }
+    }
+
+    need(GlyfPart | HmtxPart | VarPart);
+    auto inst = std::allocate_shared<Instance>(
+      std::pmr::polymorphic_allocator<Instance>(_font), _font);
+    inst->index = index;
+    inst->coords = _coords;
+    auto& outline = inst->outline;
+    double phantoms[2] = {0.0, 0.0};
+    int16_t xMin = 0;
+    if (_loca[index] != _loca[index+1]) {
+      const auto glyf = reinterpret_cast<Glyf*>(&_glyf[_loca[index]]);
+      xMin = betoh(glyf->xMin);
+      outline.comps.emplace_back();
+      auto& comp = outline.comps.back();
+      if (isCompound(index)) {
+        flatten(index, comp, 0, phantoms);
+      } else {
+        fetchSimple(index, comp);
+        vary(index, comp, phantoms);
+      }
+      if (comp.pts.empty()) {
+        outline.comps.clear();
+      } else {
+        outline.xMin = outline.yMin = INT16_MAX;
+        outline.xMax = outline.yMax = INT16_MIN;
+        for (const auto& pt : comp.pts) {
+          outline.xMin = std::min(outline.xMin, std::get<1>(pt));
+          outline.yMin = std::min(outline.yMin, std::get<2>(pt));
+          outline.xMax = std::max(outline.xMax, std::get<1>(pt));
+          outline.yMax = std::max(outline.yMax, std::get<2>(pt));
+        }
+      }
+    } else {
+      double dxs[4] = {}, dys[4] = {};
+      deltas(index, 4, nullptr, dxs, dys);
+      phantoms[0] = dxs[0];
+      phantoms[1] = dxs[1];
+    }
+    const double left = xMin - _lsbs[index] + phantoms[0];
+    const double right = xMin - _lsbs[index] + _advs[index] + phantoms[1];
+    inst->adv = std::max(0, otRound(right - left));
+    inst->lsb = otRound(outline.xMin - left);
+
+    std::lock_guard<std::mutex> lock(_instMtx);
+    // a key already in the ring (after a collision, or a race with
+    // another thread) only has its instance replaced
+    if (_instances.count(key) == 0) {
+      if (_instRing.size() < InstanceMax) {
+        _instRing.push_back(key);
+      } else {
+        _instances.erase(_instRing[_instNext]);
+        _instRing[_instNext] = key;
+        _instNext = (_instNext+1) % InstanceMax;
+      }
+    }
+    _instances[key] = inst;
+    return inst;
+  }
+
+  /// Applies the deltas of the selected instance to a simple glyph.
+  ///
+  /// 'phantoms', if given, receives the x deltas of the left and right
+  /// phantom points.
+  ///
+  void vary(uint16_t index, Component<int16_t>& comp, double* phantoms) {
+    const uint32_t ptN = comp.pts.size();
+    std::pmr::vector<double> dxs(ptN+4, 0.0, _scratch);
+    std::pmr::vector<double> dys(ptN+4, 0.0, _scratch);
+    if (!deltas(index, ptN+4, &comp, dxs.data(), dys.data()))
+      return;
+    for (uint32_t i = 0; i < ptN; ++i) {
+      auto& pt = comp.pts[i];
+      std::get<1>(pt) = otRound(std::get<1>(pt) + dxs[i]);
+      std::get<2>(pt) = otRound(std::get<2>(pt) + dys[i]);
+    }
+    if (phantoms) {
+      phantoms[0] = dxs[ptN];
+      phantoms[1] = dxs[ptN+1];
+    }
+  }
+
+  /// Accumulates the deltas of a glyph at the selected coordinates.
+  ///
+  /// 'ptN' counts the glyph's points, including the four phantom points
+  /// (for compound glyphs, each component has one point). Points that a
+  /// variation leaves out are inferred from their neighbors on the same
+  /// contour of 'comp', if given, or left in place otherwise.
+  ///
+  /// Returns false if the glyph has no variations.
+  ///
+  bool deltas(uint16_t index, uint32_t ptN, const Component<int16_t>* comp,
+              double* dxs, double* dys) {
+    if (_gvar.empty())
+      return false;
+    const uint8_t* gvar = _gvar.data();
+    const size_t len = _gvar.size();
+    bool valid = true;
+    auto offset = [&](uint32_t i) -> size_t {
+      if (_gvarLong)
+        return peek<uint32_t>(gvar, len, 20 + 4*i, valid);
+      return peek<uint16_t>(gvar, len, 20 + 2*i, valid) * 2;
+    };
+    const size_t beg = size_t(_gvarData) + offset(index);
+    const size_t end = std::min(size_t(_gvarData) + offset(index+1), len);
+    if (!valid || beg >= end)
+      return false;
+
+    // reads within the glyph's variation data
+    auto u8 = [&](size_t off) {
+      return peek<uint8_t>(gvar, end, off, valid);
+    };
+    auto u16 = [&](size_t off) {
+      return peek<uint16_t>(gvar, end, off, valid);
+    };
+
+    // packed point numbers, empty for all points
+    auto points = [&](size_t& off, std::pmr::vector<uint16_t>& pts) {
+      pts.clear();
+      uint32_t n = u8(off++);
+      if (n & 0x80)
+        n = ((n & 0x7F) << 8) | u8(off++);
+      uint16_t pt = 0;
+      while (pts.size() < n && valid) {
+        const uint8_t ctrl = u8(off++);
+        const uint32_t run = (ctrl & 0x7F) + 1;
+        for (uint32_t i = 0; i < run && pts.size() < n && valid; ++i) {
+          if (ctrl & 0x80) {
+            pt += u16(off);
+            off += 2;
+          } else {
+            pt += u8(off++);
+          }
+          pts.push_back(pt);
+        }
+      }
+    };
+
+    // packed deltas
+    auto unpack = [&](size_t& off, uint32_t n, std::pmr::vector<double>& ds) {
+      ds.clear();
+      while (ds.size() < n && valid) {
+        const uint8_t ctrl = u8(off++);
+        const uint32_t run = (ctrl & 0x3F) + 1;
+        for (uint32_t i = 0; i < run && ds.size() < n && valid; ++i) {
+          if ((ctrl & 0xC0) == 0xC0) {
+            ds.push_back(int32_t(peek<uint32_t>(gvar, end, off, valid)));
+            off += 4;
+          } else if (ctrl & 0x80) {
+            ds.push_back(0.0);
+          } else if (ctrl & 0x40) {
+            ds.push_back(int16_t(u16(off)));
+            off += 2;
+          } else {
+            ds.push_back(int8_t(u8(off++)));
+          }
+        }
+      }
+    };
+
+    // scalar of a tuple's region at the selected coordinates
+    const uint32_t axisN = _axes.size();
+    auto scalar = [&](size_t peakOff, size_t interOff, bool inter) {
+      double scl = 1.0;
+      for (uint32_t i = 0; i < axisN && scl != 0.0; ++i) {
+        const int16_t peak = peek<uint16_t>(gvar, len, peakOff + 2*i, valid);
+        const int16_t v = _coords[i];
+        if (peak == 0 || v == peak)
+          continue;
+        int16_t lo = std::min<int16_t>(peak, 0);
+        int16_t hi = std::max<int16_t>(peak, 0);
+        if (inter) {
+          lo = u16(interOff + 2*i);
+          hi = u16(interOff + 2*(axisN+i));
+          if (lo > peak || peak > hi || (lo < 0 && hi > 0))
+            continue;
+        }
+        if (v <= lo || v >= hi)
+          scl = 0.0;
+        else if (v < peak)
+          scl *= double(v - lo) / (peak - lo);
+        else
+          scl *= double(hi - v) / (hi - peak);
+      }
+      return scl;
+    };
+
+    const uint16_t tupleN = u16(beg) & 0x0FFF;
+    const bool sharedPts = u16(beg) & 0x8000;
+    size_t hdr = beg + 4;
+    size_t data = beg + u16(beg+2);
+    std::pmr::vector<uint16_t> shared(_scratch), priv(_scratch);
+    if (sharedPts)
+      points(data, shared);
+
+    std::pmr::vector<double> xs(_scratch), ys(_scratch);
+    std::pmr::vector<double> tx(_scratch), ty(_scratch);
+    std::pmr::vector<uint8_t> touched(_scratch);
+    for (uint16_t t = 0; t < tupleN && valid; ++t) {
+      const uint16_t size = u16(hdr);
+      const uint16_t tupleIdx = u16(hdr+2);
+      hdr += 4;
+      size_t peakOff;
+      if (tupleIdx & 0x8000) {
+        peakOff = hdr;
+        hdr += 2*axisN;
+      } else if ((tupleIdx & 0x0FFF) < _gvarSharedN) {
+        peakOff = _gvarShared + size_t(tupleIdx & 0x0FFF)*axisN*2;
+      } else {
+        return false;
+      }
+      const bool inter = tupleIdx & 0x4000;
+      const size_t interOff = hdr;
+      if (inter)
+        hdr += 4*axisN;
+      size_t off = data;
+      data += size;
+      const double scl = scalar(peakOff, interOff, inter);
+      if (scl == 0.0)
+        continue;
+
+      const auto* pts = &shared;
+      if (tupleIdx & 0x2000) {
+        points(off, priv);
+        pts = &priv;
+      }
+      const uint32_t n = pts->empty() ? ptN : pts->size();
+      unpack(off, n, xs);
+      unpack(off, n, ys);
+      if (!valid)
+        break;
+      if (pts->empty()) {
+        for (uint32_t i = 0; i < ptN; ++i) {
+          dxs[i] += scl * xs[i];
+          dys[i] += scl * ys[i];
+        }
+        continue;
+      }
+      if (!comp) {
+        for (uint32_t i = 0; i < n; ++i) {
+          if ((*pts)[i] < ptN) {
+            dxs[(*pts)[i]] += scl * xs[i];
+            dys[(*pts)[i]] += scl * ys[i];
+          }
+        }
+        continue;
+      }
+
+      tx.assign(ptN, 0.0);
+      ty.assign(ptN, 0.0);
+      touched.assign(ptN, 0);
+      for (uint32_t i = 0; i < n; ++i) {
+        const uint16_t pt = (*pts)[i];
+        if (pt < ptN) {
+          tx[pt] = xs[i];
+          ty[pt] = ys[i];
+          touched[pt] = 1;
+        }
+      }
+      infer(*comp, touched.data(), tx.data(), ty.data());
+      for (uint32_t i = 0; i < ptN; ++i) {
+        dxs[i] += scl * tx[i];
+        dys[i] += scl * ty[i];
+      }
+    }
+    return valid;
+  }
+
+  /// Infers the deltas of the points that a variation leaves out.
+  ///
+  /// Each untouched point takes, in x and y separately, the deltas of the
+  /// nearest touched points before and after it on its contour: the same
+  /// delta if it lies outside their range, or an interpolated one.
+  ///
+  static void infer(const Component<int16_t>& comp, const uint8_t* touched,
+                    double* dxs, double* dys) {
+    auto axis = [&](uint32_t c, uint32_t p1, uint32_t p2, double* ds,
+                    uint32_t i) {
+      const auto& pt = comp.pts;
+      double c1, c2, d1 = ds[p1], d2 = ds[p2];
+      c1 = c == 1 ? std::get<1>(pt[p1]) : std::get<2>(pt[p1]);
+      c2 = c == 1 ? std::get<1>(pt[p2]) : std::get<2>(pt[p2]);
+      const double v = c == 1 ? std::get<1>(pt[i]) : std::get<2>(pt[i]);
+      if (c1 == c2)
+        return d1 == d2 ? d1 : 0.0;
+      if (c1 > c2) {
+        std::swap(c1, c2);
+        std::swap(d1, d2);
+      }
+      if (v <= c1)
+        return d1;
+      if (v >= c2)
+        return d2;
+      return d1 + (v-c1) * (d2-d1) / (c2-c1);
+    };
+
+    uint32_t beg = 0;
+    for (const auto end : comp.cntrEnd) {
+      if (end >= comp.pts.size())
+        break;
+      // first touched point of the contour
+      uint32_t first = beg;
+      while (first <= end && !touched[first])
+        ++first;
+      if (first > end) {
+        beg = end+1;
+        continue;
+      }
+      uint32_t prev = first;
+      uint32_t i = first;
+      do {
+        i = i == end ? beg : i+1;
+        if (touched[i]) {
+          prev = i;
+          continue;
+        }
+        // next touched point, wrapping around
+        uint32_t next = i;
+        do
+          next = next == end ? beg : next+1;
+        while (!touched[next]);
+        dxs[i] = axis(1, prev, next, dxs, i);
+        dys[i] = axis(2, prev, next, dys, i);
+      } while (i != first);
+      beg = end+1;
+    }
+  }
+
   /// Fetches a simple glyph.
   ///
+  /// Flags are first expanded into one byte per point, then mapped through
+  /// 'FlagFmt' into the field formats that the coordinate decoder consumes.
+  ///
   void fetchSimple(uint16_t index, Component<int16_t>& comp) {
     uint32_t curOff = _loca[index];
     const Glyf* glyf = reinterpret_cast<Glyf*>(&_glyf[curOff]);
     curOff += sizeof(Glyf);
     const int16_t cntrN = betoh(glyf->cntrN); // assuming >= 0
+    if (cntrN == 0)
+      return;
 
     uint16_t* endPts = reinterpret_cast<uint16_t*>(&_glyf[curOff]);
     curOff += cntrN * sizeof(uint16_t);
     for (uint16_t i = 0; i < cntrN; ++i)
       comp.cntrEnd.push_back(betoh(endPts[i]));
-    const uint16_t lastPt = comp.cntrEnd.back();
+    const uint32_t ptN = comp.cntrEnd.back() + 1;
 
     uint16_t instrLen = *reinterpret_cast<uint16_t*>(&_glyf[curOff]);
     curOff += sizeof(uint16_t) + betoh(instrLen);
 
     // XXX: Cannot assume 2-byte alignment after this point.
 
-    const uint32_t flagStart = curOff;
-    int32_t flagN = lastPt;
-    uint8_t flags;
-    uint8_t repeatN;
-    uint32_t yOff = 0;
-
-    // iterate over flags array to compute offsets
-    do {
-      flags = _glyf[curOff++];
-      repeatN = (flags & 8) ? _glyf[curOff++] : 0;
-      flagN -= repeatN+1;
-      if (flags & 2)
-        // x is byte
-        yOff += repeatN+1;
-      else if (!(flags & 16))
-        // x is word
-        yOff += (repeatN+1)*2;
-      // x is same otherwise
-    } while (flagN >= 0);
-
-    uint32_t xOff = curOff;
-    yOff += curOff;
-    curOff = flagStart;
-    flagN = lastPt;
-    bool onCurve;
-    int16_t x = 0;
-    int16_t y = 0;
-    int16_t dt;
-
-    // iterate again to fetch point data
-    do {
-      flags = _glyf[curOff++];
-      repeatN = (flags & 8) ? _glyf[curOff++] : 0;
-      flagN -= repeatN+1;
-
-      do {
-        onCurve = flags & 1;
+    // flags, x formats and y formats
+    std::pmr::vector<uint8_t> fmts(ptN*3, _scratch);
+    uint8_t* flags = fmts.data();
+    uint8_t* xFmt = flags + ptN;
+    uint8_t* yFmt = xFmt + ptN;
 
-        if (flags & 2) {
-          if (flags & 16)
-            // x is byte, positive sign
-            x += _glyf[xOff++];
-          else
-            // x is byte, negative sign
-            x += -(_glyf[xOff++]);
-        } else if (!(flags & 16)) {
-          // x is signed word
-          dt = _glyf[xOff+1];
-          dt = (dt << 8) | _glyf[xOff];
-          x += betoh(dt);
-          xOff += 2;
-        }
+    for (uint32_t i = 0; i < ptN;) {
+      const uint8_t f = _glyf[curOff++];
+      uint32_t n = (f & 8) ? _glyf[curOff++] + 1 : 1;
+      n = std::min(n, ptN-i);
+      std::fill_n(flags+i, n, f);
+      i += n;
+    }
 
-        if (flags & 4) {
-          if (flags & 32)
-            // y is byte, positive sign
-            y += _glyf[yOff++];
-          else
-            // y is byte, negative sign
-            y += -(_glyf[yOff++]);
-        } else if (!(flags & 32)) {
-          // y is signed word
-          dt = _glyf[yOff+1];
-          dt = (dt << 8) | _glyf[yOff];
-          y += betoh(dt);
-          yOff += 2;
-        }
+    const auto& kern = kernels::get();
+    kern.lookup(flags, xFmt, ptN, FlagFmt.x);
+    kern.lookup(flags, yFmt, ptN, FlagFmt.y);
 
-        comp.pts.push_back({onCurve, x, y});
-      } while (repeatN-- > 0);
+    std::pmr::vector<int16_t> crds(ptN*2, _scratch);
+    int16_t* xs = crds.data();
+    int16_t* ys = xs + ptN;
+    curOff += kern.decodeCoords(&_glyf[curOff], xFmt, xs, ptN);
+    kern.decodeCoords(&_glyf[curOff], yFmt, ys, ptN);
 
-    } while (flagN >= 0);
+    comp.pts.resize(ptN);
+    for (uint32_t i = 0; i < ptN; ++i)
+      comp.pts[i] = {flags[i] & 1, xs[i], ys[i]};
   }
 
   /// Samples per pixel.
@@ -693,71 +2965,546 @@ class SFNT {
     dst.yMax = src.yMax * fac;
 
     std::for_each(src.comps.begin(), src.comps.end(), [&](auto& comp) {
-      dst.comps.push_back({});
+      dst.comps.emplace_back();
       auto& it = dst.comps.back();
       uint16_t beg, cur;
       beg = cur = 0;
 
-      for (const auto& end : comp.cntrEnd) {
-        do {
-          auto& p1 = comp.pts[cur];
-          if (std::get<0>(p1)) {
-            it.pts.push_back({true, std::get<1>(p1)*fac, std::get<2>(p1)*fac});
-            continue;
-          }
-          auto& p0 = cur == beg ? comp.pts[end] : comp.pts[cur-1];
-          auto& p2 = cur == end ? comp.pts[beg] : comp.pts[cur+1];
-          float x0, y0, x1, y1, x2, y2;
+      for (const auto& end : comp.cntrEnd) {
+        do {
+          auto& p1 = comp.pts[cur];
+          if (std::get<0>(p1)) {
+            it.pts.push_back({true, std::get<1>(p1)*fac, std::get<2>(p1)*fac});
+            continue;
+          }
+          auto& p0 = cur == beg ? comp.pts[end] : comp.pts[cur-1];
+          auto& p2 = cur == end ? comp.pts[beg] : comp.pts[cur+1];
+          float x0, y0, x1, y1, x2, y2;
+
+          // missing on-curve points created as needed
+          x1 = std::get<1>(p1)*fac;
+          y1 = std::get<2>(p1)*fac;
+          if (std::get<0>(p0)) {
+            x0 = std::get<1>(p0)*fac;
+            y0 = std::get<2>(p0)*fac;
+          } else {
+            x0 = std::get<1>(p0)*fac*0.5f + x1*0.5f;
+            y0 = std::get<2>(p0)*fac*0.5f + y1*0.5f;
+          }
+          if (std::get<0>(p2)) {
+            x2 = std::get<1>(p2)*fac;
+            y2 = std::get<2>(p2)*fac;
+          } else {
+            x2 = x1*0.5f + std::get<1>(p2)*fac*0.5f;
+            y2 = y1*0.5f + std::get<2>(p2)*fac*0.5f;
+          }
+
+          const auto len01 = std::sqrt((x1-x0)*(x1-x0)+(y1-y0)*(y1-y0));
+          const auto len12 = std::sqrt((x2-x1)*(x2-x1)+(y2-y1)*(y2-y1));
+          const auto len = len01+len12;
+          const auto ts = 1.0f / std::max(4.0f, std::round(len*0.25f));
+          auto t = 0.0f;
+
+          // p(t) = (1-t)^2[p0] + 2t(1-t)[p1] + t^2[p2]
+          while ((t += ts) < 1.0f) {
+            const auto a = std::pow(1.0f-t, 2.0f);
+            const auto b = 2.0f*t*(1.0f-t);
+            const auto c = std::pow(t, 2.0f);
+            it.pts.push_back({true, a*x0+b*x1+c*x2, a*y0+b*y1+c*y2});
+          }
+        } while (cur++ != end);
+
+        beg = end+1;
+        it.cntrEnd.push_back(it.pts.size()-1);
+      }
+    });
+  }
+
+  /// Gets the length of an em in samples, at the size of 'reso'.
+  ///
+  static float emOf(float reso) {
+    return std::max(1, SAA>>1) * reso / 72.0f;
+  }
+
+  /// Checks whether options apply a synthetic style.
+  ///
+  static bool styled(const RenderOpts& opts) {
+    return opts.embolden != 0.0f || opts.slant != 0.0f;
+  }
+
+  /// Identifies the synthetic style of options (zero for none).
+  ///
+  /// Styled glyphs are cached as glyphs of a font of their own, whose
+  /// fingerprint is the font's combined with this value.
+  ///
+  static uint64_t variantOf(const RenderOpts& opts) {
+    if (!styled(opts))
+      return 0;
+    uint32_t bold, slant;
+    std::memcpy(&bold, &opts.embolden, sizeof bold);
+    std::memcpy(&slant, &opts.slant, sizeof slant);
+    uint64_t x = (uint64_t(bold) << 32 | slant) * 0x9E3779B97F4A7C15;
+    x ^= x >> 31;
+    x *= 0xBF58476D1CE4E5B9;
+    return (x ^ (x >> 29)) | 1;
+  }
+
+  /// Gets the bounds of a styled outline, from the unstyled bounds and
+  /// the length of an em.
+  ///
+  /// Bounds grow by the emboldening offset, and then by the shear of
+  /// their corners.
+  ///
+  static void styleBounds(float em, const RenderOpts& opts, float& xMin,
+                          float& yMin, float& xMax, float& yMax) {
+    const float d = opts.embolden * 0.5f * em;
+    xMin -= d;
+    yMin -= d;
+    xMax += d;
+    yMax += d;
+    const float slant = opts.slant;
+    xMin += slant * (slant > 0.0f ? yMin : yMax);
+    xMax += slant * (slant > 0.0f ? yMax : yMin);
+  }
+
+  /// Applies the synthetic style of options to a scaled outline, whose em
+  /// is 'em' long.
+  ///
+  /// Emboldening moves each point along the bisector of the normals of
+  /// its edges, by half the 'embolden' width - contours are taken to be
+  /// clockwise around filled areas, unless the signed area of the whole
+  /// outline says otherwise. Miters are limited at sharp corners, and
+  /// points kept within the grown bounds. The outline is then sheared
+  /// about the baseline.
+  ///
+  void style(Outline<float>& outline, float em, const RenderOpts& opts) {
+    if (!styled(opts) || outline.comps.empty())
+      return;
+    const float xMin = outline.xMin;
+    const float yMin = outline.yMin;
+    const float xMax = outline.xMax;
+    const float yMax = outline.yMax;
+    styleBounds(em, opts, outline.xMin, outline.yMin, outline.xMax,
+                outline.yMax);
+
+    float area = 0.0f;
+    for (const auto& comp : outline.comps) {
+      uint16_t beg = 0;
+      for (const auto end : comp.cntrEnd) {
+        for (uint16_t i = beg; i <= end; ++i) {
+          const auto& p1 = comp.pts[i];
+          const auto& p2 = comp.pts[i < end ? i+1 : beg];
+          area += std::get<1>(p1)*std::get<2>(p2) -
+                  std::get<1>(p2)*std::get<2>(p1);
+        }
+        beg = end+1;
+      }
+    }
+    const float d = (area > 0.0f ? -0.5f : 0.5f) * opts.embolden * em;
+    const float dMax = std::abs(d);
+    const float slant = opts.slant;
+
+    // left normal of the edge from 'p1' to 'p2' (zero if degenerate)
+    auto normal = [](const auto& p1, const auto& p2) {
+      const float dx = std::get<1>(p2) - std::get<1>(p1);
+      const float dy = std::get<2>(p2) - std::get<2>(p1);
+      const float len = std::sqrt(dx*dx + dy*dy);
+      return len > 0.0f ? Point{-dy/len, dx/len} : Point{0.0f, 0.0f};
+    };
+
+    std::pmr::vector<Point> moved(_scratch);
+    for (auto& comp : outline.comps) {
+      uint16_t beg = 0;
+      for (const auto end : comp.cntrEnd) {
+        moved.clear();
+        for (uint16_t i = beg; i <= end; ++i) {
+          const auto& p0 = comp.pts[i > beg ? i-1 : end];
+          const auto& p1 = comp.pts[i];
+          const auto& p2 = comp.pts[i < end ? i+1 : beg];
+          Point n0 = normal(p0, p1);
+          Point n1 = normal(p1, p2);
+          if (n0.x == 0.0f && n0.y == 0.0f)
+            n0 = n1;
+          if (n1.x == 0.0f && n1.y == 0.0f)
+            n1 = n0;
+          // miter of length d/cos(a/2), 'a' being the turn angle
+          const float cos1 = 1.0f + n0.x*n1.x + n0.y*n1.y;
+          Point off{0.0f, 0.0f};
+          if (cos1 >= 2.0f / (MiterLimit*MiterLimit)) {
+            off = {(n0.x+n1.x) * d/cos1, (n0.y+n1.y) * d/cos1};
+          } else {
+            const Point mid{n0.x+n1.x, n0.y+n1.y};
+            const float len = std::sqrt(mid.x*mid.x + mid.y*mid.y);
+            if (len > 0.0f)
+              off = {mid.x * d*MiterLimit/len, mid.y * d*MiterLimit/len};
+          }
+          moved.push_back({
+            std::clamp(std::get<1>(p1) + off.x, xMin-dMax, xMax+dMax),
+            std::clamp(std::get<2>(p1) + off.y, yMin-dMax, yMax+dMax)});
+        }
+        for (uint16_t i = beg; i <= end; ++i) {
+          const auto& pt = moved[i-beg];
+          std::get<1>(comp.pts[i]) = pt.x + slant*pt.y;
+          std::get<2>(comp.pts[i]) = pt.y;
+        }
+        beg = end+1;
+      }
+    }
+  }
+
+  /// Longest miter of emboldened corners, in offsets.
+  ///
+  static constexpr float MiterLimit = 2.0f;
+
+  /// Renders a glyph index, going through the cache if there is one.
+  ///
+  std::unique_ptr<Glyph> drawCached(uint16_t index, uint16_t pts,
+                                    uint16_t dpi, const RenderOpts& opts) {
+    Outline<int16_t> outlnF(_scratch);
+    const bool resampled = opts.tolerance > 0.0f && pts*dpi != 0 &&
+                           !clipped(opts);
+    auto render = [&] {
+      if (resampled)
+        return drawResampled(index, pts, dpi, opts);
+      return draw(fetch(index, outlnF), pts, dpi, opts);
+    };
+    if (!_cache || clipped(opts))
+      return render();
+
+    // resampled glyphs are shared apart from rasterized ones
+    const ShmCache::Key key{_print ^ _varPrint ^ variantOf(opts),
+                            uint32_t(pts*dpi),
+                            modeOf(opts) | (resampled ? ResampledMode : 0),
+                            index};
+    auto glyph = _cache->get(key, _scratch);
+    if (!glyph) {
+      glyph = render();
+      _cache->put(key, *glyph, _scratch);
+    }
+    return glyph;
+  }
+
+  /// Renders a glyph index by resampling a bitmap of a nearby size, if
+  /// one was rendered before.
+  ///
+  /// Otherwise, the glyph is rasterized and its coverage kept, for the
+  /// sizes within tolerance of its own.
+  ///
+  std::unique_ptr<Glyph> drawResampled(uint16_t index, uint16_t pts,
+                                       uint16_t dpi, const RenderOpts& opts) {
+    const uint32_t reso = pts*dpi;
+    auto near = [&](uint32_t srcReso) {
+      return std::abs(float(reso)/srcReso - 1.0f) <= opts.tolerance;
+    };
+
+    const uint64_t variant = variantOf(opts) ^ _varPrint;
+    Sized best{};
+    {
+      std::lock_guard<std::mutex> lock(_sizedMtx);
+      const auto it = _sized.find(index);
+      if (it != _sized.end()) {
+        for (const auto& sz : it->second) {
+          if (sz.variant == variant && near(sz.reso) && (!best.cov ||
+                                std::abs(int64_t(sz.reso)-reso) <
+                                std::abs(int64_t(best.reso)-reso)))
+          { best = sz; }
+        }
+      }
+    }
+    if (best.cov)
+      return resample(best, reso, opts);
+
+    Outline<int16_t> outlnF(_scratch);
+    const auto& outline = fetch(index, outlnF);
+    RenderOpts covOpts;
+    covOpts.parallel = opts.parallel;
+    covOpts.embolden = opts.embolden;
+    covOpts.slant = opts.slant;
+    Sized sz{reso, variant, float(outline.xMin), float(outline.yMin),
+             float(outline.xMax), float(outline.yMax),
+             draw(outline, pts, dpi, covOpts)};
+    if (!outline.comps.empty())
+      styleBounds(_upem, opts, sz.xMin, sz.yMin, sz.xMax, sz.yMax);
+    const auto ext = sz.cov->extent();
+    auto glyph = encode(sz.cov->data(), sz.cov->pitch(), ext.first,
+                        ext.second, opts, sz.cov->bearing());
+
+    std::lock_guard<std::mutex> lock(_sizedMtx);
+    auto& sizes = _sized[index];
+    if (std::none_of(sizes.begin(), sizes.end(), [&](const Sized& s) {
+          return s.variant == variant && near(s.reso);
+        }))
+    {
+      // kept in font memory, as scratch memory may be released any time
+      auto cov = new SFNTGlyph{ext, sz.cov->format(), sz.cov->pitch(),
+                               sz.cov->bearing(), _font};
+      if (cov->buffer())
+        std::memcpy(cov->buffer(), sz.cov->data(),
+                    size_t(sz.cov->pitch())*ext.second);
+      sz.cov = std::shared_ptr<const Glyph>{
+        cov, std::default_delete<const Glyph>(),
+        std::pmr::polymorphic_allocator<Glyph>(_font)};
+      sizes.push_back(std::move(sz));
+      _sizedOrder.push_back({index, cov});
+      _sizedLen += size_t(cov->pitch())*ext.second;
+      while (_sizedLen > SizedLenMax) {
+        drop(_sizedOrder.front());
+        _sizedOrder.pop_front();
+      }
+    }
+    return std::unique_ptr<Glyph>{glyph};
+  }
+
+  /// Most bytes of bitmaps kept for resampling at once - the oldest are
+  /// dropped first.
+  ///
+  static constexpr size_t SizedLenMax = 16 << 20;
+
+  /// Drops a kept bitmap, given its glyph index and address.
+  ///
+  void drop(std::pair<uint16_t, const Glyph*> kept) {
+    _sizedLen -= size_t(kept.second->pitch())*kept.second->extent().second;
+    const auto it = _sized.find(kept.first);
+    auto& sizes = it->second;
+    sizes.erase(std::find_if(sizes.begin(), sizes.end(),
+                             [&](const Sized& s) {
+                               return s.cov.get() == kept.second;
+                             }));
+    if (sizes.empty())
+      _sized.erase(it);
+  }
+
+  /// Kept coverage of a glyph, at the size of 'reso' (points times dpi).
+  ///
+  struct Sized {
+    uint32_t reso;
+    uint64_t variant; // see 'variantOf'
+    float xMin, yMin, xMax, yMax; // outline bounds, in FUnits
+    std::shared_ptr<const Glyph> cov;
+  };
+
+  /// Resamples kept coverage to the size of 'reso'.
+  ///
+  /// The bitmap has the extent and bearing that rasterizing at that size
+  /// would give it. Each pixel is mapped to its position in the source
+  /// bitmap, which is filtered with a Catmull-Rom cubic, one dimension at
+  /// a time (pixels past the source's edges are empty).
+  ///
+  std::unique_ptr<Glyph> resample(const Sized& src, uint32_t reso,
+                                  const RenderOpts& opts) {
+    const auto srcExt = src.cov->extent();
+    const auto srcPitch = src.cov->pitch();
+    if (src.reso == reso)
+      return std::unique_ptr<Glyph>{encode(src.cov->data(), srcPitch,
+                                           srcExt.first, srcExt.second, opts,
+                                           src.cov->bearing())};
+
+    // set up as in 'scale' and 'rasterize'
+    const int32_t ds = std::max(1, SAA>>1);
+    const float fac = ds * float(reso) / (72.0f * _upem);
+    const float xMin = src.xMin * fac;
+    const float yMin = src.yMin * fac;
+    const uint16_t w = std::ceil(src.xMax*fac - xMin);
+    const uint16_t h = std::ceil(src.yMax*fac - yMin);
+    const uint16_t dw = w / ds;
+    const uint16_t dh = h / ds;
+    const int16_t left = std::lround(xMin / ds);
+    const int16_t bottom = std::lround(yMin / ds);
+
+    const float srcFac = ds * float(src.reso) / (72.0f * _upem);
+    const float inv = srcFac / fac;
+    const float mid = (ds-1) * 0.5f;
+
+    // first source pixel and weights of the four taps of pixel 'i'
+    auto taps = [&](float min, float srcMin, uint32_t i, float* wgt) {
+      const float u = ((min + ds*i + mid) * inv - srcMin - mid) / ds;
+      const float f = std::floor(u);
+      const float t = u - f;
+      wgt[0] = 0.5f * t*(-1.0f + t*(2.0f - t));
+      wgt[1] = 0.5f * (2.0f + t*t*(-5.0f + 3.0f*t));
+      wgt[2] = 0.5f * t*(1.0f + t*(4.0f - 3.0f*t));
+      wgt[3] = 0.5f * t*t*(t - 1.0f);
+      return int32_t(f) - 1;
+    };
+
+    // horizontal pass, over every source row
+    std::pmr::vector<float> cols(dw*srcExt.second, _scratch);
+    const float srcXMin = src.xMin * srcFac;
+    const uint8_t* srcData = src.cov->data();
+    for (uint16_t x = 0; x < dw; ++x) {
+      float wgt[4];
+      const int32_t first = taps(xMin, srcXMin, x, wgt);
+      for (int32_t k = 0; k < 4; ++k) {
+        const int32_t sx = first + k;
+        if (sx < 0 || sx >= srcExt.first || wgt[k] == 0.0f)
+          continue;
+        for (uint16_t y = 0; y < srcExt.second; ++y)
+          cols[y*dw+x] += srcData[y*srcPitch+sx] * wgt[k];
+      }
+    }
+
+    // vertical pass, into coverage
+    std::pmr::vector<uint8_t> cov(dw*dh, _scratch);
+    std::pmr::vector<float> zero(dw, _scratch);
+    const float srcYMin = src.yMin * srcFac;
+    const auto& kern = kernels::get();
+    for (uint16_t y = 0; y < dh; ++y) {
+      float wgt[4];
+      const int32_t first = taps(yMin, srcYMin, y, wgt);
+      const float* rows[4];
+      for (int32_t k = 0; k < 4; ++k) {
+        const int32_t sy = first + k;
+        rows[k] = sy < 0 || sy >= srcExt.second ? zero.data() :
+                                                  cols.data() + sy*dw;
+      }
+      kern.filterRows(rows, wgt, cov.data() + y*dw, dw);
+    }
+
+    // edges are estimated to be placed within half a source sample
+    auto glyph = encode(cov.data(), dw, dw, dh, opts, {left, bottom});
+    glyph->setError(0.5f / ds / inv);
+    return std::unique_ptr<Glyph>{glyph};
+  }
+
+  /// Encodes the options that change a glyph bitmap (resampling is added
+  /// as 'ResampledMode' where it applies).
+  ///
+  static constexpr uint32_t ResampledMode = 1U << 31;
+  static uint32_t modeOf(const RenderOpts& opts) {
+    uint32_t mode = static_cast<uint32_t>(opts.format);
+    if (opts.format == PixelFmt::A8Gamma)
+      mode |= std::lround(opts.gamma * 1000.0f) << 8;
+    return mode;
+  }
+
+  /// Checks whether options clip the bitmap (which is then not cached).
+  ///
+  static bool clipped(const RenderOpts& opts) {
+    const RenderOpts all;
+    return opts.clip.xMin != all.clip.xMin ||
+      opts.clip.yMin != all.clip.yMin || opts.clip.xMax != all.clip.xMax ||
+      opts.clip.yMax != all.clip.yMax;
+  }
+
+  /// Scales and rasterizes an outline.
+  ///
+  std::unique_ptr<Glyph> draw(const Outline<int16_t>& outlnF, uint16_t pts,
+                              uint16_t dpi, const RenderOpts& opts) {
+    Outline<float> outlnP(_scratch);
+    scale(outlnF, outlnP, pts*dpi);
+    style(outlnP, emOf(pts*dpi), opts);
+
+#ifdef FONT_DEVEL
+    std::wcout << "\n-[FUnits]-\n";
+    std::wcout << "\nbounds:\n" <<
+      "x=(" << outlnF.xMin << "," << outlnF.xMax << ")\n" <<
+      "y=(" << outlnF.yMin << "," << outlnF.yMax << ")\n";
+    std::wcout << "\n~~ Components ~~\n" << outlnF.comps.size() << std::endl;
+    std::for_each(outlnF.comps.begin(), outlnF.comps.end(),
+      [](auto& comp) {
+        std::wcout << "\ncntrEnd:\n";
+        std::for_each(comp.cntrEnd.begin(), comp.cntrEnd.end(),
+          [](const auto& ce) {
+            std::wcout << ce << std::endl;
+          });
+        std::wcout << "\npts:\n";
+        std::for_each(comp.pts.begin(), comp.pts.end(),
+          [] (const auto& pt) {
+            std::wcout <<
+              (std::get<0>(pt) ? "on " : "off ") <<
+              std::get<1>(pt) << " " <<
+              std::get<2>(pt) << "\n";
+          });
+      });
+    std::wcout << "\n~~~~\n";
+
+    std::wcout << "\n-[Scaled]-\n";
+    std::wcout << "\nbounds:\n" <<
+      "x=(" << outlnP.xMin << "," << outlnP.xMax << ")\n" <<
+      "y=(" << outlnP.yMin << "," << outlnP.yMax << ")\n";
+    std::wcout << "\n~~ Components ~~\n" << outlnP.comps.size() << std::endl;
+    std::for_each(outlnP.comps.begin(), outlnP.comps.end(),
+      [](auto& comp) {
+        std::wcout << "\ncntrEnd:\n";
+        std::for_each(comp.cntrEnd.begin(), comp.cntrEnd.end(),
+          [](const auto& ce) {
+            std::wcout << ce << std::endl;
+          });
+        std::wcout << "\npts:\n";
+        std::for_each(comp.pts.begin(), comp.pts.end(),
+          [] (const auto& pt) {
+            std::wcout <<
+              (std::get<0>(pt) ? "on " : "off ") <<
+              std::get<1>(pt) << " " <<
+              std::get<2>(pt) << "\n";
+          });
+      });
+    std::wcout << "\n~~~~\n";
+#endif
+
+    return rasterize(outlnP, opts);
+  }
+
+  /// Renders one outline at several sizes.
+  ///
+  std::vector<std::unique_ptr<Glyph>> drawSizes(
+    const Outline<int16_t>& outlnF, const std::vector<uint16_t>& pts,
+    uint16_t dpi, const RenderOpts& opts, bool parallel) {
+
+    std::vector<std::unique_ptr<Glyph>> glyphs(pts.size());
+    if (pts.empty())
+      return glyphs;
 
-          // missing on-curve points created as needed
-          x1 = std::get<1>(p1)*fac;
-          y1 = std::get<2>(p1)*fac;
-          if (std::get<0>(p0)) {
-            x0 = std::get<1>(p0)*fac;
-            y0 = std::get<2>(p0)*fac;
-          } else {
-            x0 = std::get<1>(p0)*fac*0.5f + x1*0.5f;
-            y0 = std::get<2>(p0)*fac*0.5f + y1*0.5f;
-          }
-          if (std::get<0>(p2)) {
-            x2 = std::get<1>(p2)*fac;
-            y2 = std::get<2>(p2)*fac;
-          } else {
-            x2 = x1*0.5f + std::get<1>(p2)*fac*0.5f;
-            y2 = y1*0.5f + std::get<2>(p2)*fac*0.5f;
-          }
+    const uint16_t maxPts = *std::max_element(pts.begin(), pts.end());
+    Outline<float> outlnP(_scratch);
+    scale(outlnF, outlnP, maxPts*dpi);
+    style(outlnP, emOf(maxPts*dpi), opts);
+    std::pmr::vector<Segment> segs(_scratch);
+    edges(outlnP, segs);
 
-          const auto len01 = std::sqrt((x1-x0)*(x1-x0)+(y1-y0)*(y1-y0));
-          const auto len12 = std::sqrt((x2-x1)*(x2-x1)+(y2-y1)*(y2-y1));
-          const auto len = len01+len12;
-          const auto ts = 1.0f / std::max(4.0f, std::round(len*0.25f));
-          auto t = 0.0f;
+    auto job = [&](size_t i) {
+      const float fac = maxPts != 0 ? float(pts[i]) / maxPts : 0.0f;
+      glyphs[i] = rasterize(segs, outlnP, fac, opts);
+    };
 
-          // p(t) = (1-t)^2[p0] + 2t(1-t)[p1] + t^2[p2]
-          while ((t += ts) < 1.0f) {
-            const auto a = std::pow(1.0f-t, 2.0f);
-            const auto b = 2.0f*t*(1.0f-t);
-            const auto c = std::pow(t, 2.0f);
-            it.pts.push_back({true, a*x0+b*x1+c*x2, a*y0+b*y1+c*y2});
-          }
-        } while (cur++ != end);
+    const size_t thrdN = parallel ?
+      std::min<size_t>(std::thread::hardware_concurrency(), pts.size()) : 0;
+    if (thrdN < 2) {
+      for (size_t i = 0; i < pts.size(); ++i)
+        job(i);
+      return glyphs;
+    }
 
-        beg = end+1;
-        it.cntrEnd.push_back(it.pts.size()-1);
-      }
-    });
+    // sizes are handed out one at a time, largest cost first
+    std::pmr::vector<size_t> order(pts.size(), _scratch);
+    for (size_t i = 0; i < order.size(); ++i)
+      order[i] = i;
+    std::sort(order.begin(), order.end(),
+              [&](size_t l, size_t r) { return pts[l] > pts[r]; });
+    std::atomic<size_t> next{0};
+    auto work = [&] {
+      size_t i;
+      while ((i = next++) < order.size())
+        job(order[i]);
+    };
+    std::pmr::vector<std::thread> thrds(_scratch);
+    for (size_t i = 1; i < thrdN; ++i)
+      thrds.emplace_back(work);
+    work();
+    for (auto& t : thrds)
+      t.join();
+    return glyphs;
   }
 
-  /// Rasterizes a scaled outline.
-  /// TODO: Handle rounding errors.
+  /// Edges of a scaled outline.
   ///
-  std::unique_ptr<Glyph> rasterize(const Outline<float>& outline) {
-    enum Winding { ON = 1, OFF = -1, NONE = 0 };
-    struct Point { float x, y; };
-    struct Segment { Winding wind; Point p1, p2; };
-
-    std::vector<Segment> segs;
+  enum Winding { ON = 1, OFF = -1, NONE = 0 };
+  struct Point { float x, y; };
+  struct Segment { Winding wind; Point p1, p2; };
 
+  /// Sets up the edges of a scaled outline.
+  ///
+  void edges(const Outline<float>& outline, std::pmr::vector<Segment>& segs) {
     auto addSeg = [&](const Component<float>& comp, uint16_t i, uint16_t j) {
       auto x1 = std::get<1>(comp.pts[i]);
       auto y1 = std::get<2>(comp.pts[i]);
@@ -793,7 +3540,26 @@ class SFNT {
     });
     std::wcout << "\n~~~~\n";
 #endif
+  }
+
+  /// Rasterizes a scaled outline.
+  ///
+  std::unique_ptr<Glyph> rasterize(const Outline<float>& outline,
+                                   const RenderOpts& opts) {
+    std::pmr::vector<Segment> segs(_scratch);
+    edges(outline, segs);
+    return rasterize(segs, outline, 1.0f, opts);
+  }
 
+  /// Rasterizes the edges of a scaled outline, resized by 'fac'.
+  ///
+  /// Samples are mapped back into the space of the edges, so edges can be
+  /// shared by any number of sizes.
+  /// TODO: Handle rounding errors.
+  ///
+  std::unique_ptr<Glyph> rasterize(const std::pmr::vector<Segment>& segs,
+                                   const Outline<float>& outline, float fac,
+                                   const RenderOpts& opts) {
     auto dir = [](Point p1, Point p2, Point p3) {
       return (p3.x-p1.x)*(p2.y-p1.y)-(p2.x-p1.x)*(p3.y-p1.y);
     };
@@ -829,58 +3595,257 @@ class SFNT {
       return false;
     };
 
-    const uint16_t w = std::ceil(outline.xMax - outline.xMin);
-    const uint16_t h = std::ceil(outline.yMax - outline.yMin);
-    auto bmap = new uint8_t[w*h];
+    const float xMin = outline.xMin * fac;
+    const float yMin = outline.yMin * fac;
+    const uint16_t w = std::ceil(outline.xMax*fac - xMin);
+    const uint16_t h = std::ceil(outline.yMax*fac - yMin);
+    const float inv = fac != 0.0f ? 1.0f / fac : 0.0f;
+    const int32_t ds = std::max(1, SAA>>1);
+    const int16_t left = std::lround(xMin / ds);
+    const int16_t bottom = std::lround(yMin / ds);
+
+    // only the samples of pixels inside the clip rectangle are produced
+    const Rect& clip = opts.clip;
+    const int32_t dw = w / ds;
+    const int32_t dh = h / ds;
+    const int32_t x0 = std::clamp(clip.xMin - left, 0, dw);
+    const int32_t x1 = std::clamp(clip.xMax - left, x0, dw);
+    const int32_t y0 = std::clamp(clip.yMin - bottom, 0, dh);
+    const int32_t y1 = std::clamp(clip.yMax - bottom, y0, dh);
+    const uint32_t sx0 = x0 * ds;
+    const uint32_t sy0 = y0 * ds;
+    const uint16_t sw = (x1-x0) * ds;
+    const uint16_t sh = (y1-y0) * ds;
+    std::pmr::vector<uint8_t> bmap(sw*sh, _scratch);
+
+    // samples are rasterized a tile at a time, against the edges that can
+    // reach the tile: edges crossing its bounds are tested at every
+    // sample, edges wholly to its right once per row (their crossings do
+    // not depend on where the ray starts) and the rest are culled - rows
+    // that no edge crosses are filled without visiting each sample
+    const uint16_t bandN = (sh + TileLen-1) / TileLen;
+
+    auto band = [&](uint16_t b) {
+      std::pmr::vector<const Segment*> spans(_scratch);
+      std::pmr::vector<const Segment*> local(_scratch);
+      std::pmr::vector<const Segment*> right(_scratch);
+      std::pmr::vector<const Segment*> cross(_scratch);
+      const uint32_t by0 = b * TileLen;
+      const uint32_t by1 = std::min<uint32_t>(by0+TileLen, sh);
+      const float pyMin = (by0+sy0 + yMin) * inv;
+      const float pyMax = (by1-1+sy0 + yMin) * inv;
+      for (const auto& seg : segs) {
+        if (std::min(seg.p1.y, seg.p2.y) <= pyMax &&
+            std::max(seg.p1.y, seg.p2.y) >= pyMin)
+        { spans.push_back(&seg); }
+      }
+
+      for (uint32_t bx0 = 0; bx0 < sw; bx0 += TileLen) {
+        const uint32_t bx1 = std::min<uint32_t>(bx0+TileLen, sw);
+        const float pxMin = (bx0+sx0 + xMin) * inv;
+        const float pxMax = (bx1-1+sx0 + xMin) * inv;
+        local.clear();
+        right.clear();
+        for (const auto seg : spans) {
+          if (std::max(seg->p1.x, seg->p2.x) < pxMin)
+            continue;
+          if (std::min(seg->p1.x, seg->p2.x) > pxMax)
+            right.push_back(seg);
+          else
+            local.push_back(seg);
+        }
+
+        for (uint32_t y = by0; y < by1; ++y) {
+          const float py = (y+sy0 + yMin) * inv;
+          auto spansRow = [py](const Segment* seg) {
+            return std::min(seg->p1.y, seg->p2.y) <= py &&
+              std::max(seg->p1.y, seg->p2.y) >= py;
+          };
+          Point p1 = {pxMin, py};
+          Point p2 = {p1.x+65535.0f, p1.y};
+          int base = 0;
+          for (const auto seg : right) {
+            if (spansRow(seg) && intersects(*seg, p1, p2))
+              base += seg->wind;
+          }
+          cross.clear();
+          for (const auto seg : local) {
+            if (spansRow(seg))
+              cross.push_back(seg);
+          }
 
-    for (uint16_t y = 0; y < h; ++y) {
-      for (uint16_t x = 0; x < w; ++x) {
-        Point p1 = {x+outline.xMin, y+outline.yMin};
-        Point p2 = {p1.x+65535.0f, p1.y};
-        int wind = 0;
-        for (const auto& seg : segs) {
-          if (onSegment(seg, p1)) {
-            wind = ON;
-            break;
+          uint8_t* row = bmap.data() + y*sw;
+          if (cross.empty()) {
+            std::fill(row+bx0, row+bx1, base != 0 ? 255 : 0);
+            continue;
+          }
+          for (uint32_t x = bx0; x < bx1; ++x) {
+            p1.x = (x+sx0 + xMin) * inv;
+            p2.x = p1.x+65535.0f;
+            int wind = base;
+            for (const auto seg : cross) {
+              if (onSegment(*seg, p1)) {
+                wind = ON;
+                break;
+              }
+              if (intersects(*seg, p1, p2))
+                wind += seg->wind;
+            }
+            row[x] = wind != 0 ? 255 : 0;
           }
-          if (intersects(seg, p1, p2))
-            wind += seg.wind;
         }
-        bmap[y*w+x] = wind != 0 ? 255 : 0;
       }
+    };
+
+    // bands of tiles are handed out one at a time
+    const size_t thrdN = opts.parallel && uint32_t(sw*sh) >= ParallelLen ?
+      std::min<size_t>(std::thread::hardware_concurrency(), bandN) : 0;
+    if (thrdN < 2) {
+      for (uint16_t b = 0; b < bandN; ++b)
+        band(b);
+    } else {
+      std::atomic<uint16_t> next{0};
+      auto work = [&] {
+        uint16_t b;
+        while ((b = next++) < bandN)
+          band(b);
+      };
+      std::pmr::vector<std::thread> thrds(_scratch);
+      for (size_t i = 1; i < thrdN; ++i)
+        thrds.emplace_back(work);
+      work();
+      for (auto& t : thrds)
+        t.join();
+    }
+
+    return resolve(bmap.data(), sw, sh, opts,
+                   {int16_t(left + x0), int16_t(bottom + y0)});
+  }
+
+  /// Side of the square tiles of samples, and the least number of samples
+  /// worth rasterizing on several threads.
+  ///
+  static constexpr uint32_t TileLen = 16;
+  static constexpr uint32_t ParallelLen = 256 * 256;
+
+  /// Computes the row length of a bitmap.
+  ///
+  static uint32_t pitchOf(PixelFmt format, uint16_t w) {
+    switch (format) {
+      case PixelFmt::A1: return (w+7) / 8;
+      case PixelFmt::RGBA8: return w * 4;
+      default: return w;
     }
+  }
 
-    switch (SAA) {
-      case 1:
+  /// Converts a row of coverage values into the given format.
+  ///
+  static void convert(const uint8_t* cov, uint8_t* dst, uint16_t n,
+                      PixelFmt format, const uint8_t* lut) {
+    const auto& kern = kernels::get();
+    switch (format) {
+      case PixelFmt::A8:
+        if (cov != dst)
+          std::copy(cov, cov+n, dst);
+        break;
+      case PixelFmt::A1:
+        kern.toA1(cov, dst, n);
+        break;
+      case PixelFmt::A8Gamma:
+        kern.lookup(cov, dst, n, lut);
+        break;
+      case PixelFmt::RGBA8:
+        kern.toRGBA8(cov, dst, n);
         break;
+    }
+  }
 
-      case 4: {
-        const uint16_t ds = SAA>>1;
-        const uint16_t dw = w / ds;
-        const uint16_t dh = h / ds;
-        auto dbm = new uint8_t[dw*dh];
-        for (uint16_t y = 0; y < dh; ++y) {
-          for (uint16_t x = 0; x < dw; ++x) {
-            const float s1 = bmap[ds*(y*w+x)];
-            const float s2 = bmap[ds*(y*w+x+1)];
-            const float s3 = bmap[ds*((y+1)*w+x)];
-            const float s4 = bmap[ds*((y+1)*w+x+1)];
-            dbm[y*dw+x] = (s1+s2+s3+s4) / 4.0f;
-          }
-        }
-        delete[] bmap;
-        return std::unique_ptr<Glyph>{new SFNTGlyph{{dw, dh}, dbm}};
-      }
+  /// Converts coverage, whose rows are 'covPitch' bytes apart, into a
+  /// bitmap of the requested format.
+  ///
+  SFNTGlyph* encode(const uint8_t* cov, uint32_t covPitch, uint16_t w,
+                    uint16_t h, const RenderOpts& opts,
+                    std::pair<int16_t, int16_t> bearing) {
+    const uint32_t pitch = pitchOf(opts.format, w);
+    auto glyph = new SFNTGlyph{{w, h}, opts.format, pitch, bearing, _scratch};
+    uint8_t lut[256];
+    if (opts.format == PixelFmt::A8Gamma)
+      kernels::makeGammaLut(opts.gamma, lut);
+    for (uint16_t y = 0; y < h; ++y)
+      convert(cov + size_t(y)*covPitch, glyph->buffer() + size_t(y)*pitch, w,
+              opts.format, lut);
+    return glyph;
+  }
+
+  /// Resolves samples into pixels of the requested format.
+  ///
+  /// Downsampling and format conversion are done one row at a time, so the
+  /// output is produced in a single pass over the samples.
+  ///
+  std::unique_ptr<Glyph> resolve(const uint8_t* smp, uint16_t w, uint16_t h,
+                                 const RenderOpts& opts,
+                                 std::pair<int16_t, int16_t> bearing) {
+    static_assert(SAA == 1 || SAA == 4, "!SAA");
+    const uint16_t ds = std::max(1, SAA>>1);
+    const uint16_t dw = w / ds;
+    const uint16_t dh = h / ds;
+    const auto& kern = kernels::get();
 
-      // TODO: Other SAA values.
+    const uint32_t pitch = pitchOf(opts.format, dw);
+    auto glyph = new SFNTGlyph{{dw, dh}, opts.format, pitch, bearing, _scratch};
 
-      default:
-        std::abort();
+    uint8_t lut[256];
+    if (opts.format == PixelFmt::A8Gamma)
+      kernels::makeGammaLut(opts.gamma, lut);
+    std::pmr::vector<uint8_t> row(_scratch);
+    if (ds != 1 && opts.format != PixelFmt::A8)
+      row.resize(dw);
+
+    for (uint16_t y = 0; y < dh; ++y) {
+      uint8_t* dst = glyph->buffer() + y*pitch;
+      const uint8_t* cov = smp + y*w;
+      if (ds != 1) {
+        // A8 needs no conversion, so it is filtered straight into place
+        uint8_t* flt = opts.format == PixelFmt::A8 ? dst : row.data();
+        kern.downsample(smp + ds*y*w, smp + (ds*y+1)*w, flt, dw);
+        cov = flt;
+      }
+      convert(cov, dst, dw, opts.format, lut);
     }
 
-    return std::unique_ptr<Glyph>{new SFNTGlyph{{w, h}, bmap}};
+    return std::unique_ptr<Glyph>{glyph};
   }
 
+  /// Font file, kept open for lazy loading.
+  ///
+  std::ifstream _ifs;
+
+  /// Mapping of a compiled font (null for font files), and its header (in
+  /// host order).
+  ///
+  const uint8_t* _map = nullptr;
+  size_t _mapLen = 0;
+  CompHeader _comp{};
+
+  /// Font fingerprint, and the cache of rendered glyphs (if any).
+  ///
+  uint64_t _print;
+  ShmCache* _cache = nullptr;
+
+  /// Memory for decoded tables, and for temporaries and glyph bitmaps.
+  ///
+  std::pmr::memory_resource* _font;
+  std::pmr::memory_resource* _scratch;
+
+  /// Table directory (byte-swapped).
+  ///
+  std::pmr::vector<DirEntry> _dir;
+
+  /// Parts loaded so far, and the lock that serializes loading.
+  ///
+  std::atomic<uint32_t> _loaded{0};
+  std::mutex _loadMtx;
+
   /// Units per em.
   ///
   uint16_t _upem;
@@ -893,21 +3858,88 @@ class SFNT {
   ///
   uint16_t _glyphN;
 
+  /// Format of 'loca' offsets (0 for short, 1 for long).
+  ///
+  int16_t _locaFmt;
+
   /// Limits for simple and composite glyphs.
   ///
   uint16_t _maxPts, _maxCntrs, _maxCompPts, _maxCompCntrs;
 
+  /// Advance widths and left side bearings, one per glyph.
+  ///
+  std::pmr::vector<uint16_t> _advs;
+  std::pmr::vector<int16_t> _lsbs;
+
+  /// Bounds of each glyph, for metrics (see 'loadBounds').
+  ///
+  struct Bounds {
+    int16_t xMin, yMin, xMax, yMax;
+  };
+  std::pmr::vector<Bounds> _bounds;
+
+  /// Kerning pairs.
+  ///
+  Kerning _kerning;
+
   /// Character code to glyph index mapping.
   ///
-  std::unordered_map<uint16_t, uint16_t> _cmap;
+  std::pmr::unordered_map<uint16_t, uint16_t> _cmap;
+
+  /// Glyph indices of the first 256 code points ('NoGlyph' if unmapped).
+  ///
+  static constexpr uint16_t NoGlyph = 0xFFFF;
+  uint16_t _latin[256];
 
   /// Location of each glyph in the 'glyf' table, sorted by glyph index.
   ///
-  std::unique_ptr<uint32_t[]> _loca;
+  std::pmr::vector<uint32_t> _loca;
 
   /// Raw 'glyf' table data (BE).
   ///
-  std::unique_ptr<uint8_t[]> _glyf;
+  std::pmr::vector<uint8_t> _glyf;
+
+  /// Flattened compound glyphs, and the lock that guards them.
+  ///
+  std::pmr::unordered_map<uint16_t, Outline<int16_t>> _compounds;
+  std::mutex _compMtx;
+
+  /// Coverage kept for resampling, the order of its insertion (glyph
+  /// index and bitmap), the bytes of its bitmaps, and the lock that guards
+  /// them.
+  ///
+  std::pmr::unordered_map<uint16_t, std::pmr::vector<Sized>> _sized;
+  std::pmr::deque<std::pair<uint16_t, const Glyph*>> _sizedOrder;
+  size_t _sizedLen = 0;
+  std::mutex _sizedMtx;
+
+  /// Axes of a variable font, and the segment maps of each axis.
+  ///
+  std::pmr::vector<Axis> _axes;
+  std::pmr::vector<std::pmr::vector<std::pair<int16_t, int16_t>>> _avar;
+
+  /// Selected coordinates (see 'setVariation'), and their hash (zero for
+  /// the default instance).
+  ///
+  std::pmr::vector<int16_t> _coords;
+  uint64_t _varPrint = 0;
+
+  /// Glyph variations, and the offsets and flags of its header.
+  ///
+  std::pmr::vector<uint8_t> _gvar;
+  uint32_t _gvarShared = 0;
+  uint16_t _gvarSharedN = 0;
+  uint32_t _gvarData = 0;
+  bool _gvarLong = false;
+
+  /// Instanced glyphs, by hash of glyph index and coordinates, and the
+  /// order of their insertion.
+  ///
+  std::pmr::unordered_map<uint64_t, std::shared_ptr<const Instance>>
+    _instances;
+  std::pmr::vector<uint64_t> _instRing;
+  uint32_t _instNext = 0;
+  std::mutex _instMtx;
 };
 
 } // ns
@@ -915,27 +3947,364 @@ class SFNT {
 Glyph::Glyph() {}
 Glyph::~Glyph() {}
 
+float Glyph::error() const {
+  return 0.0f;
+}
+
+bool Mesh::contains(float x, float y) const {
+  int wind = 0;
+  for (size_t i = 0; i+2 < vertices.size(); i += 3) {
+    const auto& a = vertices[i];
+    const auto& b = vertices[i+1];
+    const auto& c = vertices[i+2];
+    const float area = (b.x-a.x)*(c.y-a.y) - (b.y-a.y)*(c.x-a.x);
+    if (area == 0.0f)
+      continue;
+    // barycentric coordinates, all of the area's sign if inside
+    const float wa = ((b.x-x)*(c.y-y) - (b.y-y)*(c.x-x)) / area;
+    const float wb = ((c.x-x)*(a.y-y) - (c.y-y)*(a.x-x)) / area;
+    const float wc = 1.0f - wa - wb;
+    if (wa < 0.0f || wb < 0.0f || wc < 0.0f)
+      continue;
+    const float u = wa*a.u + wb*b.u + wc*c.u;
+    const float v = wa*a.v + wb*b.v + wc*c.v;
+    if (u*u < v)
+      wind += area > 0.0f ? 1 : -1;
+  }
+  return wind != 0;
+}
+
+PackedGlyph::PackedGlyph(const Glyph& glyph)
+  : _extent(glyph.extent()), _format(glyph.format()), _pitch(glyph.pitch()),
+    _bearing(glyph.bearing()) {
+  const uint16_t h = _extent.second;
+  _rows.resize(kernels::packBound(_pitch, h));
+  const uint32_t len = kernels::pack(glyph.data(), _pitch, h, _pitch,
+                                     _rows.data());
+  // kept as is if packing does not pay off (e.g. for 1-bit glyphs)
+  _packed = len < _pitch*h;
+  if (_packed)
+    _rows.resize(len);
+  else
+    _rows.assign(glyph.data(), glyph.data() + _pitch*h);
+  _rows.shrink_to_fit();
+}
+
+PackedGlyph::~PackedGlyph() {}
+
+std::pair<uint16_t, uint16_t> PackedGlyph::extent() const {
+  return _extent;
+}
+
+PixelFmt PackedGlyph::format() const {
+  return _format;
+}
+
+uint32_t PackedGlyph::pitch() const {
+  return _pitch;
+}
+
+std::pair<int16_t, int16_t> PackedGlyph::bearing() const {
+  return _bearing;
+}
+
+size_t PackedGlyph::size() const {
+  return _rows.size();
+}
+
+void PackedGlyph::unpack(uint8_t* dst, uint32_t dstPitch) const {
+  if (_packed) {
+    kernels::get().unpack(_rows.data(), _rows.size(), dst, _pitch,
+                          _extent.second, dstPitch);
+  } else {
+    for (uint16_t y = 0; y < _extent.second; ++y)
+      std::copy_n(&_rows[y*_pitch], _pitch, dst + y*dstPitch);
+  }
+}
+
+std::unique_ptr<Glyph> PackedGlyph::unpack(std::pmr::memory_resource* mem)
+  const {
+  auto glyph = new SFNTGlyph{_extent, _format, _pitch, _bearing,
+                             mem ? mem : std::pmr::get_default_resource()};
+  unpack(glyph->buffer(), _pitch);
+  return std::unique_ptr<Glyph>{glyph};
+}
+
 class Font::Impl {
  public:
-  Impl(const std::string& pathname) {
-    std::ifstream ifs(pathname);
+  Impl(const std::string& pathname, bool verify,
+       std::pmr::memory_resource* fontMem,
+       std::pmr::memory_resource* scratchMem) {
+    std::ifstream ifs(pathname, std::ios_base::binary);
     if (!ifs)
       std::abort();
+    if (!fontMem)
+      fontMem = std::pmr::get_default_resource();
+    if (!scratchMem)
+      scratchMem = std::pmr::get_default_resource();
     // TODO: Check whether this is a sfnt file.
-    _sfnt = std::make_unique<SFNT>(ifs);
+    if (SFNT::isCompiled(ifs)) {
+      ifs.close();
+      _sfnt = std::make_unique<SFNT>(pathname, verify, fontMem, scratchMem);
+    } else {
+      _sfnt = std::make_unique<SFNT>(std::move(ifs), verify, fontMem,
+                                     scratchMem);
+    }
+  }
+
+  void compile(const std::string& pathname) {
+    _sfnt->compile(pathname);
+  }
+
+  std::unique_ptr<Glyph> getGlyph(wchar_t chr, uint16_t pts, uint16_t dpi,
+                                  const RenderOpts& opts) {
+    return _sfnt->getGlyph(chr, pts, dpi, opts);
+  }
+
+  std::vector<std::unique_ptr<Glyph>> getGlyphs(
+    wchar_t chr, const std::vector<uint16_t>& pts, uint16_t dpi,
+    const RenderOpts& opts, bool parallel) {
+
+    return _sfnt->getGlyphs(chr, pts, dpi, opts, parallel);
+  }
+
+  std::unique_ptr<Glyph> getIndexGlyph(uint16_t index, uint16_t pts,
+                                       uint16_t dpi, const RenderOpts& opts) {
+    return _sfnt->getIndexGlyph(index, pts, dpi, opts);
+  }
+
+  std::unique_ptr<Glyph> renderRun(const std::wstring& str, uint16_t pts,
+                                   uint16_t dpi, const RenderOpts& opts) {
+    return _sfnt->renderRun(str, pts, dpi, opts);
+  }
+
+  uint16_t getIndex(wchar_t chr) {
+    return _sfnt->getIndex(chr);
+  }
+
+  template<class T>
+  size_t mapText(const T* text, size_t len, uint16_t* indices,
+                 std::vector<Unmapped>* missing) {
+    return _sfnt->mapText(text, len, indices, missing);
+  }
+
+  template<class F>
+  void mappings(F fn) {
+    _sfnt->mappings(fn);
+  }
+
+  void setCache(ShmCache* cache) {
+    _sfnt->setCache(cache);
+  }
+
+  std::vector<Axis> axes() const {
+    return _sfnt->axes();
+  }
+
+  void setVariation(const std::vector<Variation>& variations) {
+    _sfnt->setVariation(variations);
+  }
+
+  MemoryUsage memoryUsage() {
+    return _sfnt->memoryUsage();
+  }
+
+  void trim(TrimLevel level) {
+    _sfnt->trim(level);
+  }
+
+  Mesh getMesh(uint16_t index) {
+    return _sfnt->getMesh(index);
+  }
+
+  Metrics getMetrics(uint16_t index, uint16_t pts, uint16_t dpi) {
+    return _sfnt->getMetrics(index, pts, dpi);
+  }
+
+  void getKerning(const uint16_t* indices, size_t n, float* adjs,
+                  uint16_t pts, uint16_t dpi) {
+    _sfnt->getKerning(indices, n, adjs, pts, dpi);
   }
 
-  std::unique_ptr<Glyph> getGlyph(wchar_t chr, uint16_t pts, uint16_t dpi) {
-    return _sfnt->getGlyph(chr, pts, dpi);
+  Metrics measure(const std::wstring& str, uint16_t pts, uint16_t dpi) {
+    return _sfnt->measure(str, pts, dpi);
   }
 
  private:
   std::unique_ptr<SFNT> _sfnt;
 };
 
-Font::Font(const std::string& pathname) : _impl(new Impl{pathname}) {}
+Font::Font(const std::string& pathname, bool verify,
+           std::pmr::memory_resource* fontMem,
+           std::pmr::memory_resource* scratchMem)
+  : _impl(new Impl{pathname, verify, fontMem, scratchMem}) {}
 Font::~Font() {}
 
-std::unique_ptr<Glyph> Font::getGlyph(wchar_t chr, uint16_t pts, uint16_t dpi) {
-  return _impl->getGlyph(chr, pts, dpi);
+std::unique_ptr<Glyph> Font::getGlyph(wchar_t chr, uint16_t pts, uint16_t dpi,
+                                      const RenderOpts& opts) {
+  return _impl->getGlyph(chr, pts, dpi, opts);
+}
+
+std::vector<std::unique_ptr<Glyph>> Font::getGlyphs(
+  wchar_t chr, const std::vector<uint16_t>& pts, uint16_t dpi,
+  const RenderOpts& opts, bool parallel) {
+
+  return _impl->getGlyphs(chr, pts, dpi, opts, parallel);
+}
+
+std::unique_ptr<Glyph> Font::getIndexGlyph(uint16_t index, uint16_t pts,
+                                           uint16_t dpi,
+                                           const RenderOpts& opts) {
+  return _impl->getIndexGlyph(index, pts, dpi, opts);
+}
+
+std::unique_ptr<Glyph> Font::renderRun(const std::wstring& str, uint16_t pts,
+                                       uint16_t dpi, const RenderOpts& opts) {
+  return _impl->renderRun(str, pts, dpi, opts);
+}
+
+uint16_t Font::getIndex(wchar_t chr) {
+  return _impl->getIndex(chr);
+}
+
+size_t Font::mapText(const char* text, size_t len, uint16_t* indices,
+                     std::vector<Unmapped>* missing) {
+  return _impl->mapText(text, len, indices, missing);
+}
+
+size_t Font::mapText(const char16_t* text, size_t len, uint16_t* indices,
+                     std::vector<Unmapped>* missing) {
+  return _impl->mapText(text, len, indices, missing);
+}
+
+Mesh Font::getMesh(wchar_t chr) {
+  return _impl->getMesh(_impl->getIndex(chr));
+}
+
+Mesh Font::getIndexMesh(uint16_t index) {
+  return _impl->getMesh(index);
+}
+
+Metrics Font::getMetrics(wchar_t chr, uint16_t pts, uint16_t dpi) {
+  return _impl->getMetrics(_impl->getIndex(chr), pts, dpi);
+}
+
+Metrics Font::getIndexMetrics(uint16_t index, uint16_t pts, uint16_t dpi) {
+  return _impl->getMetrics(index, pts, dpi);
+}
+
+Metrics Font::measure(const std::wstring& str, uint16_t pts, uint16_t dpi) {
+  return _impl->measure(str, pts, dpi);
+}
+
+void Font::getKerning(const uint16_t* indices, size_t n, float* adjs,
+                      uint16_t pts, uint16_t dpi) {
+  _impl->getKerning(indices, n, adjs, pts, dpi);
+}
+
+MemoryUsage Font::memoryUsage() {
+  return _impl->memoryUsage();
+}
+
+void Font::trim(TrimLevel level) {
+  _impl->trim(level);
+}
+
+void Font::compile(const std::string& pathname) {
+  _impl->compile(pathname);
+}
+
+void Font::setCache(SharedCache* cache) {
+  _impl->setCache(cache ? cache->_cache.get() : nullptr);
+}
+
+std::vector<Axis> Font::axes() {
+  return _impl->axes();
+}
+
+void Font::setVariation(const std::vector<Variation>& variations) {
+  _impl->setVariation(variations);
+}
+
+FontSet::FontSet(const std::vector<std::string>& pathnames, bool verify,
+                 std::pmr::memory_resource* fontMem,
+                 std::pmr::memory_resource* scratchMem)
+  : _faces(0x10000), _indices(0x10000) {
+  if (pathnames.size() > 256)
+    // TODO
+    std::abort();
+
+  // the merged table keeps the first font that maps each code point
+  for (size_t i = 0; i < pathnames.size(); ++i) {
+    _fonts.emplace_back(new Font{pathnames[i], verify, fontMem, scratchMem});
+    _fonts[i]->_impl->mappings([&](uint16_t chr, uint16_t idx) {
+      if (idx != 0 && _indices[chr] == 0) {
+        _faces[chr] = i;
+        _indices[chr] = idx;
+      }
+    });
+  }
+}
+
+FontSet::~FontSet() {}
+
+size_t FontSet::size() const {
+  return _fonts.size();
+}
+
+Font& FontSet::font(size_t i) {
+  return *_fonts[i];
+}
+
+uint8_t FontSet::select(char32_t chr) const {
+  return chr <= 0xFFFF ? _faces[chr] : 0;
+}
+
+size_t FontSet::mapText(const char* text, size_t len, uint16_t* indices,
+                        uint8_t* fonts, std::vector<Unmapped>* missing) {
+  return map(text, len, indices, fonts, missing);
+}
+
+size_t FontSet::mapText(const char16_t* text, size_t len, uint16_t* indices,
+                        uint8_t* fonts, std::vector<Unmapped>* missing) {
+  return map(text, len, indices, fonts, missing);
+}
+
+std::unique_ptr<Glyph> FontSet::getGlyph(wchar_t chr, uint16_t pts,
+                                         uint16_t dpi,
+                                         const RenderOpts& opts) {
+  const uint32_t cp = chr;
+  if (cp > 0xFFFF || _indices[cp] == 0)
+    return _fonts[0]->getGlyph(chr, pts, dpi, opts);
+  return _fonts[_faces[cp]]->getIndexGlyph(_indices[cp], pts, dpi, opts);
+}
+
+template<class T>
+size_t FontSet::map(const T* text, size_t len, uint16_t* indices,
+                    uint8_t* fonts, std::vector<Unmapped>* missing) {
+  const auto& kern = kernels::get();
+  auto put = [&](size_t n, char32_t chr) {
+    const bool mapped = chr <= 0xFFFF && _indices[chr] != 0;
+    indices[n] = mapped ? _indices[chr] : 0;
+    fonts[n] = mapped ? _faces[chr] : 0;
+    if (!mapped && missing)
+      missing->push_back({n, chr});
+  };
+
+  size_t n = 0;
+  for (size_t i = 0; i < len;) {
+    const uint32_t max = std::min<size_t>(len-i, UINT32_MAX);
+    uint32_t run;
+    if constexpr (sizeof(T) == 1)
+      run = kern.asciiLen(text+i, max);
+    else
+      run = kern.asciiLen16(text+i, max);
+    for (uint32_t j = 0; j < run; ++j)
+      put(n+j, text[i+j]);
+    i += run;
+    n += run;
+    if (i < len)
+      put(n++, decode(text, len, i));
+  }
+  return n;
 }
@@ -0,0 +1,705 @@
+//
+// Font
+// kernels.cc
+//
+// Copyright (C) 2020 Gustavo C. Viegas.
+//
+
+#include <cmath>
+#include <cstring>
+#include <algorithm>
+
+#include "kernels.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+# define FONT_X86
+# include <immintrin.h>
+# define FONT_SSE2 __attribute__((target("sse2")))
+# define FONT_AVX2 __attribute__((target("avx2")))
+#endif
+
+namespace {
+
+/// Bit-reversed bytes, for MSB-first packing of movemask results.
+///
+struct RevTable {
+  uint8_t v[256];
+  constexpr RevTable() : v() {
+    for (int i = 0; i < 256; ++i) {
+      int r = 0;
+      for (int b = 0; b < 8; ++b)
+        r |= ((i >> b) & 1) << (7-b);
+      v[i] = r;
+    }
+  }
+};
+constexpr RevTable Rev;
+
+//
+// Scalar
+//
+
+void downsampleScalar(const uint8_t* row0, const uint8_t* row1, uint8_t* dst,
+                      uint32_t n) {
+  for (uint32_t i = 0; i < n; ++i)
+    dst[i] = (row0[2*i] + row0[2*i+1] + row1[2*i] + row1[2*i+1]) >> 2;
+}
+
+void toA1Scalar(const uint8_t* src, uint8_t* dst, uint32_t n) {
+  for (uint32_t i = 0; i < n; i += 8) {
+    uint8_t bits = 0;
+    for (uint32_t j = i; j < std::min(n, i+8); ++j)
+      bits |= (src[j] >> 7) << (7-(j-i));
+    dst[i/8] = bits;
+  }
+}
+
+void toRGBA8Scalar(const uint8_t* src, uint8_t* dst, uint32_t n) {
+  for (uint32_t i = 0; i < n; ++i)
+    dst[4*i] = dst[4*i+1] = dst[4*i+2] = dst[4*i+3] = src[i];
+}
+
+void lookupScalar(const uint8_t* src, uint8_t* dst, uint32_t n,
+                  const uint8_t* lut) {
+  uint32_t i = 0;
+  for (; i+4 <= n; i += 4) {
+    dst[i] = lut[src[i]];
+    dst[i+1] = lut[src[i+1]];
+    dst[i+2] = lut[src[i+2]];
+    dst[i+3] = lut[src[i+3]];
+  }
+  for (; i < n; ++i)
+    dst[i] = lut[src[i]];
+}
+
+/// Decodes coordinates starting from a given accumulator and offset.
+///
+uint32_t decodeCoordsFrom(const uint8_t* src, const uint8_t* fmt, int16_t* dst,
+                          uint32_t n, int16_t acc, uint32_t off) {
+  for (uint32_t i = 0; i < n; ++i) {
+    switch (fmt[i] & 3) {
+      case 1:
+        acc += (fmt[i] & kernels::CoordPos) ? src[off] : -src[off];
+        break;
+      case 2:
+        acc += static_cast<int16_t>((src[off] << 8) | src[off+1]);
+        break;
+    }
+    off += fmt[i] & 3;
+    dst[i] = acc;
+  }
+  return off;
+}
+
+uint32_t decodeCoordsScalar(const uint8_t* src, const uint8_t* fmt,
+                            int16_t* dst, uint32_t n) {
+  return decodeCoordsFrom(src, fmt, dst, n, 0, 0);
+}
+
+void blendMaxScalar(uint8_t* dst, const uint8_t* src, uint32_t n) {
+  for (uint32_t i = 0; i < n; ++i)
+    dst[i] = std::max(dst[i], src[i]);
+}
+
+void blendAddScalar(uint8_t* dst, const uint8_t* src, uint32_t n) {
+  for (uint32_t i = 0; i < n; ++i)
+    dst[i] = std::min(dst[i] + src[i], 255);
+}
+
+uint32_t checksumScalar(const uint8_t* data, uint32_t len) {
+  uint32_t sum = 0;
+  for (uint32_t i = 0; i+4 <= len; i += 4)
+    sum += (uint32_t(data[i]) << 24) | (data[i+1] << 16) | (data[i+2] << 8) |
+           data[i+3];
+  return sum;
+}
+
+/// Decodes one packed token, returning the length of its output.
+///
+inline uint32_t unpackToken(const uint8_t*& src, uint8_t* dst,
+                            const uint8_t* prev) {
+  const uint8_t tok = *src++;
+  const uint32_t len = (tok & 63) + 1;
+  switch (tok & 0xC0) {
+    case kernels::RunZero:
+      std::memset(dst, 0, len);
+      break;
+    case kernels::RunFull:
+      std::memset(dst, 255, len);
+      break;
+    case kernels::RunLit:
+      std::memcpy(dst, src, len);
+      src += len;
+      break;
+    default:
+      std::memcpy(dst, prev, len);
+      break;
+  }
+  return len;
+}
+
+void unpackScalar(const uint8_t* src, uint32_t, uint8_t* dst, uint32_t n,
+                  uint16_t h, uint32_t pitch) {
+  for (uint16_t y = 0; y < h; ++y) {
+    uint8_t* row = dst + y*pitch;
+    for (uint32_t i = 0; i < n;)
+      i += unpackToken(src, row+i, row+i-pitch);
+  }
+}
+
+void filterRowsScalar(const float* const* rows, const float* wgt,
+                      uint8_t* dst, uint32_t n) {
+  for (uint32_t i = 0; i < n; ++i) {
+    float v = rows[0][i]*wgt[0];
+    v += rows[1][i]*wgt[1];
+    v += rows[2][i]*wgt[2];
+    v += rows[3][i]*wgt[3];
+    dst[i] = std::nearbyint(std::min(std::max(v, 0.0f), 255.0f));
+  }
+}
+
+uint32_t asciiLenScalar(const char* src, uint32_t n) {
+  uint32_t i = 0;
+  while (i < n && static_cast<uint8_t>(src[i]) < 0x80)
+    ++i;
+  return i;
+}
+
+uint32_t asciiLen16Scalar(const char16_t* src, uint32_t n) {
+  uint32_t i = 0;
+  while (i < n && src[i] < 0x80)
+    ++i;
+  return i;
+}
+
+#ifdef FONT_X86
+
+//
+// SSE2
+//
+
+/// Sums each pair of adjacent bytes into a word.
+///
+FONT_SSE2 inline __m128i pairSum(__m128i v) {
+  const __m128i lo = _mm_set1_epi16(0x00FF);
+  return _mm_add_epi16(_mm_and_si128(v, lo), _mm_srli_epi16(v, 8));
+}
+
+FONT_SSE2
+void downsampleSSE2(const uint8_t* row0, const uint8_t* row1, uint8_t* dst,
+                    uint32_t n) {
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    auto r0 = reinterpret_cast<const __m128i*>(row0+2*i);
+    auto r1 = reinterpret_cast<const __m128i*>(row1+2*i);
+    const auto a0 = _mm_loadu_si128(r0);
+    const auto a1 = _mm_loadu_si128(r0+1);
+    const auto b0 = _mm_loadu_si128(r1);
+    const auto b1 = _mm_loadu_si128(r1+1);
+    const auto s0 = _mm_add_epi16(pairSum(a0), pairSum(b0));
+    const auto s1 = _mm_add_epi16(pairSum(a1), pairSum(b1));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i),
+      _mm_packus_epi16(_mm_srli_epi16(s0, 2), _mm_srli_epi16(s1, 2)));
+  }
+  downsampleScalar(row0+2*i, row1+2*i, dst+i, n-i);
+}
+
+FONT_SSE2
+void toA1SSE2(const uint8_t* src, uint8_t* dst, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    const uint32_t m = _mm_movemask_epi8(v);
+    dst[i/8] = Rev.v[m & 0xFF];
+    dst[i/8+1] = Rev.v[m >> 8];
+  }
+  toA1Scalar(src+i, dst+i/8, n-i);
+}
+
+FONT_SSE2
+void toRGBA8SSE2(const uint8_t* src, uint8_t* dst, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    const auto l = _mm_unpacklo_epi8(v, v);
+    const auto h = _mm_unpackhi_epi8(v, v);
+    auto d = reinterpret_cast<__m128i*>(dst+4*i);
+    _mm_storeu_si128(d, _mm_unpacklo_epi16(l, l));
+    _mm_storeu_si128(d+1, _mm_unpackhi_epi16(l, l));
+    _mm_storeu_si128(d+2, _mm_unpacklo_epi16(h, h));
+    _mm_storeu_si128(d+3, _mm_unpackhi_epi16(h, h));
+  }
+  toRGBA8Scalar(src+i, dst+4*i, n-i);
+}
+
+FONT_SSE2
+void blendMaxSSE2(uint8_t* dst, const uint8_t* src, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    auto d = reinterpret_cast<__m128i*>(dst+i);
+    const auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    _mm_storeu_si128(d, _mm_max_epu8(_mm_loadu_si128(d), s));
+  }
+  blendMaxScalar(dst+i, src+i, n-i);
+}
+
+FONT_SSE2
+void blendAddSSE2(uint8_t* dst, const uint8_t* src, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    auto d = reinterpret_cast<__m128i*>(dst+i);
+    const auto s = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    _mm_storeu_si128(d, _mm_adds_epu8(_mm_loadu_si128(d), s));
+  }
+  blendAddScalar(dst+i, src+i, n-i);
+}
+
+FONT_SSE2
+uint32_t checksumSSE2(const uint8_t* data, uint32_t len) {
+  auto acc = _mm_setzero_si128();
+  uint32_t i = 0;
+  for (; i+16 <= len; i += 16) {
+    auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(data+i));
+    // swap bytes within words, then words within dwords
+    v = _mm_or_si128(_mm_slli_epi16(v, 8), _mm_srli_epi16(v, 8));
+    v = _mm_or_si128(_mm_slli_epi32(v, 16), _mm_srli_epi32(v, 16));
+    acc = _mm_add_epi32(acc, v);
+  }
+  uint32_t part[4];
+  _mm_storeu_si128(reinterpret_cast<__m128i*>(part), acc);
+  return part[0] + part[1] + part[2] + part[3] +
+         checksumScalar(data+i, len-i);
+}
+
+FONT_SSE2
+void unpackSSE2(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t n,
+                uint16_t h, uint32_t pitch) {
+  const uint8_t* end = src + len;
+  for (uint16_t y = 0; y < h; ++y) {
+    uint8_t* row = dst + y*pitch;
+    uint32_t i = 0;
+    while (i < n) {
+      const uint8_t tok = *src;
+      const uint8_t kind = tok & 0xC0;
+      const uint32_t cnt = (tok & 63) + 1;
+      const uint32_t vecLen = (cnt+15) & ~15;
+
+      // tokens are written in whole vectors when the excess stays within
+      // the row (to be overwritten by the next tokens), and the input too
+      if (i+vecLen > n || (kind == kernels::RunLit && src+1+vecLen > end)) {
+        i += unpackToken(src, row+i, row+i-pitch);
+        continue;
+      }
+      const uint8_t* from = kind == kernels::RunLit ? src+1 : row+i-pitch;
+      if (kind == kernels::RunZero || kind == kernels::RunFull) {
+        const auto v = _mm_set1_epi8(-(kind >> 6));
+        for (uint32_t j = 0; j < vecLen; j += 16)
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(row+i+j), v);
+      } else {
+        for (uint32_t j = 0; j < vecLen; j += 16)
+          _mm_storeu_si128(reinterpret_cast<__m128i*>(row+i+j),
+            _mm_loadu_si128(reinterpret_cast<const __m128i*>(from+j)));
+      }
+      src += kind == kernels::RunLit ? 1+cnt : 1;
+      i += cnt;
+    }
+  }
+}
+
+/// Sums four vectors of rows at 'i', weighted, clamped to [0, 255].
+///
+FONT_SSE2 inline __m128i filterSum(const float* const* rows, uint32_t i,
+                                   const __m128* wgt) {
+  auto v = _mm_mul_ps(_mm_loadu_ps(rows[0]+i), wgt[0]);
+  v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(rows[1]+i), wgt[1]));
+  v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(rows[2]+i), wgt[2]));
+  v = _mm_add_ps(v, _mm_mul_ps(_mm_loadu_ps(rows[3]+i), wgt[3]));
+  v = _mm_min_ps(_mm_max_ps(v, _mm_setzero_ps()), _mm_set1_ps(255.0f));
+  return _mm_cvtps_epi32(v);
+}
+
+FONT_SSE2
+void filterRowsSSE2(const float* const* rows, const float* wgt,
+                    uint8_t* dst, uint32_t n) {
+  const __m128 w[4] = {_mm_set1_ps(wgt[0]), _mm_set1_ps(wgt[1]),
+                       _mm_set1_ps(wgt[2]), _mm_set1_ps(wgt[3])};
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    const auto lo = _mm_packs_epi32(filterSum(rows, i, w),
+                                    filterSum(rows, i+4, w));
+    const auto hi = _mm_packs_epi32(filterSum(rows, i+8, w),
+                                    filterSum(rows, i+12, w));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i),
+                     _mm_packus_epi16(lo, hi));
+  }
+  const float* rest[4] = {rows[0]+i, rows[1]+i, rows[2]+i, rows[3]+i};
+  filterRowsScalar(rest, wgt, dst+i, n-i);
+}
+
+FONT_SSE2
+uint32_t asciiLenSSE2(const char* src, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    const uint32_t m = _mm_movemask_epi8(v);
+    if (m != 0)
+      return i + __builtin_ctz(m);
+  }
+  return i + asciiLenScalar(src+i, n-i);
+}
+
+FONT_SSE2
+uint32_t asciiLen16SSE2(const char16_t* src, uint32_t n) {
+  const auto high = _mm_set1_epi16(-0x80);
+  uint32_t i = 0;
+  for (; i+8 <= n; i += 8) {
+    const auto v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i));
+    const auto nz = _mm_cmpeq_epi16(_mm_and_si128(v, high),
+                                    _mm_setzero_si128());
+    const uint32_t m = _mm_movemask_epi8(nz) ^ 0xFFFF;
+    if (m != 0)
+      return i + __builtin_ctz(m)/2;
+  }
+  return i + asciiLen16Scalar(src+i, n-i);
+}
+
+//
+// AVX2
+//
+
+FONT_AVX2 inline __m256i pairSum(__m256i v) {
+  const __m256i lo = _mm256_set1_epi16(0x00FF);
+  return _mm256_add_epi16(_mm256_and_si256(v, lo), _mm256_srli_epi16(v, 8));
+}
+
+FONT_AVX2
+void downsampleAVX2(const uint8_t* row0, const uint8_t* row1, uint8_t* dst,
+                    uint32_t n) {
+  uint32_t i = 0;
+  for (; i+32 <= n; i += 32) {
+    auto r0 = reinterpret_cast<const __m256i*>(row0+2*i);
+    auto r1 = reinterpret_cast<const __m256i*>(row1+2*i);
+    const auto a0 = _mm256_loadu_si256(r0);
+    const auto a1 = _mm256_loadu_si256(r0+1);
+    const auto b0 = _mm256_loadu_si256(r1);
+    const auto b1 = _mm256_loadu_si256(r1+1);
+    const auto s0 = _mm256_add_epi16(pairSum(a0), pairSum(b0));
+    const auto s1 = _mm256_add_epi16(pairSum(a1), pairSum(b1));
+    // packus works per 128-bit lane, so quadwords come out as 0,2,1,3
+    const auto p = _mm256_permute4x64_epi64(
+      _mm256_packus_epi16(_mm256_srli_epi16(s0, 2), _mm256_srli_epi16(s1, 2)),
+      0xD8);
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst+i), p);
+  }
+  downsampleSSE2(row0+2*i, row1+2*i, dst+i, n-i);
+}
+
+FONT_AVX2
+void toA1AVX2(const uint8_t* src, uint8_t* dst, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+32 <= n; i += 32) {
+    const auto v =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i));
+    const uint32_t m = _mm256_movemask_epi8(v);
+    dst[i/8] = Rev.v[m & 0xFF];
+    dst[i/8+1] = Rev.v[(m >> 8) & 0xFF];
+    dst[i/8+2] = Rev.v[(m >> 16) & 0xFF];
+    dst[i/8+3] = Rev.v[m >> 24];
+  }
+  toA1SSE2(src+i, dst+i/8, n-i);
+}
+
+FONT_AVX2
+void toRGBA8AVX2(const uint8_t* src, uint8_t* dst, uint32_t n) {
+  // each lane shuffles its own copy of the 16 source pixels
+  const auto lo = _mm256_setr_epi8(0, 0, 0, 0, 1, 1, 1, 1,
+                                   2, 2, 2, 2, 3, 3, 3, 3,
+                                   4, 4, 4, 4, 5, 5, 5, 5,
+                                   6, 6, 6, 6, 7, 7, 7, 7);
+  const auto hi = _mm256_add_epi8(lo, _mm256_set1_epi8(8));
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    const auto v = _mm256_broadcastsi128_si256(
+      _mm_loadu_si128(reinterpret_cast<const __m128i*>(src+i)));
+    auto d = reinterpret_cast<__m256i*>(dst+4*i);
+    _mm256_storeu_si256(d, _mm256_shuffle_epi8(v, lo));
+    _mm256_storeu_si256(d+1, _mm256_shuffle_epi8(v, hi));
+  }
+  toRGBA8SSE2(src+i, dst+4*i, n-i);
+}
+
+FONT_AVX2
+void blendMaxAVX2(uint8_t* dst, const uint8_t* src, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+32 <= n; i += 32) {
+    auto d = reinterpret_cast<__m256i*>(dst+i);
+    const auto s =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i));
+    _mm256_storeu_si256(d, _mm256_max_epu8(_mm256_loadu_si256(d), s));
+  }
+  blendMaxSSE2(dst+i, src+i, n-i);
+}
+
+FONT_AVX2
+void blendAddAVX2(uint8_t* dst, const uint8_t* src, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+32 <= n; i += 32) {
+    auto d = reinterpret_cast<__m256i*>(dst+i);
+    const auto s =
+      _mm256_loadu_si256(reinterpret_cast<const __m256i*>(src+i));
+    _mm256_storeu_si256(d, _mm256_adds_epu8(_mm256_loadu_si256(d), s));
+  }
+  blendAddSSE2(dst+i, src+i, n-i);
+}
+
+FONT_AVX2
+uint32_t checksumAVX2(const uint8_t* data, uint32_t len) {
+  const auto swap = _mm256_setr_epi8(3, 2, 1, 0, 7, 6, 5, 4,
+                                     11, 10, 9, 8, 15, 14, 13, 12,
+                                     3, 2, 1, 0, 7, 6, 5, 4,
+                                     11, 10, 9, 8, 15, 14, 13, 12);
+  auto acc0 = _mm256_setzero_si256();
+  auto acc1 = _mm256_setzero_si256();
+  uint32_t i = 0;
+  for (; i+64 <= len; i += 64) {
+    auto p = reinterpret_cast<const __m256i*>(data+i);
+    acc0 = _mm256_add_epi32(acc0,
+      _mm256_shuffle_epi8(_mm256_loadu_si256(p), swap));
+    acc1 = _mm256_add_epi32(acc1,
+      _mm256_shuffle_epi8(_mm256_loadu_si256(p+1), swap));
+  }
+  uint32_t part[8];
+  _mm256_storeu_si256(reinterpret_cast<__m256i*>(part),
+                      _mm256_add_epi32(acc0, acc1));
+  uint32_t sum = 0;
+  for (const auto& p : part)
+    sum += p;
+  return sum + checksumSSE2(data+i, len-i);
+}
+
+/// Inclusive prefix sum of eight dwords.
+///
+FONT_AVX2 inline __m256i prefixSum(__m256i v) {
+  v = _mm256_add_epi32(v, _mm256_slli_si256(v, 4));
+  v = _mm256_add_epi32(v, _mm256_slli_si256(v, 8));
+  // carry the low lane's total into the high lane
+  const auto c = _mm256_permutevar8x32_epi32(v, _mm256_set1_epi32(3));
+  return _mm256_add_epi32(v, _mm256_blend_epi32(_mm256_setzero_si256(), c,
+                                                0xF0));
+}
+
+FONT_AVX2
+uint32_t decodeCoordsAVX2(const uint8_t* src, const uint8_t* fmt, int16_t* dst,
+                          uint32_t n) {
+  const auto last = _mm256_set1_epi32(7);
+  const auto three = _mm256_set1_epi32(3);
+  const auto byteMask = _mm256_set1_epi32(0xFF);
+  auto acc = _mm256_setzero_si256();
+  auto off = _mm256_setzero_si256();
+  uint32_t i = 0;
+  for (; i+8 <= n; i += 8) {
+    const auto f = _mm256_cvtepu8_epi32(
+      _mm_loadl_epi64(reinterpret_cast<const __m128i*>(fmt+i)));
+    const auto sz = _mm256_and_si256(f, three);
+
+    // offsets of each delta, from an exclusive scan of the field sizes
+    const auto end = _mm256_add_epi32(off, prefixSum(sz));
+    const auto beg = _mm256_sub_epi32(end, sz);
+    const auto raw = _mm256_i32gather_epi32(
+      reinterpret_cast<const int*>(src), beg, 1);
+
+    const auto b0 = _mm256_and_si256(raw, byteMask);
+    const auto b1 = _mm256_and_si256(_mm256_srli_epi32(raw, 8), byteMask);
+    const auto word = _mm256_srai_epi32(
+      _mm256_slli_epi32(_mm256_or_si256(_mm256_slli_epi32(b0, 8), b1), 16),
+      16);
+    const auto pos = _mm256_cmpeq_epi32(
+      _mm256_and_si256(f, _mm256_set1_epi32(kernels::CoordPos)),
+      _mm256_set1_epi32(kernels::CoordPos));
+    const auto byte = _mm256_blendv_epi8(_mm256_sub_epi32(
+      _mm256_setzero_si256(), b0), b0, pos);
+    auto dt = _mm256_blendv_epi8(
+      _mm256_setzero_si256(), byte,
+      _mm256_cmpeq_epi32(sz, _mm256_set1_epi32(1)));
+    dt = _mm256_blendv_epi8(dt, word,
+                            _mm256_cmpeq_epi32(sz, _mm256_set1_epi32(2)));
+
+    // coordinates wrap as 16-bit values, so only the low words are kept
+    const auto crd = _mm256_add_epi32(acc, prefixSum(dt));
+    const auto lo = _mm256_and_si256(crd, _mm256_set1_epi32(0xFFFF));
+    const auto pk = _mm256_permute4x64_epi64(_mm256_packus_epi32(lo, lo), 0x08);
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst+i),
+                     _mm256_castsi256_si128(pk));
+
+    acc = _mm256_permutevar8x32_epi32(crd, last);
+    off = _mm256_permutevar8x32_epi32(end, last);
+  }
+  return decodeCoordsFrom(src, fmt+i, dst+i, n-i,
+                          _mm256_cvtsi256_si32(acc),
+                          _mm256_cvtsi256_si32(off));
+}
+
+FONT_AVX2 inline __m256i filterSum(const float* const* rows, uint32_t i,
+                                   const __m256* wgt) {
+  auto v = _mm256_mul_ps(_mm256_loadu_ps(rows[0]+i), wgt[0]);
+  v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_loadu_ps(rows[1]+i), wgt[1]));
+  v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_loadu_ps(rows[2]+i), wgt[2]));
+  v = _mm256_add_ps(v, _mm256_mul_ps(_mm256_loadu_ps(rows[3]+i), wgt[3]));
+  v = _mm256_min_ps(_mm256_max_ps(v, _mm256_setzero_ps()),
+                    _mm256_set1_ps(255.0f));
+  return _mm256_cvtps_epi32(v);
+}
+
+FONT_AVX2
+void filterRowsAVX2(const float* const* rows, const float* wgt,
+                    uint8_t* dst, uint32_t n) {
+  const __m256 w[4] = {_mm256_set1_ps(wgt[0]), _mm256_set1_ps(wgt[1]),
+                       _mm256_set1_ps(wgt[2]), _mm256_set1_ps(wgt[3])};
+  // packing interleaves the 128-bit lanes, which the permutation undoes
+  const auto order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+  uint32_t i = 0;
+  for (; i+32 <= n; i += 32) {
+    const auto lo = _mm256_packs_epi32(filterSum(rows, i, w),
+                                       filterSum(rows, i+8, w));
+    const auto hi = _mm256_packs_epi32(filterSum(rows, i+16, w),
+                                       filterSum(rows, i+24, w));
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(dst+i),
+      _mm256_permutevar8x32_epi32(_mm256_packus_epi16(lo, hi), order));
+  }
+  const float* rest[4] = {rows[0]+i, rows[1]+i, rows[2]+i, rows[3]+i};
+  filterRowsSSE2(rest, wgt, dst+i, n-i);
+}
+
+FONT_AVX2
+uint32_t asciiLenAVX2(const char* src, uint32_t n) {
+  uint32_t i = 0;
+  for (; i+32 <= n; i += 32) {
+    const auto v = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(src+i));
+    const uint32_t m = _mm256_movemask_epi8(v);
+    if (m != 0)
+      return i + __builtin_ctz(m);
+  }
+  return i + asciiLenSSE2(src+i, n-i);
+}
+
+FONT_AVX2
+uint32_t asciiLen16AVX2(const char16_t* src, uint32_t n) {
+  const auto high = _mm256_set1_epi16(-0x80);
+  uint32_t i = 0;
+  for (; i+16 <= n; i += 16) {
+    const auto v = _mm256_loadu_si256(
+      reinterpret_cast<const __m256i*>(src+i));
+    const auto nz = _mm256_cmpeq_epi16(_mm256_and_si256(v, high),
+                                       _mm256_setzero_si256());
+    const uint32_t m = ~static_cast<uint32_t>(_mm256_movemask_epi8(nz));
+    if (m != 0)
+      return i + __builtin_ctz(m)/2;
+  }
+  return i + asciiLen16SSE2(src+i, n-i);
+}
+
+#endif // FONT_X86
+
+kernels::Table select() {
+  kernels::Table t = {downsampleScalar, toA1Scalar, toRGBA8Scalar,
+                      lookupScalar, decodeCoordsScalar, blendMaxScalar,
+                      blendAddScalar, checksumScalar, unpackScalar,
+                      filterRowsScalar, asciiLenScalar, asciiLen16Scalar};
+#ifdef FONT_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("sse2")) {
+    t.downsample = downsampleSSE2;
+    t.toA1 = toA1SSE2;
+    t.toRGBA8 = toRGBA8SSE2;
+    t.blendMax = blendMaxSSE2;
+    t.blendAdd = blendAddSSE2;
+    t.checksum = checksumSSE2;
+    t.unpack = unpackSSE2;
+    t.filterRows = filterRowsSSE2;
+    t.asciiLen = asciiLenSSE2;
+    t.asciiLen16 = asciiLen16SSE2;
+  }
+  if (__builtin_cpu_supports("avx2")) {
+    t.downsample = downsampleAVX2;
+    t.toA1 = toA1AVX2;
+    t.toRGBA8 = toRGBA8AVX2;
+    t.decodeCoords = decodeCoordsAVX2;
+    t.blendMax = blendMaxAVX2;
+    t.blendAdd = blendAddAVX2;
+    t.checksum = checksumAVX2;
+    t.filterRows = filterRowsAVX2;
+    t.asciiLen = asciiLenAVX2;
+    t.asciiLen16 = asciiLen16AVX2;
+  }
+#endif
+  // XXX: Table lookups gain nothing from byte gathers, so 'lookup' stays
+  // scalar everywhere. Packed tokens are mostly short, so 'unpack' gains
+  // nothing from wider stores either.
+  return t;
+}
+
+} // ns
+
+const kernels::Table& kernels::get() {
+  static const Table table = select();
+  return table;
+}
+
+void kernels::makeGammaLut(float gamma, uint8_t* lut) {
+  const float e = 1.0f / std::max(gamma, 0.01f);
+  for (int i = 0; i < 256; ++i)
+    lut[i] = std::round(255.0f * std::pow(i / 255.0f, e));
+}
+
+uint32_t kernels::pack(const uint8_t* src, uint32_t n, uint16_t h,
+                       uint32_t pitch, uint8_t* dst) {
+  uint8_t* d = dst;
+  for (uint16_t y = 0; y < h; ++y) {
+    const uint8_t* row = src + y*pitch;
+    const uint8_t* prev = y > 0 ? row-pitch : nullptr;
+
+    // length of the run or copy that starts at 'i' (up to 64 bytes)
+    auto runLen = [&](uint32_t i) {
+      uint32_t len = 0;
+      if (row[i] == 0 || row[i] == 255) {
+        while (i+len < n && len < 64 && row[i+len] == row[i])
+          ++len;
+      }
+      return len;
+    };
+    auto copyLen = [&](uint32_t i) {
+      uint32_t len = 0;
+      if (prev) {
+        while (i+len < n && len < 64 && row[i+len] == prev[i+len])
+          ++len;
+      }
+      return len;
+    };
+
+    uint32_t i = 0;
+    while (i < n) {
+      const uint32_t run = runLen(i);
+      const uint32_t copy = copyLen(i);
+      if (copy >= 2 && copy > run) {
+        *d++ = RunCopy | (copy-1);
+        i += copy;
+      } else if (run > 0) {
+        // single bytes too, as they would split a literal anyway
+        *d++ = (row[i] == 0 ? RunZero : RunFull) | (run-1);
+        i += run;
+      } else {
+        // literals, until a run or copy of two or more bytes starts
+        uint32_t len = 1;
+        while (i+len < n && len < 64 && runLen(i+len) < 2 &&
+               copyLen(i+len) < 2)
+        { ++len; }
+        *d++ = RunLit | (len-1);
+        std::memcpy(d, row+i, len);
+        d += len;
+        i += len;
+      }
+    }
+  }
+  return d - dst;
+}
@@ -0,0 +1,117 @@
+//
+// Font
+// kernels.h
+//
+// Copyright (C) 2020 Gustavo C. Viegas.
+//
+
+#ifndef FONT_KERNELS_H
+#define FONT_KERNELS_H
+
+#include <cstdint>
+
+namespace kernels {
+
+/// Pixel processing routines, selected at runtime for the host CPU.
+///
+struct Table {
+  /// Box-filters two rows of '2*n' samples into 'n' pixels.
+  ///
+  void (*downsample)(const uint8_t* row0, const uint8_t* row1, uint8_t* dst,
+                     uint32_t n);
+
+  /// Thresholds 'n' pixels into bits (MSB first).
+  ///
+  void (*toA1)(const uint8_t* src, uint8_t* dst, uint32_t n);
+
+  /// Expands 'n' pixels into premultiplied white RGBA.
+  ///
+  void (*toRGBA8)(const uint8_t* src, uint8_t* dst, uint32_t n);
+
+  /// Maps 'n' pixels through a 256-entry table.
+  ///
+  void (*lookup)(const uint8_t* src, uint8_t* dst, uint32_t n,
+                 const uint8_t* lut);
+
+  /// Decodes 'n' coordinates from a stream of variable-length deltas.
+  ///
+  /// Each 'fmt' entry gives the size of a delta in bytes (0, 1 or 2), with
+  /// 'CoordPos' set if a 1-byte delta is positive. Deltas are accumulated
+  /// into 'dst'. 'src' must be readable for 3 bytes past the last delta.
+  /// Returns the length of the stream.
+  ///
+  uint32_t (*decodeCoords)(const uint8_t* src, const uint8_t* fmt,
+                           int16_t* dst, uint32_t n);
+
+  /// Blends 'n' pixels into 'dst' by taking the maximum.
+  ///
+  void (*blendMax)(uint8_t* dst, const uint8_t* src, uint32_t n);
+
+  /// Blends 'n' pixels into 'dst' by saturated addition.
+  ///
+  void (*blendAdd)(uint8_t* dst, const uint8_t* src, uint32_t n);
+
+  /// Sums the big-endian dwords of a table, whose length must be a
+  /// multiple of four.
+  ///
+  uint32_t (*checksum)(const uint8_t* data, uint32_t len);
+
+  /// Decodes 'h' rows of 'n' bytes packed by 'pack' (into 'len' bytes),
+  /// into rows that are 'pitch' bytes apart.
+  ///
+  void (*unpack)(const uint8_t* src, uint32_t len, uint8_t* dst, uint32_t n,
+                 uint16_t h, uint32_t pitch);
+
+  /// Sums four rows of 'n' values, weighted by 'wgt', into pixels (clamped
+  /// to [0, 255] and rounded to nearest even).
+  ///
+  void (*filterRows)(const float* const* rows, const float* wgt,
+                     uint8_t* dst, uint32_t n);
+
+  /// Counts the ASCII code units (below 0x80) that 'src' starts with, up
+  /// to 'n'.
+  ///
+  uint32_t (*asciiLen)(const char* src, uint32_t n);
+  uint32_t (*asciiLen16)(const char16_t* src, uint32_t n);
+};
+
+/// Sign bit of 'Table::decodeCoords' formats.
+///
+constexpr uint8_t CoordPos = 4;
+
+/// Kinds of packed tokens.
+///
+/// A token is a kind in the top two bits and a length less one in the low
+/// six bits. Literal tokens are followed by their bytes, and copy tokens
+/// repeat the bytes above them in the previous row.
+///
+constexpr uint8_t RunZero = 0x00;
+constexpr uint8_t RunFull = 0x40;
+constexpr uint8_t RunLit = 0x80;
+constexpr uint8_t RunCopy = 0xC0;
+
+/// Longest packing of 'h' rows of 'n' bytes.
+///
+constexpr uint32_t packBound(uint32_t n, uint16_t h) {
+  return (n + (n+63)/64) * h;
+}
+
+/// Packs 'h' rows of 'n' bytes, 'pitch' bytes apart, into runs of 0x00,
+/// runs of 0xFF, copies of the previous row and literals.
+///
+/// Returns the length of the packed rows.
+///
+uint32_t pack(const uint8_t* src, uint32_t n, uint16_t h, uint32_t pitch,
+              uint8_t* dst);
+
+/// Gets the kernel table for the host CPU.
+///
+const Table& get();
+
+/// Fills a gamma correction table.
+///
+void makeGammaLut(float gamma, uint8_t* lut);
+
+} // ns
+
+#endif // FONT_KERNELS_H
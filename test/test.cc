@@ -6,12 +6,25 @@
 //
 
 #include <iostream>
+#include <fstream>
 #include <vector>
+#include <algorithm>
 #include <cassert>
+#include <cstring>
+#include <cstdio>
+#include <cmath>
+#include <memory_resource>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include <yf/yf.h>
 
 #include "font.h"
+#include "kernels.h"
 
 void draw(const Glyph& glyph) {
   const auto gw = glyph.extent().first;
@@ -141,6 +154,1038 @@ void draw(const Glyph& glyph) {
   }
 }
 
+/// Pseudo-random bytes, the same on every run.
+///
+uint8_t randByte() {
+  static uint32_t seed = 1;
+  seed = seed * 1103515245 + 12345;
+  return seed >> 16;
+}
+
+void testKernels(Font& font) {
+  std::wcout << "\n\n~~Kernels~~\n\n";
+
+  const auto& kern = kernels::get();
+  for (const uint32_t n : {1, 7, 16, 31, 33, 64, 255, 517}) {
+    std::vector<uint8_t> row0(2*n), row1(2*n), src(n), dst(4*n);
+    std::generate(row0.begin(), row0.end(), randByte);
+    std::generate(row1.begin(), row1.end(), randByte);
+    std::generate(src.begin(), src.end(), randByte);
+
+    kern.downsample(row0.data(), row1.data(), dst.data(), n);
+    for (uint32_t i = 0; i < n; ++i)
+      assert(dst[i] == (row0[2*i] + row0[2*i+1] + row1[2*i] +
+                        row1[2*i+1]) / 4);
+
+    std::fill(dst.begin(), dst.end(), 0);
+    kern.toA1(src.data(), dst.data(), n);
+    for (uint32_t i = 0; i < n; ++i)
+      assert(((dst[i/8] >> (7-i%8)) & 1) == (src[i] >= 128));
+
+    kern.toRGBA8(src.data(), dst.data(), n);
+    for (uint32_t i = 0; i < n; ++i)
+      assert(std::count(&dst[4*i], &dst[4*i+4], src[i]) == 4);
+
+    uint8_t lut[256];
+    kernels::makeGammaLut(2.2f, lut);
+    assert(lut[0] == 0 && lut[255] == 255);
+    kern.lookup(src.data(), dst.data(), n, lut);
+    for (uint32_t i = 0; i < n; ++i)
+      assert(dst[i] == lut[src[i]]);
+  }
+
+  // other formats are converted from the same coverage
+  RenderOpts opts;
+  const auto a8 = font.getGlyph(L'g', 40, 72, opts);
+  opts.format = PixelFmt::A1;
+  const auto a1 = font.getGlyph(L'g', 40, 72, opts);
+  opts.format = PixelFmt::RGBA8;
+  const auto rgba = font.getGlyph(L'g', 40, 72, opts);
+  assert(a8->extent() == a1->extent() && a8->extent() == rgba->extent());
+  for (uint16_t y = 0; y < a8->extent().second; ++y) {
+    for (uint16_t x = 0; x < a8->extent().first; ++x) {
+      const uint8_t cov = a8->data()[y*a8->pitch()+x];
+      const uint8_t bit = a1->data()[y*a1->pitch()+x/8] >> (7-x%8) & 1;
+      assert(bit == (cov >= 128));
+      assert(rgba->data()[y*rgba->pitch()+4*x+3] == cov);
+    }
+  }
+
+  std::wcout << "kernels match the scalar definitions\n";
+}
+
+void testCoords() {
+  std::wcout << "\n\n~~Coords~~\n\n";
+
+  const auto& kern = kernels::get();
+  for (const uint32_t n : {1, 5, 8, 9, 24, 100, 1001}) {
+    std::vector<uint8_t> fmt(n), src(2*n+3);
+    for (auto& f : fmt) {
+      f = randByte() % 3;
+      if (f == 1 && randByte() & 1)
+        f |= kernels::CoordPos;
+    }
+    std::generate(src.begin(), src.end(), randByte);
+
+    std::vector<int16_t> dst(n);
+    const uint32_t len = kern.decodeCoords(src.data(), fmt.data(),
+                                           dst.data(), n);
+    int16_t acc = 0;
+    uint32_t off = 0;
+    for (uint32_t i = 0; i < n; ++i) {
+      if ((fmt[i] & 3) == 1) {
+        acc += (fmt[i] & kernels::CoordPos) ? src[off] : -src[off];
+      } else if ((fmt[i] & 3) == 2) {
+        acc += static_cast<int16_t>(src[off] << 8 | src[off+1]);
+      }
+      off += fmt[i] & 3;
+      assert(dst[i] == acc);
+    }
+    assert(len == off);
+  }
+
+  std::wcout << "coordinates decode as in the scalar definition\n";
+}
+
+void testMetrics(const std::string& pathname) {
+  std::wcout << "\n\n~~Metrics~~\n\n";
+
+  Font font{pathname};
+  const auto mtcs = font.getMetrics(L'H', 100);
+  const auto run = font.measure(L"HH", 100);
+  // metrics must not decode outlines
+  assert(font.memoryUsage().outlines == 0);
+
+  assert(mtcs.advance > 0.0f);
+  assert(mtcs.xMax > mtcs.xMin && mtcs.yMax > mtcs.yMin);
+  assert(std::fabs(mtcs.lsb + (mtcs.xMax-mtcs.xMin) + mtcs.rsb -
+                   mtcs.advance) < 0.01f);
+
+  const uint16_t indices[] = {font.getIndex(L'H'), font.getIndex(L'H')};
+  float adjs[2];
+  font.getKerning(indices, 2, adjs, 100);
+  assert(std::fabs(run.advance - 2.0f*mtcs.advance - adjs[0]) < 0.01f);
+  assert(run.xMin == mtcs.xMin && run.yMax == mtcs.yMax);
+
+  // the bitmap covers the bounds, to the pixel
+  const auto glyph = font.getGlyph(L'H', 100);
+  const auto ext = glyph->extent();
+  const auto brg = glyph->bearing();
+  assert(std::fabs(brg.first - mtcs.xMin) <= 1.0f);
+  assert(std::fabs(brg.second - mtcs.yMin) <= 1.0f);
+  assert(std::fabs(brg.first + ext.first - mtcs.xMax) <= 1.0f);
+  assert(std::fabs(brg.second + ext.second - mtcs.yMax) <= 1.0f);
+
+  std::wcout << "advance " << mtcs.advance << ", bounds " << mtcs.xMin <<
+    " " << mtcs.yMin << " " << mtcs.xMax << " " << mtcs.yMax << "\n";
+}
+
+void testRun(Font& font) {
+  std::wcout << "\n\n~~Run~~\n\n";
+
+  const std::wstring str = L"Wavy";
+  const auto run = font.renderRun(str, 40);
+  const auto mtcs = font.measure(str, 40);
+  const auto ext = run->extent();
+  assert(std::fabs(run->bearing().first - mtcs.xMin) <= 1.0f);
+  assert(std::fabs(ext.first - (mtcs.xMax-mtcs.xMin)) <= str.size());
+  assert(std::fabs(ext.second - (mtcs.yMax-mtcs.yMin)) <= 2.0f);
+
+  // each glyph is blended in at its pen position
+  const auto glyph = font.getGlyph(L'W', 40);
+  const int32_t dx = glyph->bearing().first - run->bearing().first;
+  const int32_t dy = glyph->bearing().second - run->bearing().second;
+  for (uint16_t y = 0; y < glyph->extent().second; ++y) {
+    for (uint16_t x = 0; x < glyph->extent().first; ++x)
+      assert(run->data()[(y+dy)*run->pitch()+x+dx] >=
+             glyph->data()[y*glyph->pitch()+x]);
+  }
+
+  // runs too long for one bitmap come back empty
+  const size_t n = 50000.0f / font.getMetrics(L'W', 72).advance;
+  const std::wstring longStr(2*n, L'W');
+  const auto longRun = font.renderRun(longStr, 72);
+  assert(font.measure(longStr, 72).advance > UINT16_MAX);
+  assert(longRun->extent().first == 0 && longRun->extent().second == 0);
+  const auto wideRun = font.renderRun(longStr.substr(0, n), 72);
+  assert(wideRun->extent().first > INT16_MAX);
+
+  std::wcout << "run extent is " << ext.first << "x" << ext.second << "\n";
+}
+
+/// Sets the class counts of the first class pair subtable of a font's
+/// 'GPOS' to their maximum, so that its values run past the table. The
+/// table checksum is updated to match.
+///
+/// Returns false if the font has no such subtable.
+///
+bool breakClassPairs(std::vector<char>& data) {
+  auto u16 = [&](size_t off) -> uint32_t {
+    if (off+2 > data.size())
+      return 0;
+    return uint8_t(data[off]) << 8 | uint8_t(data[off+1]);
+  };
+  auto u32 = [&](size_t off) { return u16(off) << 16 | u16(off+2); };
+
+  size_t ent = 0, gpos = 0;
+  for (uint32_t i = 0; i < u16(4); ++i) {
+    if (!std::memcmp(&data[12+16*i], "GPOS", 4)) {
+      ent = 12+16*i;
+      gpos = u32(ent+8);
+    }
+  }
+  if (gpos == 0)
+    return false;
+  const size_t lookList = gpos + u16(gpos+8);
+  for (uint32_t i = 0; i < u16(lookList); ++i) {
+    const size_t look = lookList + u16(lookList+2+2*i);
+    for (uint32_t j = 0; j < u16(look+4); ++j) {
+      size_t sub = look + u16(look+6+2*j);
+      if (u16(look) == 9 && u16(sub+2) == 2)
+        sub += u32(sub+4);
+      else if (u16(look) != 2)
+        continue;
+      if (u16(sub) == 2) {
+        data[sub+12] = data[sub+13] = data[sub+14] = data[sub+15] = '\xFF';
+        uint32_t sum = 0;
+        for (size_t k = 0; k < u32(ent+12); k += 4)
+          sum += u32(gpos+k);
+        for (size_t k = 0; k < 4; ++k)
+          data[ent+4+k] = sum >> (24-8*k);
+        return true;
+      }
+    }
+  }
+  return false;
+}
+
+void testKerning(Font& font, const std::string& pathname) {
+  std::wcout << "\n\n~~Kerning~~\n\n";
+
+  const std::wstring str = L"AVATAR WAVE To Ty LT Yo P. F, r. y, \"A\"";
+  std::vector<uint16_t> indices;
+  for (const auto chr : str)
+    indices.push_back(font.getIndex(chr));
+  std::vector<float> adjs(indices.size());
+  font.getKerning(indices.data(), indices.size(), adjs.data(), 1000);
+  assert(adjs.back() == 0.0f);
+
+  // batch adjustments match the pair spacing of 'measure'
+  size_t kerned = 0;
+  for (size_t i = 0; i+1 < str.size(); ++i) {
+    const auto pair = font.measure(str.substr(i, 2), 1000);
+    const float adv = font.getMetrics(str[i], 1000).advance +
+                      font.getMetrics(str[i+1], 1000).advance;
+    assert(std::fabs(pair.advance - adv - adjs[i]) < 0.01f);
+    kerned += adjs[i] != 0.0f;
+  }
+
+  std::wcout << kerned << " of " << str.size()-1 << " pairs kerned\n";
+
+  // a class pair subtable whose values run past the table is dropped,
+  // without allocating them
+  std::ifstream ifs(pathname, std::ios_base::binary);
+  std::vector<char> data{std::istreambuf_iterator<char>(ifs),
+                         std::istreambuf_iterator<char>()};
+  if (!breakClassPairs(data))
+    return;
+  const std::string bad = "/tmp/font-test-" + std::to_string(getpid()) +
+                          ".ttf";
+  std::ofstream(bad, std::ios_base::binary).write(data.data(), data.size());
+
+  // the broken subtable is dropped without allocating its values
+  {
+    Font broken{bad};
+    broken.getKerning(indices.data(), indices.size(), adjs.data(), 1000);
+    for (size_t i = 0; i+1 < str.size(); ++i) {
+      assert(std::isfinite(adjs[i]));
+      assert(broken.getMetrics(str[i], 1000).advance ==
+             font.getMetrics(str[i], 1000).advance);
+    }
+  }
+  assert(std::remove(bad.c_str()) == 0);
+  std::wcout << "broken class pairs dropped\n";
+}
+
+void testLazy(const std::string& pathname) {
+  std::wcout << "\n\n~~Lazy~~\n\n";
+
+  // tables are decoded on first use
+  Font font{pathname, true};
+  const auto before = font.memoryUsage();
+  assert(before.outlines == 0 && before.metrics == 0 && before.kerning == 0);
+  const uint16_t index = font.getIndex(L'a');
+  auto usage = font.memoryUsage();
+  assert(usage.cmap > before.cmap && usage.outlines == 0);
+  font.getIndexGlyph(index, 12);
+  usage = font.memoryUsage();
+  assert(usage.outlines != 0);
+
+  // the same glyphs come from a font loaded without verification
+  Font other{pathname};
+  const auto a = font.getGlyph(L'a', 30), b = other.getGlyph(L'a', 30);
+  assert(a->extent() == b->extent() && a->bearing() == b->bearing());
+  assert(!std::memcmp(a->data(), b->data(), a->pitch()*a->extent().second));
+
+  std::wcout << "tables decoded on first use\n";
+}
+
+/// Memory resource that counts the bytes it holds.
+///
+class CountingResource : public std::pmr::memory_resource {
+ public:
+  size_t held = 0;
+  size_t allocs = 0;
+
+ private:
+  void* do_allocate(size_t bytes, size_t align) {
+    held += bytes;
+    ++allocs;
+    return std::pmr::new_delete_resource()->allocate(bytes, align);
+  }
+  void do_deallocate(void* ptr, size_t bytes, size_t align) {
+    assert(held >= bytes);
+    held -= bytes;
+    std::pmr::new_delete_resource()->deallocate(ptr, bytes, align);
+  }
+  bool do_is_equal(const std::pmr::memory_resource& other) const noexcept {
+    return this == &other;
+  }
+};
+
+void testResources(const std::string& pathname) {
+  std::wcout << "\n\n~~Resources~~\n\n";
+
+  CountingResource fontMem, scratchMem;
+  {
+    Font font{pathname, false, &fontMem, &scratchMem};
+    const size_t tables = fontMem.held;
+    {
+      const auto glyph = font.getGlyph(L'&', 50);
+      const auto run = font.renderRun(L"pmr", 20);
+      assert(fontMem.held > tables);
+      // bitmaps are held by the scratch resource until released
+      assert(scratchMem.held >= glyph->pitch()*glyph->extent().second +
+                                run->pitch()*run->extent().second);
+    }
+    assert(scratchMem.held == 0);
+    std::wcout << "font memory " << fontMem.held << " bytes in " <<
+      fontMem.allocs << " allocations, scratch " << scratchMem.allocs <<
+      " allocations\n";
+  }
+  assert(fontMem.held == 0 && scratchMem.held == 0);
+
+  // instanced outlines are copied into the given resources too
+  const char* vfont = std::getenv("VFONT");
+  if (!vfont)
+    return;
+  CountingResource defaultMem;
+  {
+    Font vf{vfont, false, &fontMem, &scratchMem};
+    vf.setVariation({{('w' << 24) | ('g' << 16) | ('h' << 8) | 't', 800}});
+    const auto prev = std::pmr::set_default_resource(&defaultMem);
+    for (const auto chr : std::wstring{L"Variable \u00C5"})
+      vf.getGlyph(chr, 30);
+    vf.getGlyphs(L'&', {12, 24, 48}, 72, {}, true);
+    vf.renderRun(L"pmr", 20);
+    std::pmr::set_default_resource(prev);
+  }
+  assert(defaultMem.allocs == 0);
+  assert(fontMem.held == 0 && scratchMem.held == 0);
+}
+
+/// Checks whether two glyphs have the same bitmap.
+///
+bool sameGlyph(const Glyph& a, const Glyph& b) {
+  if (a.extent() != b.extent() || a.bearing() != b.bearing() ||
+      a.format() != b.format())
+  { return false; }
+  const uint32_t len = a.format() == PixelFmt::A1 ? (a.extent().first+7)/8 :
+                       a.format() == PixelFmt::RGBA8 ? a.extent().first*4 :
+                       a.extent().first;
+  for (uint16_t y = 0; y < a.extent().second; ++y) {
+    if (std::memcmp(a.data()+y*a.pitch(), b.data()+y*b.pitch(), len))
+      return false;
+  }
+  return true;
+}
+
+void testCompounds(Font& font) {
+  std::wcout << "\n\n~~Compounds~~\n\n";
+
+  // accented letters are usually compound glyphs
+  const std::wstring str = L"\u00C4\u00C5\u00C9\u00F1\u01FA";
+  std::vector<std::unique_ptr<Glyph>> glyphs;
+  for (const auto chr : str)
+    glyphs.push_back(font.getGlyph(chr, 60));
+  const size_t cached = font.memoryUsage().compounds;
+
+  // flattened once, then reused
+  for (size_t i = 0; i < str.size(); ++i)
+    assert(sameGlyph(*glyphs[i], *font.getGlyph(str[i], 60)));
+  assert(font.memoryUsage().compounds == cached);
+  font.trim(TrimLevel::Caches);
+  for (size_t i = 0; i < str.size(); ++i)
+    assert(sameGlyph(*glyphs[i], *font.getGlyph(str[i], 60)));
+
+  std::wcout << cached << " bytes of flattened compounds\n";
+}
+
+void testSizes(Font& font) {
+  std::wcout << "\n\n~~Sizes~~\n\n";
+
+  // the largest size is rendered exactly as alone - smaller ones use its
+  // finer curve flattening, which moves some edge pixels by a sample or
+  // two
+  const std::vector<uint16_t> pts = {9, 12, 16, 24, 36, 72, 150};
+  for (const bool parallel : {false, true}) {
+    const auto glyphs = font.getGlyphs(L'@', pts, 96, {}, parallel);
+    assert(glyphs.size() == pts.size());
+    assert(sameGlyph(*glyphs.back(), *font.getGlyph(L'@', pts.back(), 96)));
+    for (size_t i = 0; i+1 < pts.size(); ++i) {
+      const auto& a = *glyphs[i];
+      const auto b = font.getGlyph(L'@', pts[i], 96);
+      assert(a.extent() == b->extent() && a.bearing() == b->bearing());
+      uint32_t diffs = 0;
+      for (uint16_t y = 0; y < a.extent().second; ++y) {
+        for (uint16_t x = 0; x < a.extent().first; ++x) {
+          const int32_t d = a.data()[y*a.pitch()+x] -
+                            b->data()[y*b->pitch()+x];
+          assert(std::abs(d) <= 128);
+          diffs += d != 0;
+        }
+      }
+      assert(diffs <= uint32_t(a.extent().first + a.extent().second));
+    }
+  }
+
+  std::wcout << pts.size() << " sizes rendered from shared edges\n";
+}
+
+void testSharedCache(const std::string& pathname) {
+  std::wcout << "\n\n~~SharedCache~~\n\n";
+
+  const std::string name = "/font-test-" + std::to_string(getpid());
+  const std::wstring str = L"Shared glyphs";
+  SharedCache::unlink(name);
+
+  // two processes publish the same glyphs at once
+  std::vector<pid_t> pids;
+  for (int i = 0; i < 2; ++i) {
+    const pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+      SharedCache cache{name, 4 << 20, i == 1};
+      Font font{pathname};
+      font.setCache(&cache);
+      for (const auto chr : str)
+        font.getGlyph(chr, 33);
+      _exit(0);
+    }
+    pids.push_back(pid);
+  }
+  for (const auto pid : pids) {
+    int status;
+    assert(waitpid(pid, &status, 0) == pid);
+    assert(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+  }
+
+  // another process acquires them without rendering
+  {
+    SharedCache cache{name};
+    CountingResource scratchMem;
+    Font font{pathname, false, nullptr, &scratchMem};
+    Font plain{pathname};
+    font.setCache(&cache);
+    // loading tables and unpacking packed records are the only uses of
+    // scratch memory on hits
+    font.getGlyph(str[0], 33);
+    const size_t allocs = scratchMem.allocs;
+    const size_t held = scratchMem.held;
+    for (const auto chr : str) {
+      const auto glyph = font.getGlyph(chr, 33);
+      assert(sameGlyph(*glyph, *plain.getGlyph(chr, 33)));
+    }
+    assert(scratchMem.allocs <= allocs + str.size());
+    assert(scratchMem.held == held);
+  }
+  SharedCache::unlink(name);
+
+  // an object whose creator died before sizing it is replaced, and one
+  // that cannot be opened leaves fonts uncached
+  const int fd = shm_open(name.c_str(), O_RDWR | O_CREAT | O_EXCL, 0600);
+  assert(fd != -1);
+  close(fd);
+  for (const auto& nm : {name, name + "/bad"}) {
+    SharedCache cache{nm};
+    Font font{pathname};
+    Font plain{pathname};
+    font.setCache(&cache);
+    for (const auto chr : str)
+      assert(sameGlyph(*font.getGlyph(chr, 33), *plain.getGlyph(chr, 33)));
+  }
+  struct stat st;
+  const int fd2 = shm_open(name.c_str(), O_RDONLY, 0);
+  assert(fd2 != -1 && fstat(fd2, &st) == 0 && st.st_size != 0);
+  close(fd2);
+  SharedCache::unlink(name);
+
+  std::wcout << "glyphs shared by " << pids.size() << " processes\n";
+}
+
+void testPacked(const std::string& pathname) {
+  std::wcout << "\n\n~~Packed~~\n\n";
+
+  CountingResource scratchMem;
+  Font font{pathname, false, nullptr, &scratchMem};
+  size_t bytes = 0, packed = 0;
+  for (const wchar_t chr : {L'O', L'g', L'&', L'W', L'.'}) {
+    const auto glyph = font.getGlyph(chr, 40);
+    const PackedGlyph pack{*glyph};
+    assert(pack.extent() == glyph->extent());
+    assert(pack.bearing() == glyph->bearing());
+    bytes += glyph->pitch()*glyph->extent().second;
+    packed += pack.size();
+
+    // straight into a wider atlas
+    const uint32_t pitch = glyph->pitch() + 5;
+    std::vector<uint8_t> atlas(pitch*glyph->extent().second);
+    pack.unpack(atlas.data(), pitch);
+    for (uint16_t y = 0; y < glyph->extent().second; ++y)
+      assert(!std::memcmp(atlas.data()+y*pitch,
+                          glyph->data()+y*glyph->pitch(),
+                          glyph->extent().first));
+
+    // into a new glyph held by the given resource
+    CountingResource mem;
+    {
+      const auto copy = pack.unpack(&mem);
+      assert(sameGlyph(*copy, *glyph));
+      assert(mem.held >= copy->pitch()*copy->extent().second);
+    }
+    assert(mem.held == 0);
+  }
+  assert(packed < bytes);
+
+  // packed records of the shared cache are unpacked into scratch memory
+  const std::string name = "/font-test-packed-" + std::to_string(getpid());
+  SharedCache::unlink(name);
+  {
+    SharedCache cache{name, 1 << 20, true};
+    font.setCache(&cache);
+    font.getGlyph(L'@', 40);
+    const size_t allocs = scratchMem.allocs;
+    const size_t held = scratchMem.held;
+    {
+      const auto glyph = font.getGlyph(L'@', 40);
+      assert(scratchMem.allocs > allocs);
+      assert(scratchMem.held >= held + glyph->pitch()*glyph->extent().second);
+    }
+    assert(scratchMem.held == held);
+    font.setCache(nullptr);
+  }
+  SharedCache::unlink(name);
+
+  std::wcout << bytes << " bytes packed in " << packed << "\n";
+}
+
+void testMesh(Font& font) {
+  std::wcout << "\n\n~~Mesh~~\n\n";
+
+  // pixels that the rasterizer covers fully or not at all must agree with
+  // the mesh at their centers - the first pixel starts at the outline's
+  // minimum, and curve flattening may move edges by a fraction of a pixel,
+  // so only pixels whose neighbors match them must agree exactly
+  const uint16_t pts = 48;
+  const float em = pts;
+  size_t solid = 0, empty = 0, edge = 0, off = 0;
+  for (const wchar_t chr : {L'O', L'g', L'&', L'e', L'S', L'%'}) {
+    const auto mesh = font.getMesh(chr);
+    const auto glyph = font.getGlyph(chr, pts);
+    assert(glyph->format() == PixelFmt::A8);
+    const int32_t w = glyph->extent().first;
+    const int32_t h = glyph->extent().second;
+    auto pixel = [&](int32_t x, int32_t y) -> uint8_t {
+      if (x < 0 || y < 0 || x >= w || y >= h)
+        return 0;
+      return glyph->data()[y*glyph->pitch()+x];
+    };
+    for (int32_t y = 0; y < h; ++y) {
+      for (int32_t x = 0; x < w; ++x) {
+        const uint8_t pix = pixel(x, y);
+        if (pix != 0 && pix != 255)
+          continue;
+        bool deep = true;
+        for (int32_t j = y-1; j <= y+1; ++j) {
+          for (int32_t i = x-1; i <= x+1; ++i)
+            deep = deep && pixel(i, j) == pix;
+        }
+        const bool in = mesh.contains(mesh.xMin + (x+0.5f)/em,
+                                      mesh.yMin + (y+0.5f)/em);
+        if (deep) {
+          assert(in == (pix == 255));
+          ++(in ? solid : empty);
+        } else {
+          off += in != (pix == 255);
+          ++edge;
+        }
+      }
+    }
+  }
+  assert(off*50 <= edge);
+
+  std::wcout << solid << " solid and " << empty << " empty pixels, " <<
+    off << " of " << edge << " next to edges differ\n";
+}
+
+void testTiles(Font& font) {
+  std::wcout << "\n\n~~Tiles~~\n\n";
+
+  const uint16_t pts = 300;
+  size_t tiles = 0;
+  for (const wchar_t chr : {L'&', L'g', L'O'}) {
+    const auto full = font.getGlyph(chr, pts);
+    const auto brg = full->bearing();
+    const int32_t w = full->extent().first;
+    const int32_t h = full->extent().second;
+
+    // threads produce the same bitmap
+    RenderOpts opts;
+    opts.parallel = true;
+    assert(sameGlyph(*font.getGlyph(chr, pts, 72, opts), *full));
+
+    // each tile is a crop of the full bitmap, also when it sticks out
+    const int16_t step = 37;
+    for (int32_t y = brg.second - 10; y < brg.second + h; y += step) {
+      for (int32_t x = brg.first - 10; x < brg.first + w; x += step) {
+        opts = {};
+        opts.clip = {int16_t(x), int16_t(y), int16_t(x+step),
+                     int16_t(y+step)};
+        const auto tile = font.getGlyph(chr, pts, 72, opts);
+        const int32_t x0 = std::max<int32_t>(x, brg.first);
+        const int32_t y0 = std::max<int32_t>(y, brg.second);
+        const int32_t x1 = std::min<int32_t>(x+step, brg.first+w);
+        const int32_t y1 = std::min<int32_t>(y+step, brg.second+h);
+        assert(tile->extent().first == x1-x0);
+        assert(tile->extent().second == y1-y0);
+        assert(tile->bearing() == std::make_pair(int16_t(x0), int16_t(y0)));
+        for (int32_t j = y0; j < y1; ++j) {
+          const uint8_t* src = full->data() + (j-brg.second)*full->pitch() +
+                               (x0-brg.first);
+          const uint8_t* dst = tile->data() + (j-y0)*tile->pitch();
+          assert(!std::memcmp(src, dst, x1-x0));
+        }
+        ++tiles;
+      }
+    }
+
+    // nothing is rendered outside the glyph
+    opts.clip = {int16_t(brg.first+w), 0, int16_t(brg.first+w+10), 10};
+    const auto none = font.getGlyph(chr, pts, 72, opts);
+    assert(none->extent().first == 0 || none->extent().second == 0);
+  }
+
+  std::wcout << tiles << " tiles match their full bitmaps\n";
+}
+
+void testResample(const std::string& pathname) {
+  std::wcout << "\n\n~~Resample~~\n\n";
+
+  CountingResource fontMem;
+  std::pmr::monotonic_buffer_resource scratchMem;
+  Font font{pathname, false, &fontMem, &scratchMem};
+  RenderOpts opts;
+  opts.tolerance = 0.0005f;
+
+  // kept coverage outlives the scratch memory it was rendered in
+  assert(font.getGlyph(L'l', 40, 72, opts)->error() == 0.0f);
+  const size_t held = fontMem.held;
+  scratchMem.release();
+  float error;
+  {
+    const auto near = font.getGlyph(L'l', 43, 67, opts);
+    error = near->error();
+    assert(error > 0.0f);
+    assert(sameGlyph(*near, *font.getGlyph(L'l', 43, 67, opts)));
+    assert(fontMem.held == held);
+  }
+
+  // the oldest coverage is dropped once 16 MiB of bitmaps are kept
+  size_t kept = 0;
+  for (uint16_t pts = 1000; kept <= 20 << 20; pts += 10) {
+    const auto glyph = font.getGlyph(L'W', pts, 72, opts);
+    kept += glyph->pitch() * glyph->extent().second;
+    scratchMem.release();
+  }
+  assert(fontMem.held <= held + (16 << 20));
+  assert(font.getGlyph(L'l', 43, 67, opts)->error() == 0.0f);
+  scratchMem.release();
+
+  // resampled glyphs are shared too
+  const std::string name = "/font-test-resample-" + std::to_string(getpid());
+  SharedCache::unlink(name);
+  {
+    SharedCache cache{name, 4 << 20};
+    Font first{pathname}, second{pathname};
+    first.setCache(&cache);
+    second.setCache(&cache);
+    first.getGlyph(L'&', 40, 72, opts);
+    const auto near = first.getGlyph(L'&', 43, 67, opts);
+    assert(sameGlyph(*second.getGlyph(L'&', 43, 67, opts), *near));
+    assert(sameGlyph(*second.getGlyph(L'&', 43, 67),
+                     *Font{pathname}.getGlyph(L'&', 43, 67)));
+  }
+  SharedCache::unlink(name);
+
+  std::wcout << "error " << error << " px, " << fontMem.held - held <<
+    " bytes kept\n";
+}
+
+/// Maps UTF-8 and UTF-16 text, checking that both give the same glyphs.
+///
+std::vector<uint16_t> mapBoth(Font& font, const char* utf8,
+                              const std::u16string& utf16,
+                              std::vector<Unmapped>* missing = nullptr) {
+  const size_t len = std::strlen(utf8);
+  std::vector<uint16_t> indices(len), indices16(utf16.size());
+  std::vector<Unmapped> missing16;
+  indices.resize(font.mapText(utf8, len, indices.data(), missing));
+  indices16.resize(font.mapText(utf16.data(), utf16.size(),
+                                indices16.data(), &missing16));
+  assert(indices == indices16);
+  if (missing) {
+    assert(missing->size() == missing16.size());
+    for (size_t i = 0; i < missing16.size(); ++i)
+      assert((*missing)[i].pos == missing16[i].pos &&
+             (*missing)[i].chr == missing16[i].chr);
+  }
+  return indices;
+}
+
+void testMapText(Font& font) {
+  std::wcout << "\n\n~~MapText~~\n\n";
+
+  // ASCII
+  std::vector<Unmapped> missing;
+  const auto ascii = mapBoth(font, "Hello", u"Hello", &missing);
+  assert(ascii.size() == 5 && missing.empty());
+  assert(ascii[2] == ascii[3] && ascii[0] != ascii[1]);
+  assert(std::count(ascii.begin(), ascii.end(), 0) == 0);
+
+  // multibyte sequences
+  const auto multi = mapBoth(font, "a\xC3\xA9\xE2\x82\xAC" "a",
+                             u"a\u00E9\u20ACa");
+  assert(multi.size() == 4 && multi[0] == multi[3]);
+
+  // code points past U+FFFF, which map to index zero
+  missing.clear();
+  const auto astral = mapBoth(font, "x\xF0\x9F\x98\x80y",
+                              u"x\xD83D\xDE00y", &missing);
+  assert(astral.size() == 3 && astral[1] == 0);
+  assert(missing.size() == 1);
+  assert(missing[0].pos == 1 && missing[0].chr == U'\U0001F600');
+
+  // invalid sequences map to U+FFFD, one per sequence
+  const uint16_t repl = mapBoth(font, "\xEF\xBF\xBD", u"\uFFFD")[0];
+  const char* bad8[] = {"\x80", "\xC0\xAF", "\xED\xA0\x80", "\xF8",
+                        "\xF4\x90\x80\x80"};
+  for (const auto bad : bad8) {
+    uint16_t index;
+    assert(font.mapText(bad, std::strlen(bad), &index) == 1);
+    assert(index == repl);
+  }
+  // a sequence stops at the first unit that does not continue it
+  uint16_t cut[3];
+  assert(font.mapText("\xE2\x82o", 3, cut) == 2);
+  assert(cut[0] == repl && cut[1] == ascii[4]);
+  const char16_t bad16[][2] = {{0xDC00, u'o'}, {0xD800, u'o'}};
+  for (const auto& bad : bad16) {
+    uint16_t indices[2];
+    assert(font.mapText(bad, 2, indices) == 2);
+    assert(indices[0] == repl && indices[1] == ascii[4]);
+  }
+  const char16_t high = 0xD83D;
+  uint16_t index;
+  assert(font.mapText(&high, 1, &index) == 1 && index == repl);
+
+  std::wcout << "U+FFFD maps to " << repl << "\n";
+}
+
+void testFontSet(const std::string& pathname) {
+  std::wcout << "\n\n~~FontSet~~\n\n";
+
+  const char* fallback = std::getenv("FALLBACK");
+  FontSet set{{pathname, fallback ? fallback : pathname}};
+  assert(set.size() == 2);
+
+  // each character comes from the first font that maps it
+  const std::u16string text = u"Az\u00E9\u03A9\u0416\u2192\u2500\u25A0"
+                              u"\uE000\uFFFD\xD83D\xDE00";
+  std::vector<uint16_t> indices(text.size());
+  std::vector<uint8_t> fonts(text.size());
+  std::vector<Unmapped> missing;
+  const size_t n = set.mapText(text.data(), text.size(), indices.data(),
+                               fonts.data(), &missing);
+  assert(n == text.size()-1);
+  size_t fallen = 0, unmapped = 0;
+  for (size_t i = 0; i < n; ++i) {
+    const char32_t chr = i < n-1 ? char32_t(text[i]) : U'\U0001F600';
+    uint16_t own[2] = {};
+    for (size_t k = 0; k < 2 && chr <= 0xFFFF; ++k)
+      set.font(k).mapText(&text[i], 1, &own[k]);
+    const uint8_t face = own[0] != 0 ? 0 : own[1] != 0 ? 1 : 0;
+    assert(set.select(chr) == face);
+    assert(fonts[i] == face && indices[i] == own[face]);
+    if (indices[i] == 0) {
+      assert(std::any_of(missing.begin(), missing.end(), [&](auto& m) {
+        return m.pos == i && m.chr == chr;
+      }));
+      ++unmapped;
+      continue;
+    }
+    fallen += face;
+    assert(sameGlyph(*set.getGlyph(chr, 24),
+                     *set.font(face).getGlyph(chr, 24)));
+  }
+  assert(missing.size() == unmapped);
+
+  // UTF-8 gives the same mapping
+  const char* utf8 = "Az\xC3\xA9\xCE\xA9\xD0\x96\xE2\x86\x92\xE2\x94\x80"
+                     "\xE2\x96\xA0\xEE\x80\x80\xEF\xBF\xBD"
+                     "\xF0\x9F\x98\x80";
+  std::vector<uint16_t> indices8(std::strlen(utf8));
+  std::vector<uint8_t> fonts8(indices8.size());
+  assert(set.mapText(utf8, indices8.size(), indices8.data(),
+                     fonts8.data()) == n);
+  assert(std::equal(indices.begin(), indices.begin()+n, indices8.begin()));
+  assert(std::equal(fonts.begin(), fonts.begin()+n, fonts8.begin()));
+
+  // every font of the set allocates from the given resources
+  CountingResource fontMem, scratchMem;
+  {
+    FontSet own{{pathname, fallback ? fallback : pathname}, false, &fontMem,
+                &scratchMem};
+    const auto glyph = own.getGlyph(L'A', 24);
+    assert(sameGlyph(*glyph, *set.getGlyph(L'A', 24)));
+    assert(fontMem.held > 0 && scratchMem.held > 0);
+  }
+  assert(fontMem.held == 0 && scratchMem.held == 0);
+
+  std::wcout << fallen << " of " << n << " characters from the fallback, " <<
+    unmapped << " unmapped\n";
+}
+
+void testCompiled(Font& font) {
+  std::wcout << "\n\n~~Compiled~~\n\n";
+
+  const std::string pathname = "/tmp/font-test-" + std::to_string(getpid()) +
+                               ".cfnt";
+  font.compile(pathname);
+
+  // the format is little-endian on any host
+  char magic[8] = {};
+  std::ifstream ifs(pathname, std::ios_base::binary);
+  ifs.read(magic, sizeof magic);
+  assert(ifs && !std::memcmp(magic, "FFONTCO1", sizeof magic));
+
+  size_t glyphs = 0;
+  {
+    Font comp{pathname, true};
+    const std::u16string text = u"Compiled fonts: AVAWAY \u00E9\u00DF&@";
+    for (const auto chr : text) {
+      const auto a = font.getMetrics(chr, 30);
+      const auto b = comp.getMetrics(chr, 30);
+      assert(a.advance == b.advance && a.lsb == b.lsb && a.rsb == b.rsb &&
+             a.xMin == b.xMin && a.yMin == b.yMin && a.xMax == b.xMax &&
+             a.yMax == b.yMax);
+      assert(sameGlyph(*font.getGlyph(chr, 30), *comp.getGlyph(chr, 30)));
+      ++glyphs;
+    }
+    std::vector<uint16_t> a(text.size()), b(text.size());
+    assert(font.mapText(text.data(), text.size(), a.data()) ==
+           comp.mapText(text.data(), text.size(), b.data()));
+    assert(a == b);
+    assert(sameGlyph(*font.renderRun(L"AVAWAY To", 30),
+                     *comp.renderRun(L"AVAWAY To", 30)));
+  }
+  assert(std::remove(pathname.c_str()) == 0);
+
+  std::wcout << glyphs << " glyphs the same when compiled\n";
+}
+
+void testTrim(const std::string& pathname) {
+  std::wcout << "\n\n~~Trim~~\n\n";
+
+  Font font{pathname};
+  RenderOpts opts;
+  opts.tolerance = 0.1f;
+  const std::wstring str = L"Trim \u00E9\u00C5\u00FC AVAW";
+  std::vector<std::unique_ptr<Glyph>> glyphs;
+  auto render = [&] {
+    glyphs.clear();
+    for (const auto chr : str) {
+      glyphs.push_back(font.getGlyph(chr, 30, 72, opts));
+      glyphs.push_back(font.getGlyph(chr, 31, 72, opts));
+    }
+    glyphs.push_back(font.renderRun(str, 20));
+  };
+  auto sum = [](const MemoryUsage& u) {
+    return u.cmap + u.outlines + u.metrics + u.kerning + u.compounds +
+           u.sized + u.variations + u.mapped;
+  };
+  auto same = [&](const std::vector<std::unique_ptr<Glyph>>& other) {
+    assert(other.size() == glyphs.size());
+    for (size_t i = 0; i < glyphs.size(); ++i)
+      assert(sameGlyph(*glyphs[i], *other[i]));
+  };
+
+  render();
+  const auto full = font.memoryUsage();
+  assert(full.total == sum(full));
+  assert(full.outlines != 0 && full.metrics != 0 && full.sized != 0);
+  const auto first = std::move(glyphs);
+
+  // caches are dropped, and rebuilt with the same glyphs
+  font.trim(TrimLevel::Caches);
+  auto usage = font.memoryUsage();
+  assert(usage.total == sum(usage));
+  assert(usage.sized < full.sized && usage.compounds <= full.compounds);
+  assert(usage.outlines == full.outlines && usage.metrics == full.metrics);
+  render();
+  same(first);
+
+  // tables are decoded again when next used
+  font.trim(TrimLevel::Tables);
+  usage = font.memoryUsage();
+  assert(usage.total == sum(usage) && usage.total < full.total);
+  assert(usage.outlines < full.outlines && usage.metrics < full.metrics);
+  assert(usage.sized < full.sized);
+  render();
+  same(first);
+  assert(font.memoryUsage().outlines == full.outlines);
+
+  std::wcout << full.total << " bytes trimmed to " << usage.total << "\n";
+}
+
+/// Sums the coverage of a glyph.
+///
+uint64_t inkOf(const Glyph& glyph) {
+  uint64_t ink = 0;
+  for (uint16_t y = 0; y < glyph.extent().second; ++y) {
+    for (uint16_t x = 0; x < glyph.extent().first; ++x)
+      ink += glyph.data()[y*glyph.pitch()+x];
+  }
+  return ink;
+}
+
+void testStyles(Font& font) {
+  std::wcout << "\n\n~~Styles~~\n\n";
+
+  const uint16_t pts = 40;
+  const auto plain = font.getGlyph(L'H', pts);
+  const auto plainExt = plain->extent();
+
+  // emboldening widens by a fraction of the em, half on each side
+  RenderOpts bold;
+  bold.embolden = 0.04f;
+  const auto thick = font.getGlyph(L'H', pts, 72, bold);
+  const float grow = bold.embolden * pts;
+  assert(std::abs(thick->extent().first - plainExt.first - grow) <= 2.0f);
+  assert(thick->bearing().first <= plain->bearing().first);
+  assert(inkOf(*thick) > inkOf(*plain));
+
+  // slanting shears right about the baseline
+  RenderOpts oblique;
+  oblique.slant = 0.2f;
+  const auto leaning = font.getGlyph(L'H', pts, 72, oblique);
+  assert(leaning->extent().second == plainExt.second);
+  assert(std::abs(leaning->extent().first - plainExt.first -
+                  oblique.slant*plainExt.second) <= 2.0f);
+  assert(std::abs(leaning->bearing().first - plain->bearing().first) <= 1);
+
+  // runs advance by the extra width of each glyph
+  const std::wstring str = L"HHHHHHHH";
+  const auto run = font.renderRun(str, pts);
+  const auto boldRun = font.renderRun(str, pts, 72, bold);
+  const float runGrow = boldRun->extent().first - run->extent().first;
+  assert(std::abs(runGrow - grow*str.size()) <= 2.0f);
+
+  // several sizes at once are styled the same
+  const auto sizes = font.getGlyphs(L'H', {20, pts}, 72, bold);
+  assert(sameGlyph(*sizes[1], *thick));
+
+  // styled glyphs leave unstyled ones as they were
+  assert(sameGlyph(*font.getGlyph(L'H', pts), *plain));
+  RenderOpts none;
+  none.embolden = 0.0f;
+  none.slant = 0.0f;
+  assert(sameGlyph(*font.getGlyph(L'H', pts, 72, none), *plain));
+  assert(sameGlyph(*font.renderRun(str, pts), *run));
+
+  std::wcout << "bold run " << runGrow << " px wider\n";
+}
+
+void testVariations(Font& font) {
+  std::wcout << "\n\n~~Variations~~\n\n";
+
+  constexpr uint32_t Wght = ('w' << 24) | ('g' << 16) | ('h' << 8) | 't';
+
+  // other fonts have no axes, and ignore variations
+  const auto plain = font.getGlyph(L'a', 30);
+  if (font.axes().empty()) {
+    font.setVariation({{Wght, 700.0f}});
+    assert(sameGlyph(*font.getGlyph(L'a', 30), *plain));
+    font.setVariation({});
+  }
+
+  // a variable font can be given in VFONT
+  const char* vfont = std::getenv("VFONT");
+  if (!vfont) {
+    std::wcout << "no variable font\n";
+    return;
+  }
+  CountingResource fontMem;
+  {
+    Font vf{vfont, false, &fontMem};
+    const auto axes = vf.axes();
+    const auto wght = std::find_if(axes.begin(), axes.end(),
+                                   [&](auto& a) { return a.tag == Wght; });
+    assert(wght != axes.end());
+    const auto regular = vf.getGlyph(L'a', 30);
+
+    // instanced glyphs are held by the font's resource
+    const size_t allocs = fontMem.allocs;
+    vf.setVariation({{Wght, wght->max}});
+    const auto heavy = vf.getGlyph(L'a', 30);
+    assert(!sameGlyph(*heavy, *regular));
+    assert(fontMem.allocs > allocs);
+    vf.setVariation({});
+    assert(sameGlyph(*vf.getGlyph(L'a', 30), *regular));
+
+    // a compiled instance does not share cached glyphs with the default
+    const std::string name = "/font-test-vf-" + std::to_string(getpid());
+    const std::string pathname = "/tmp" + name + ".cfnt";
+    SharedCache::unlink(name);
+    {
+      SharedCache cache{name, 1 << 20};
+      vf.setCache(&cache);
+      vf.getGlyph(L'a', 30);
+      vf.setVariation({{Wght, wght->max}});
+      vf.compile(pathname);
+      vf.setVariation({});
+      vf.setCache(nullptr);
+      Font inst{pathname};
+      inst.setCache(&cache);
+      assert(sameGlyph(*inst.getGlyph(L'a', 30), *heavy));
+    }
+    SharedCache::unlink(name);
+    assert(std::remove(pathname.c_str()) == 0);
+  }
+  assert(fontMem.held == 0);
+
+  std::wcout << "instances rendered and compiled\n";
+}
+
 int main(int argc, char* argv[]) {
   std::wcout << "[Font] test\n\n";
   for (int i = 0; i < argc; ++i)
@@ -151,7 +1196,28 @@ int main(int argc, char* argv[]) {
   const uint16_t pts = argc > 2 ? std::atoi(argv[2]) : 144;
 
   try {
-    Font font{std::getenv("FONT")};
+    const std::string pathname = std::getenv("FONT");
+    Font font{pathname};
+    testKernels(font);
+    testCoords();
+    testMetrics(pathname);
+    testRun(font);
+    testKerning(font, pathname);
+    testLazy(pathname);
+    testResources(pathname);
+    testCompounds(font);
+    testSizes(font);
+    testSharedCache(pathname);
+    testPacked(pathname);
+    testMesh(font);
+    testTiles(font);
+    testResample(pathname);
+    testMapText(font);
+    testFontSet(pathname);
+    testCompiled(font);
+    testTrim(pathname);
+    testStyles(font);
+    testVariations(font);
     auto glyph = font.getGlyph(chr, pts);
     draw(*glyph);
   } catch (...) {
@@ -0,0 +1,119 @@
+//
+// Font
+// fontc.cc
+//
+// Copyright (C) 2020 Gustavo C. Viegas.
+//
+
+#include <iostream>
+#include <vector>
+#include <set>
+#include <cstring>
+
+#include "font.h"
+
+namespace {
+
+/// Sizes at which glyphs of the compiled font are compared.
+///
+constexpr uint16_t Sizes[] = {9, 12, 16, 24, 48, 96};
+
+/// Checks whether two glyphs have the same bitmap.
+///
+bool same(const Glyph& a, const Glyph& b) {
+  if (a.extent() != b.extent() || a.bearing() != b.bearing() ||
+      a.format() != b.format())
+  { return false; }
+  const auto w = a.extent().first;
+  const auto h = a.extent().second;
+  for (uint32_t y = 0; y < h; ++y) {
+    if (std::memcmp(a.data() + y*a.pitch(), b.data() + y*b.pitch(), w) != 0)
+      return false;
+  }
+  return true;
+}
+
+/// Checks whether two fonts map, measure and render every character of
+/// the BMP the same way.
+///
+/// Returns the number of mismatches.
+///
+size_t compare(Font& font, Font& comp) {
+  std::u16string text;
+  for (char32_t chr = 1; chr < 0x10000; ++chr) {
+    if (chr < 0xD800 || chr > 0xDFFF)
+      text.push_back(chr);
+  }
+  std::vector<uint16_t> fontIdx(text.size());
+  std::vector<uint16_t> compIdx(text.size());
+  font.mapText(text.data(), text.size(), fontIdx.data());
+  comp.mapText(text.data(), text.size(), compIdx.data());
+
+  size_t errN = 0;
+  if (fontIdx != compIdx) {
+    std::wcerr << "cmap differs\n";
+    ++errN;
+  }
+
+  std::set<uint16_t> indices(fontIdx.begin(), fontIdx.end());
+  for (const auto index : indices) {
+    for (const auto pts : Sizes) {
+      const auto m1 = font.getIndexMetrics(index, pts);
+      const auto m2 = comp.getIndexMetrics(index, pts);
+      if (std::memcmp(&m1, &m2, sizeof m1) != 0) {
+        std::wcerr << "metrics of glyph " << index << " differ at " << pts
+                   << " pts\n";
+        ++errN;
+      }
+      const auto g1 = font.getIndexGlyph(index, pts);
+      const auto g2 = comp.getIndexGlyph(index, pts);
+      if (!same(*g1, *g2)) {
+        std::wcerr << "glyph " << index << " differs at " << pts << " pts\n";
+        ++errN;
+      }
+    }
+  }
+
+  std::vector<uint16_t> run(indices.begin(), indices.end());
+  std::vector<float> adjs1(run.size()), adjs2(run.size());
+  font.getKerning(run.data(), run.size(), adjs1.data(), 12);
+  comp.getKerning(run.data(), run.size(), adjs2.data(), 12);
+  if (adjs1 != adjs2) {
+    std::wcerr << "kerning differs\n";
+    ++errN;
+  }
+  return errN;
+}
+
+} // ns
+
+/// Compiles a TrueType font.
+///
+/// With '-c', the compiled font is loaded back and compared with the
+/// original.
+///
+int main(int argc, char* argv[]) {
+  bool check = false;
+  int arg = 1;
+  if (arg < argc && std::strcmp(argv[arg], "-c") == 0) {
+    check = true;
+    ++arg;
+  }
+  if (argc - arg != 2) {
+    std::wcerr << "usage: fontc [-c] <font.ttf> <output>\n";
+    return 2;
+  }
+
+  Font font{argv[arg], true};
+  font.compile(argv[arg+1]);
+  if (!check)
+    return 0;
+
+  Font comp{argv[arg+1], true};
+  const size_t errN = compare(font, comp);
+  if (errN != 0) {
+    std::wcerr << errN << " mismatches\n";
+    return 1;
+  }
+  return 0;
+}